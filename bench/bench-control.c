@@ -0,0 +1,116 @@
+#include "bench.h"
+
+#include "control.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Answer every command right away, standing in for a running waydraw. This
+// keeps going until the benchmarks exit.
+static void *serve(void *data)
+{
+  (void)data;
+
+  struct pollfd fd = { .fd = control_fd(), .events = POLLIN };
+  for(;;)
+  {
+    if(poll(&fd, 1, -1) < 0 && errno != EINTR)
+      return NULL;
+
+    struct control_message message;
+    while(read_command(&message))
+      reply_command(CONTROL_STATUS_OK, NULL, 0);
+  }
+}
+
+// What a hotkey costs on top of spawning a process, if anything.
+static void bench_roundtrip(struct bench *bench, void *data)
+{
+  const char *path = data;
+  struct control_message message = { .command = CONTROL_COMMAND_RESUME };
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+    if(send_command(path, &message, NULL, 0, NULL) != CONTROL_STATUS_OK)
+    {
+      fprintf(stderr, "error: failed to send command: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  bench_stop(bench);
+}
+
+// What a hotkey costs, running either waydraw-ctl or waydraw itself, which is
+// how waydraw used to be woken up.
+static void bench_spawn(struct bench *bench, void *data)
+{
+  char **argv = data;
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    pid_t pid;
+    int status;
+    if(posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      fprintf(stderr, "error: failed to run %s\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  bench_stop(bench);
+}
+
+void bench_control(void)
+{
+  // Nothing here has anything to do with the resolution.
+  const struct bench_resolution *resolution = &bench_resolutions[0];
+  if(!bench_enabled("control", "roundtrip", resolution) && !bench_enabled("control", "waydraw-ctl", resolution) && !bench_enabled("control", "relaunch", resolution))
+    return;
+
+  // Become the running instance, in a directory of our own so as to not get
+  // in the way of a waydraw that is actually running.
+  char directory[] = "/tmp/waydraw-bench-XXXXXX";
+  if(!mkdtemp(directory))
+  {
+    fprintf(stderr, "error: failed to create temporary directory: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  setenv("XDG_RUNTIME_DIR", directory, 1);
+  setenv("WAYLAND_DISPLAY", "bench", 1);
+  unsetenv("WAYDRAW_DISPLAY");
+  try_resume();
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, &serve, NULL);
+  pthread_detach(thread);
+
+  char *path = control_path();
+  bench_run("control", "roundtrip", resolution, &bench_roundtrip, path);
+
+  // Both are set by meson benchmark.
+  char *ctl = getenv("WAYDRAW_BENCH_CTL");
+  if(ctl)
+    bench_run("control", "waydraw-ctl", resolution, &bench_spawn, (char *[]){ ctl, "wake", NULL });
+
+  char *waydraw = getenv("WAYDRAW_BENCH_WAYDRAW");
+  if(waydraw)
+    bench_run("control", "relaunch", resolution, &bench_spawn, (char *[]){ waydraw, NULL });
+
+  char lock_path[sizeof directory + 64];
+  snprintf(lock_path, sizeof lock_path, "%s.lock", path);
+  unlink(lock_path);
+  unlink(path);
+  rmdir(directory);
+  free(path);
+}
@@ -0,0 +1,357 @@
+// Benchmarks for what happens on every pointer frame while drawing: updating
+// the preview on the seat layer, and compositing the damaged part of the
+// output into a shm buffer the same way as update_output() does. The
+// compositing kernels are also compared against cairo on their own.
+
+#include "bench.h"
+#include "fake-wayland.h"
+
+#include "blend.h"
+#include "canvas.h"
+#include "command.h"
+#include "filter.h"
+#include "swapchain.h"
+
+#include <cairo.h>
+
+#include <math.h>
+
+static const double COLOR[4] = { 1.0, 0.0, 0.0, 1.0 };
+static const double WEIGHT = 8.0;
+
+// A pointer sending 8000 positions per second to outputs refreshing at 144Hz.
+#define HIGH_RATE_POSITIONS_PER_FRAME 55
+
+// Position of the pointer after a number of pointer frames, scribbling all
+// over the output.
+static void pointer_position(const struct bench_resolution *resolution, double frame, double *x, double *y)
+{
+  double t = frame * 0.01;
+  *x = resolution->width * (0.5 + 0.4 * sin(3.0 * t));
+  *y = resolution->height * (0.5 + 0.4 * sin(2.0 * t));
+}
+
+static uint64_t region_bytes(const cairo_region_t *region)
+{
+  uint64_t bytes = 0;
+
+  int n = cairo_region_num_rectangles(region);
+  for(int i=0; i<n; ++i)
+  {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(region, i, &rect);
+    bytes += (uint64_t)rect.width * rect.height * 4;
+  }
+  return bytes;
+}
+
+struct preview_config
+{
+  const struct bench_resolution *resolution;
+  enum waydraw_mode mode;
+  double size; // of the box to scribble in, or 0 for the whole output
+};
+
+// Bytes per operation is the size of the damage, which is what has to be
+// composited afterward.
+static void bench_preview(struct bench *bench, void *data)
+{
+  const struct preview_config *config = data;
+  const struct bench_resolution *resolution = config->resolution;
+
+  cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, resolution->width, resolution->height);
+  cairo_t *cairo = cairo_create(layer);
+
+  struct command command;
+  command_init(&command, config->mode, COLOR, WEIGHT);
+  command_setup(&command, cairo);
+
+  cairo_region_t *damage = cairo_region_create();
+  uint64_t bytes = 0;
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    double x, y;
+    pointer_position(resolution, i, &x, &y);
+    if(config->size != 0.0)
+    {
+      x = resolution->width * 0.5 + (x / resolution->width - 0.5) * config->size;
+      y = resolution->height * 0.5 + (y / resolution->height - 0.5) * config->size;
+    }
+    command_add_point(&command, x, y);
+    command_preview(&command, cairo, damage);
+
+    bench_stop(bench);
+    bytes += region_bytes(damage);
+    cairo_region_destroy(damage);
+    damage = cairo_region_create();
+    bench_start(bench);
+  }
+  bench_stop(bench);
+
+  bench->bytes = bytes / bench->iterations;
+
+  cairo_region_destroy(damage);
+  command_release(&command);
+  cairo_destroy(cairo);
+  cairo_surface_destroy(layer);
+}
+
+struct high_rate_config
+{
+  const struct bench_resolution *resolution;
+  bool filter;
+  enum command_smoothing smoothing;
+};
+
+// Each operation is a position sent by a high rate pointer, which moves 64
+// times slower than in bench_preview(), and is either drawn right away or goes
+// through the input filter, which is flushed once per frame the same way as
+// update_outputs() does. Bytes per operation is the size of the damage.
+static void bench_high_rate(struct bench *bench, void *data)
+{
+  const struct high_rate_config *config = data;
+  const struct bench_resolution *resolution = config->resolution;
+
+  cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, resolution->width, resolution->height);
+  cairo_t *cairo = cairo_create(layer);
+
+  struct command command;
+  command_init(&command, WAYDRAW_MODE_BRUSH, COLOR, WEIGHT);
+  command.smoothing = config->smoothing;
+  command_setup(&command, cairo);
+
+  struct filter filter;
+  filter_init(&filter);
+
+  cairo_region_t *damage = cairo_region_create();
+  uint64_t bytes = 0;
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    double x, y;
+    pointer_position(resolution, i / 64.0, &x, &y);
+    if(config->filter)
+      filter_add(&filter, &command, x, y);
+    else
+      command_add_point(&command, x, y);
+
+    bool frame = (i + 1) % HIGH_RATE_POSITIONS_PER_FRAME == 0;
+    if(frame && config->filter)
+      filter_flush(&filter, &command);
+
+    command_preview(&command, cairo, damage);
+
+    if(frame)
+    {
+      bench_stop(bench);
+      bytes += region_bytes(damage);
+      cairo_region_destroy(damage);
+      damage = cairo_region_create();
+      bench_start(bench);
+    }
+  }
+  bench_stop(bench);
+
+  bench->bytes = (bytes + region_bytes(damage)) / bench->iterations;
+
+  cairo_region_destroy(damage);
+  command_release(&command);
+  cairo_destroy(cairo);
+  cairo_surface_destroy(layer);
+}
+
+struct composite_config
+{
+  const struct bench_resolution *resolution;
+  bool full; // damage the whole output instead of the area around a stroke
+};
+
+static void bench_composite(struct bench *bench, void *data)
+{
+  const struct composite_config *config = data;
+  const struct bench_resolution *resolution = config->resolution;
+  uint32_t width = resolution->width;
+  uint32_t height = resolution->height;
+
+  struct wl_shm *wl_shm = (struct wl_shm *)fake_proxy_create(&wl_shm_interface, 1);
+  struct swapchain *swapchain = swapchain_new(wl_shm, width, height);
+
+  // A canvas with something in every tile, and a seat layer with a stroke in
+  // progress.
+  cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  cairo_t *cairo = cairo_create(layer);
+  cairo_set_source_rgba(cairo, 0.0, 0.0, 1.0, 0.5);
+  cairo_paint(cairo);
+  cairo_destroy(cairo);
+
+  struct canvas *canvas = canvas_new(width, height);
+  cairo_rectangle_int_t bounds = { 0, 0, width, height };
+  canvas_composite(canvas, layer, 0, 0, &bounds);
+
+  cairo = cairo_create(layer);
+  cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(cairo);
+  cairo_destroy(cairo);
+
+  struct command command;
+  command_init(&command, WAYDRAW_MODE_BRUSH, COLOR, WEIGHT);
+  for(uint64_t i=0; i<64; ++i)
+  {
+    double x, y;
+    pointer_position(resolution, i, &x, &y);
+    command_add_point(&command, x, y);
+  }
+
+  cairo = cairo_create(layer);
+  command_render(&command, cairo);
+  cairo_destroy(cairo);
+  command_release(&command);
+
+  cairo_rectangle_int_t rect = bounds;
+  if(!config->full)
+    rect = (cairo_rectangle_int_t){ width / 2 - 128, height / 2 - 128, 256, 256 };
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    struct swapchain_buffer *buffer = swapchain_acquire(swapchain);
+
+    cairo_region_t *damage = cairo_region_create_rectangle(&rect);
+    swapchain_damage(swapchain, damage);
+    cairo_region_destroy(damage);
+
+    canvas_decompress(canvas, buffer->damage);
+    canvas_paint(canvas, buffer->cairo_surface, buffer->damage);
+    blend_over(buffer->cairo_surface, layer, 0, 0, buffer->damage);
+
+    cairo_region_destroy(buffer->damage);
+    buffer->damage = cairo_region_create();
+
+    // The compositor is done with the buffer right away.
+    fake_buffer_release(buffer->wl_buffer);
+  }
+  bench_stop(bench);
+
+  bench->bytes = (uint64_t)rect.width * rect.height * 4;
+
+  canvas_destroy(canvas);
+  cairo_surface_destroy(layer);
+  swapchain_destroy(swapchain);
+  wl_proxy_destroy((struct wl_proxy *)wl_shm);
+}
+
+struct blend_config
+{
+  const struct bench_resolution *resolution;
+  bool cairo; // composite with cairo instead of the selected kernels
+};
+
+// A seat layer with a translucent stroke over half of it, which is otherwise
+// fully transparent, composited onto a whole output.
+static void bench_blend(struct bench *bench, void *data)
+{
+  const struct blend_config *config = data;
+  const struct bench_resolution *resolution = config->resolution;
+  uint32_t width = resolution->width;
+  uint32_t height = resolution->height;
+
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+
+  cairo_t *cairo = cairo_create(layer);
+  cairo_set_source_rgba(cairo, 0.0, 1.0, 0.0, 0.5);
+  cairo_rectangle(cairo, 0, 0, width / 2, height);
+  cairo_fill(cairo);
+  cairo_destroy(cairo);
+
+  cairo = cairo_create(surface);
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+    if(config->cairo)
+    {
+      cairo_set_source_surface(cairo, layer, 0.0, 0.0);
+      cairo_paint(cairo);
+      cairo_surface_flush(surface);
+    }
+    else
+      blend_over(surface, layer, 0, 0, NULL);
+  bench_stop(bench);
+  cairo_destroy(cairo);
+
+  bench->bytes = (uint64_t)width * height * 4;
+
+  cairo_surface_destroy(layer);
+  cairo_surface_destroy(surface);
+}
+
+void bench_render(void)
+{
+  static const struct
+  {
+    const char *name;
+    enum waydraw_mode mode;
+  } modes[] = {
+    { "brush", WAYDRAW_MODE_BRUSH },
+    { "line", WAYDRAW_MODE_LINE },
+    { "rectangle", WAYDRAW_MODE_RECTANGLE },
+    { "circle", WAYDRAW_MODE_CIRCLE },
+  };
+
+  for(unsigned i=0; i<bench_resolution_count; ++i)
+  {
+    const struct bench_resolution *resolution = &bench_resolutions[i];
+
+    for(unsigned j=0; j<sizeof modes / sizeof modes[0]; ++j)
+    {
+      struct preview_config config = { resolution, modes[j].mode, 0.0 };
+      bench_run("preview", modes[j].name, resolution, &bench_preview, &config);
+    }
+
+    // Small shapes should cost the same no matter the size of the output.
+    // Brush strokes are left out since they never clear anything.
+    for(unsigned j=1; j<sizeof modes / sizeof modes[0]; ++j)
+    {
+      struct preview_config config = { resolution, modes[j].mode, 128.0 };
+      bench_run("preview-small", modes[j].name, resolution, &bench_preview, &config);
+    }
+
+    static const struct
+    {
+      const char *name;
+      bool filter;
+      enum command_smoothing smoothing;
+    } high_rates[] = {
+      { "unfiltered", false, COMMAND_SMOOTHING_NONE },
+      { "filtered", true, COMMAND_SMOOTHING_NONE },
+      { "quadratic", true, COMMAND_SMOOTHING_QUADRATIC },
+      { "catmull-rom", true, COMMAND_SMOOTHING_CATMULL_ROM },
+    };
+
+    for(unsigned j=0; j<sizeof high_rates / sizeof high_rates[0]; ++j)
+    {
+      struct high_rate_config config = { resolution, high_rates[j].filter, high_rates[j].smoothing };
+      bench_run("preview-8khz", high_rates[j].name, resolution, &bench_high_rate, &config);
+    }
+
+    struct composite_config full = { resolution, true };
+    struct composite_config stroke = { resolution, false };
+    bench_run("composite", "full", resolution, &bench_composite, &full);
+    bench_run("composite", "stroke", resolution, &bench_composite, &stroke);
+
+    struct blend_config blend_cairo = { resolution, true };
+    bench_run("blend", "cairo", resolution, &bench_blend, &blend_cairo);
+
+    static const char *const kernels[] = { "avx2", "sse2", "neon", "generic" };
+    const char *best = blend_selected();
+    for(unsigned j=0; j<sizeof kernels / sizeof kernels[0]; ++j)
+      if(blend_select(kernels[j]))
+      {
+        struct blend_config blend = { resolution, false };
+        bench_run("blend", kernels[j], resolution, &bench_blend, &blend);
+      }
+    blend_select(best);
+  }
+}
@@ -0,0 +1,159 @@
+// Benchmarks for the undo history at various depths.
+//
+// Strokes are kept within a small area in the middle of the output, and far
+// away keyframes are compressed while the history is built, which keeps memory
+// in check for a history as deep as 100k strokes.
+
+#include "bench.h"
+
+#include "canvas.h"
+#include "command.h"
+#include "snapshot.h"
+
+#include <cairo.h>
+
+#include <stdio.h>
+
+#define STROKE_AREA 192
+#define STROKE_POINTS 8
+
+static const double COLOR[4] = { 0.0, 1.0, 0.0, 1.0 };
+static const double WEIGHT = 4.0;
+
+static uint32_t next_random(uint32_t *state)
+{
+  *state = *state * 1664525u + 1013904223u;
+  return *state >> 8;
+}
+
+// Draw a random stroke and push it, like releasing the pointer button does.
+// Return how much the memory used by tiles grew.
+static uint64_t push_stroke(struct snapshot *snapshot, uint32_t *state)
+{
+  int area_x = snapshot->width / 2 - STROKE_AREA / 2;
+  int area_y = snapshot->height / 2 - STROKE_AREA / 2;
+
+  struct command command;
+  command_init(&command, WAYDRAW_MODE_BRUSH, COLOR, WEIGHT);
+
+  int x1 = area_x + STROKE_AREA, y1 = area_y + STROKE_AREA, x2 = area_x, y2 = area_y;
+  for(int i=0; i<STROKE_POINTS; ++i)
+  {
+    int x = area_x + next_random(state) % STROKE_AREA;
+    int y = area_y + next_random(state) % STROKE_AREA;
+    command_add_point(&command, x, y);
+    if(x < x1) x1 = x;
+    if(y < y1) y1 = y;
+    if(x > x2) x2 = x;
+    if(y > y2) y2 = y;
+  }
+
+  int padding = WEIGHT + 1;
+  command.extents = (cairo_rectangle_int_t){ x1 - padding, y1 - padding, x2 - x1 + 2 * padding, y2 - y1 + 2 * padding };
+
+  cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, command.extents.width, command.extents.height);
+  cairo_t *cairo = cairo_create(layer);
+  cairo_translate(cairo, -command.extents.x, -command.extents.y);
+  command_render(&command, cairo);
+  cairo_destroy(cairo);
+
+  struct canvas_stats before, after;
+  canvas_get_stats(&before);
+
+  struct canvas *canvas = canvas_clone(snapshot->canvas);
+  canvas_composite(canvas, layer, command.extents.x, command.extents.y, &command.extents);
+  cairo_surface_destroy(layer);
+
+  snapshot_push(snapshot, &command, canvas);
+
+  canvas_get_stats(&after);
+  return after.bytes > before.bytes ? after.bytes - before.bytes : 0;
+}
+
+struct snapshot_config
+{
+  struct snapshot *snapshot;
+  uint32_t state;
+};
+
+// Bytes per operation is how much the memory used by tiles grew.
+static void bench_push(struct bench *bench, void *data)
+{
+  struct snapshot_config *config = data;
+  uint64_t bytes = 0;
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+    bytes += push_stroke(config->snapshot, &config->state);
+  bench_stop(bench);
+
+  bench->bytes = bytes / bench->iterations;
+
+  // Stay at the same depth for the following benchmarks.
+  for(uint64_t i=0; i<bench->iterations; ++i)
+    snapshot_undo(config->snapshot);
+}
+
+static void bench_undo(struct bench *bench, void *data)
+{
+  struct snapshot_config *config = data;
+
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    bench_start(bench);
+    snapshot_undo(config->snapshot);
+    bench_stop(bench);
+    snapshot_redo(config->snapshot);
+  }
+}
+
+static void bench_redo(struct bench *bench, void *data)
+{
+  struct snapshot_config *config = data;
+
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    snapshot_undo(config->snapshot);
+    bench_start(bench);
+    snapshot_redo(config->snapshot);
+    bench_stop(bench);
+  }
+}
+
+static void bench_history(const struct bench_resolution *resolution, unsigned depth)
+{
+  char variant[32];
+  snprintf(variant, sizeof variant, "depth=%u", depth);
+
+  if(!bench_enabled("snapshot_push", variant, resolution)
+      && !bench_enabled("snapshot_undo", variant, resolution)
+      && !bench_enabled("snapshot_redo", variant, resolution))
+    return;
+
+  struct snapshot_config config = {
+    .snapshot = snapshot_new(resolution->width, resolution->height),
+    .state = depth,
+  };
+
+  for(unsigned i=0; i<depth; ++i)
+  {
+    push_stroke(config.snapshot, &config.state);
+    if(i % 1024 == 0)
+      snapshot_compress(config.snapshot, config.snapshot->keyframe_interval);
+  }
+
+  bench_run("snapshot_push", variant, resolution, &bench_push, &config);
+  bench_run("snapshot_undo", variant, resolution, &bench_undo, &config);
+  bench_run("snapshot_redo", variant, resolution, &bench_redo, &config);
+
+  snapshot_destroy(config.snapshot);
+}
+
+void bench_snapshot(void)
+{
+  for(unsigned i=0; i<bench_resolution_count; ++i)
+    bench_history(&bench_resolutions[i], 1000);
+
+  bench_history(&bench_resolutions[0], 10000);
+  bench_history(&bench_resolutions[0], 100000);
+}
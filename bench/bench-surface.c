@@ -0,0 +1,146 @@
+// Benchmarks for copying whole surfaces around, which is what every frame used
+// to cost before damage tracking.
+
+#include "bench.h"
+#include "fake-wayland.h"
+
+#include "cairo-utils.h"
+#include "cairo-wayland-utils.h"
+#include "cursor.h"
+
+#include <cairo.h>
+
+#include <math.h>
+
+static cairo_surface_t *create_surface(const struct bench_resolution *resolution)
+{
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, resolution->width, resolution->height);
+  cairo_t *cairo = cairo_create(surface);
+  cairo_set_source_rgba(cairo, 1.0, 0.0, 0.0, 0.5);
+  cairo_paint(cairo);
+  cairo_destroy(cairo);
+  return surface;
+}
+
+static uint64_t surface_bytes(cairo_surface_t *surface)
+{
+  return (uint64_t)cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+}
+
+static void bench_clone(struct bench *bench, void *data)
+{
+  cairo_surface_t *surface = create_surface(data);
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+    cairo_surface_destroy(cairo_image_surface_clone(surface));
+  bench_stop(bench);
+
+  bench->bytes = surface_bytes(surface);
+  cairo_surface_destroy(surface);
+}
+
+static void bench_copy(struct bench *bench, void *data)
+{
+  cairo_surface_t *src = create_surface(data);
+  cairo_surface_t *dst = create_surface(data);
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+    cairo_image_surface_copy(dst, src);
+  bench_stop(bench);
+
+  bench->bytes = surface_bytes(src);
+  cairo_surface_destroy(src);
+  cairo_surface_destroy(dst);
+}
+
+static void bench_wl_buffer_from_cairo_surface(struct bench *bench, void *data)
+{
+  cairo_surface_t *surface = create_surface(data);
+  struct wl_shm *wl_shm = (struct wl_shm *)fake_proxy_create(&wl_shm_interface, 1);
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    uint32_t width, height;
+    struct wl_buffer *wl_buffer = wl_buffer_from_cairo_surface(surface, &width, &height, wl_shm);
+    wl_buffer_destroy(wl_buffer);
+  }
+  bench_stop(bench);
+
+  bench->bytes = surface_bytes(surface);
+  wl_proxy_destroy((struct wl_proxy *)wl_shm);
+  cairo_surface_destroy(surface);
+}
+
+// Weights a cursor goes through while scrolling back and forth.
+#define CURSOR_WEIGHTS 8
+
+static const double CURSOR_COLOR[4] = { 1.0, 0.0, 0.0, 1.0 };
+
+static double cursor_weight(uint64_t i)
+{
+  return 10.0 + (i % CURSOR_WEIGHTS) * 1.5;
+}
+
+// What every cursor update used to cost.
+static void bench_cursor_uncached(struct bench *bench, void *data)
+{
+  (void)data;
+  struct wl_shm *wl_shm = (struct wl_shm *)fake_proxy_create(&wl_shm_interface, 1);
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    double weight = cursor_weight(i);
+    int size = cursor_size(weight);
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+    cairo_t *cairo = cairo_create(surface);
+    cairo_set_source_rgba(cairo, CURSOR_COLOR[0], CURSOR_COLOR[1], CURSOR_COLOR[2], CURSOR_COLOR[3]);
+    cairo_arc(cairo, round(size * 0.5), round(size * 0.5), weight * 0.5, 0, 2*M_PI);
+    cairo_fill(cairo);
+    cairo_destroy(cairo);
+
+    uint32_t width, height;
+    wl_buffer_destroy(wl_buffer_from_cairo_surface(surface, &width, &height, wl_shm));
+    cairo_surface_destroy(surface);
+  }
+  bench_stop(bench);
+
+  wl_proxy_destroy((struct wl_proxy *)wl_shm);
+}
+
+static void bench_cursor_cached(struct bench *bench, void *data)
+{
+  (void)data;
+  struct wl_shm *wl_shm = (struct wl_shm *)fake_proxy_create(&wl_shm_interface, 1);
+  struct cursor_cache *cache = cursor_cache_new(wl_shm);
+
+  bench_start(bench);
+  for(uint64_t i=0; i<bench->iterations; ++i)
+  {
+    struct cursor *cursor = cursor_cache_get(cache, CURSOR_COLOR, cursor_weight(i));
+    fake_buffer_release(cursor->wl_buffer);
+  }
+  bench_stop(bench);
+
+  cursor_cache_destroy(cache);
+  wl_proxy_destroy((struct wl_proxy *)wl_shm);
+}
+
+void bench_surface(void)
+{
+  // The size of a cursor has nothing to do with the resolution.
+  bench_run("cursor", "uncached", &bench_resolutions[0], &bench_cursor_uncached, NULL);
+  bench_run("cursor", "cached", &bench_resolutions[0], &bench_cursor_cached, NULL);
+
+  for(unsigned i=0; i<bench_resolution_count; ++i)
+  {
+    const struct bench_resolution *resolution = &bench_resolutions[i];
+    bench_run("clone", NULL, resolution, &bench_clone, (void *)resolution);
+    bench_run("copy", NULL, resolution, &bench_copy, (void *)resolution);
+    bench_run("wl_buffer_from_cairo_surface", NULL, resolution, &bench_wl_buffer_from_cairo_surface, (void *)resolution);
+  }
+}
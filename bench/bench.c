@@ -0,0 +1,151 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+const struct bench_resolution bench_resolutions[] = {
+  { "1080p", 1920, 1080 },
+  { "1440p", 2560, 1440 },
+  { "4k",    3840, 2160 },
+  { "8k",    7680, 4320 },
+};
+
+const unsigned bench_resolution_count = sizeof bench_resolutions / sizeof bench_resolutions[0];
+
+static uint64_t min_time = 500000000; // nanoseconds
+static bool csv;
+
+static char **filters;
+static int filter_count;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_start(struct bench *bench)
+{
+  bench->start = now();
+}
+
+void bench_stop(struct bench *bench)
+{
+  bench->elapsed += now() - bench->start;
+}
+
+static void format_id(char *id, size_t size, const char *name, const char *variant, const struct bench_resolution *resolution)
+{
+  snprintf(id, size, "%s%s%s/%s", name, variant ? "/" : "", variant ? variant : "", resolution->name);
+}
+
+bool bench_enabled(const char *name, const char *variant, const struct bench_resolution *resolution)
+{
+  if(filter_count == 0)
+    return true;
+
+  char id[256];
+  format_id(id, sizeof id, name, variant, resolution);
+  for(int i=0; i<filter_count; ++i)
+    if(strstr(id, filters[i]))
+      return true;
+
+  return false;
+}
+
+void bench_run(const char *name, const char *variant, const struct bench_resolution *resolution, bench_func func, void *data)
+{
+  if(!bench_enabled(name, variant, resolution))
+    return;
+
+  // Grow the number of iterations until the benchmark runs for long enough,
+  // aiming a bit past the minimum time to avoid one run too many.
+  struct bench bench = {0};
+  uint64_t iterations = 1;
+  for(;;)
+  {
+    bench = (struct bench){ .iterations = iterations };
+    func(&bench, data);
+    if(bench.elapsed >= min_time || iterations >= 1000000000)
+      break;
+
+    uint64_t elapsed = bench.elapsed ? bench.elapsed : 1;
+    uint64_t next = min_time * 6 / 5 * iterations / elapsed;
+    if(next > iterations * 100) next = iterations * 100;
+    if(next < iterations + 1) next = iterations + 1;
+    if(next > 1000000000) next = 1000000000;
+    iterations = next;
+  }
+
+  double ns_per_op = (double)bench.elapsed / bench.iterations;
+
+  char id[256];
+  format_id(id, sizeof id, name, variant, resolution);
+  if(csv)
+    printf("%s,%s,%s,%u,%u,%lu,%.1f,%lu\n",
+        name,
+        variant ? variant : "",
+        resolution->name,
+        resolution->width,
+        resolution->height,
+        (unsigned long)bench.iterations,
+        ns_per_op,
+        (unsigned long)bench.bytes);
+  else
+    printf("{\"id\":\"%s\",\"name\":\"%s\",\"variant\":\"%s\",\"resolution\":\"%s\",\"width\":%u,\"height\":%u,\"iterations\":%lu,\"ns_per_op\":%.1f,\"bytes_per_op\":%lu}\n",
+        id,
+        name,
+        variant ? variant : "",
+        resolution->name,
+        resolution->width,
+        resolution->height,
+        (unsigned long)bench.iterations,
+        ns_per_op,
+        (unsigned long)bench.bytes);
+
+  fflush(stdout);
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [--csv] [--time SECONDS] [FILTER...]\n", program);
+  fprintf(stderr, "note: only benchmarks whose id, such as clone/4k or preview/brush/1080p, contains one of the filters are run\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  filters = calloc(argc, sizeof *filters);
+  for(int i=1; i<argc; ++i)
+  {
+    if(strcmp(argv[i], "--csv") == 0)
+      csv = true;
+    else if(strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+    {
+      char *end;
+      double seconds = strtod(argv[++i], &end);
+      if(*end != '\0' || seconds <= 0)
+        usage(argv[0]);
+      min_time = seconds * 1e9;
+    }
+    else if(argv[i][0] == '-')
+      usage(argv[0]);
+    else
+      filters[filter_count++] = argv[i];
+  }
+
+  if(csv)
+    printf("name,variant,resolution,width,height,iterations,ns_per_op,bytes_per_op\n");
+
+  bench_surface();
+  bench_render();
+  bench_snapshot();
+  bench_control();
+
+  free(filters);
+  return 0;
+}
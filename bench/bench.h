@@ -0,0 +1,54 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// A minimal benchmark harness.
+//
+// A benchmark function is called with an increasing number of iterations until
+// it runs for long enough. It should do its setup, call bench_start(), run the
+// operation being measured bench->iterations times, and call bench_stop()
+// before cleaning up. Anything that should not be measured within the loop can
+// be excluded with a pair of bench_stop() and bench_start().
+//
+// Each result is printed to stdout as a line of JSON (or CSV with --csv) with
+// the time and the number of bytes processed per operation.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct bench
+{
+  uint64_t iterations; // number of operations to run
+  uint64_t bytes;      // bytes processed per operation, set by the benchmark
+
+  uint64_t elapsed;    // nanoseconds measured so far
+  uint64_t start;
+};
+
+typedef void (*bench_func)(struct bench *bench, void *data);
+
+struct bench_resolution
+{
+  const char *name;
+  uint32_t width, height;
+};
+
+extern const struct bench_resolution bench_resolutions[];
+extern const unsigned bench_resolution_count;
+
+void bench_start(struct bench *bench);
+void bench_stop(struct bench *bench);
+
+// Whether a benchmark would be run with the filters given on the command line,
+// so that expensive setup can be skipped otherwise.
+bool bench_enabled(const char *name, const char *variant, const struct bench_resolution *resolution);
+
+// Run a benchmark and report its result. variant tells apart different
+// configurations of the same benchmark, and may be NULL.
+void bench_run(const char *name, const char *variant, const struct bench_resolution *resolution, bench_func func, void *data);
+
+void bench_surface(void);
+void bench_render(void);
+void bench_snapshot(void);
+void bench_control(void);
+
+#endif // BENCH_H
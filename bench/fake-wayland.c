@@ -0,0 +1,133 @@
+#include "fake-wayland.h"
+
+#include <wayland-client-core.h>
+#include <wayland-client-protocol.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+struct wl_proxy
+{
+  const struct wl_interface *interface;
+  uint32_t version;
+  uint32_t id;
+
+  const void *listener;
+  void *user_data;
+};
+
+struct fake_wayland_stats fake_wayland_stats;
+struct fake_wayland_hooks fake_wayland_hooks;
+
+const struct wl_interface wl_display_interface = { "wl_display", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_registry_interface = { "wl_registry", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_callback_interface = { "wl_callback", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_compositor_interface = { "wl_compositor", 6, 0, NULL, 0, NULL };
+const struct wl_interface wl_surface_interface = { "wl_surface", 6, 0, NULL, 0, NULL };
+const struct wl_interface wl_region_interface = { "wl_region", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_subcompositor_interface = { "wl_subcompositor", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_subsurface_interface = { "wl_subsurface", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_shm_interface = { "wl_shm", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_shm_pool_interface = { "wl_shm_pool", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_buffer_interface = { "wl_buffer", 1, 0, NULL, 0, NULL };
+const struct wl_interface wl_seat_interface = { "wl_seat", 9, 0, NULL, 0, NULL };
+const struct wl_interface wl_pointer_interface = { "wl_pointer", 9, 0, NULL, 0, NULL };
+const struct wl_interface wl_keyboard_interface = { "wl_keyboard", 9, 0, NULL, 0, NULL };
+const struct wl_interface wl_output_interface = { "wl_output", 4, 0, NULL, 0, NULL };
+
+struct wl_proxy *fake_proxy_create(const struct wl_interface *interface, uint32_t version)
+{
+  static uint32_t id;
+
+  struct wl_proxy *proxy = calloc(1, sizeof *proxy);
+  proxy->interface = interface;
+  proxy->version = version;
+  proxy->id = ++id;
+
+  fake_wayland_stats.proxies += 1;
+  return proxy;
+}
+
+const struct wl_interface *fake_proxy_get_interface(struct wl_proxy *proxy)
+{
+  return proxy->interface;
+}
+
+void fake_buffer_release(struct wl_buffer *wl_buffer)
+{
+  struct wl_proxy *proxy = (struct wl_proxy *)wl_buffer;
+  const struct wl_buffer_listener *listener = proxy->listener;
+  if(listener && listener->release)
+    listener->release(proxy->user_data, wl_buffer);
+}
+
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode, const struct wl_interface *interface, uint32_t version, uint32_t flags, ...)
+{
+  fake_wayland_stats.requests += 1;
+
+  struct wl_proxy *new_proxy = NULL;
+  if(interface)
+    new_proxy = fake_proxy_create(interface, version);
+
+  if(fake_wayland_hooks.request)
+  {
+    va_list args;
+    va_start(args, flags);
+    fake_wayland_hooks.request(proxy, opcode, new_proxy, args);
+    va_end(args);
+  }
+
+  if(flags & WL_MARSHAL_FLAG_DESTROY)
+    wl_proxy_destroy(proxy);
+
+  return new_proxy;
+}
+
+void wl_proxy_destroy(struct wl_proxy *proxy)
+{
+  if(fake_wayland_hooks.destroy)
+    fake_wayland_hooks.destroy(proxy);
+
+  fake_wayland_stats.proxies -= 1;
+  free(proxy);
+}
+
+int wl_proxy_add_listener(struct wl_proxy *proxy, void (**implementation)(void), void *data)
+{
+  if(proxy->listener)
+    return -1;
+
+  proxy->listener = implementation;
+  proxy->user_data = data;
+  return 0;
+}
+
+const void *wl_proxy_get_listener(struct wl_proxy *proxy)
+{
+  return proxy->listener;
+}
+
+void wl_proxy_set_user_data(struct wl_proxy *proxy, void *user_data)
+{
+  proxy->user_data = user_data;
+}
+
+void *wl_proxy_get_user_data(struct wl_proxy *proxy)
+{
+  return proxy->user_data;
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy *proxy)
+{
+  return proxy->version;
+}
+
+uint32_t wl_proxy_get_id(struct wl_proxy *proxy)
+{
+  return proxy->id;
+}
+
+const char *wl_proxy_get_class(struct wl_proxy *proxy)
+{
+  return proxy->interface->name;
+}
@@ -0,0 +1,45 @@
+#ifndef FAKE_WAYLAND_H
+#define FAKE_WAYLAND_H
+
+// A stand-in for libwayland-client that is not connected to any compositor.
+//
+// Proxies are plain objects and requests are dropped, except that requests
+// creating or destroying objects do create or destroy them. Events are never
+// sent by themselves, and have to be sent explicitly with the functions below.
+//
+// Only the interfaces of the core protocol that waydraw uses are defined, and
+// only by name and version.
+
+#include <wayland-client.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+
+struct fake_wayland_stats
+{
+  uint64_t requests; // number of requests made
+  uint64_t proxies;  // number of live proxies
+};
+
+extern struct fake_wayland_stats fake_wayland_stats;
+
+// Hooks to play the part of the compositor, if set. The request hook is called
+// with the arguments of the request, after the object it creates if any has
+// been created. The destroy hook is called right before a proxy is destroyed.
+struct fake_wayland_hooks
+{
+  void (*request)(struct wl_proxy *proxy, uint32_t opcode, struct wl_proxy *new_proxy, va_list args);
+  void (*destroy)(struct wl_proxy *proxy);
+};
+
+extern struct fake_wayland_hooks fake_wayland_hooks;
+
+// Create a proxy as if it was bound from the registry.
+struct wl_proxy *fake_proxy_create(const struct wl_interface *interface, uint32_t version);
+
+const struct wl_interface *fake_proxy_get_interface(struct wl_proxy *proxy);
+
+// Send wl_buffer.release.
+void fake_buffer_release(struct wl_buffer *wl_buffer);
+
+#endif // FAKE_WAYLAND_H
@@ -0,0 +1,605 @@
+// Replay an input trace recorded with WAYDRAW_RECORD through waydraw itself.
+//
+// This is linked against waydraw and a fake libwayland-client in place of the
+// real one. The functions below that talk to the display play the part of a
+// compositor: they announce the globals from the trace, send its events to the
+// listeners waydraw registered, release buffers as soon as they are committed
+// and signal frame callbacks at 60Hz.
+//
+// Time is virtual, following the timestamps in the trace, so that the frames
+// rendered are the same whether or not the replay runs in real time.
+
+#include "fake-wayland.h"
+#include "control.h"
+#include "shm.h"
+#include "trace.h"
+
+#include <wayland-client-protocol.h>
+#include <wlr-layer-shell-unstable-v1-client-protocol.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#define FRAME_INTERVAL 16667 // microseconds
+
+struct replay_output
+{
+  uint32_t global_name;
+  struct wl_output *wl_output;
+  struct wl_surface *wl_surface;
+  struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1;
+};
+
+struct replay_seat
+{
+  uint32_t global_name;
+  struct wl_seat *wl_seat;
+  struct wl_pointer *wl_pointer;
+  struct wl_keyboard *wl_keyboard;
+};
+
+enum replay_pending_type
+{
+  REPLAY_PENDING_ATTACH, // buffer attached to surface but not yet committed
+  REPLAY_PENDING_FRAME,  // callback requested on surface but not yet committed
+  REPLAY_PENDING_RELEASE,
+  REPLAY_PENDING_DONE,
+};
+
+struct replay_pending
+{
+  enum replay_pending_type type;
+  struct wl_proxy *surface;
+  struct wl_proxy *proxy; // the buffer or the callback
+  uint64_t due;
+};
+
+static struct
+{
+  struct trace *trace;
+  struct trace_event event;
+  bool realtime;
+  bool queued; // whether event has been read but not sent yet
+  int fd;
+
+  struct wl_proxy *wl_display;
+  struct wl_proxy *wl_registry;
+
+  bool announced; // whether the globals not in the trace have been announced
+  uint32_t next_global_name;
+
+  struct wl_array outputs; // struct replay_output, by index in the trace
+  struct wl_array seats;   // struct replay_seat, by index in the trace
+  struct wl_array pending; // struct replay_pending
+
+  uint64_t time;  // virtual time in microseconds
+  uint64_t start; // wall clock time when the replay started
+
+  uint64_t events;
+  uint64_t commits;
+  uint64_t serial;
+} replay;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void mismatch(const char *message)
+{
+  fprintf(stderr, "error: trace does not match the replay: %s\n", message);
+  fprintf(stderr, "note: this could be because the trace was recorded with a different version of waydraw\n");
+  exit(EXIT_FAILURE);
+}
+
+static struct replay_output *get_output(uint32_t index)
+{
+  if(index >= replay.outputs.size / sizeof(struct replay_output))
+    mismatch("unknown output");
+  return (struct replay_output *)replay.outputs.data + index;
+}
+
+static struct replay_seat *get_seat(uint32_t index)
+{
+  if(index >= replay.seats.size / sizeof(struct replay_seat))
+    mismatch("unknown seat");
+  return (struct replay_seat *)replay.seats.data + index;
+}
+
+static struct wl_surface *get_output_surface(uint32_t index)
+{
+  struct replay_output *output = get_output(index);
+  if(!output->wl_surface)
+    mismatch("output without a layer surface");
+  return output->wl_surface;
+}
+
+static void add_pending(enum replay_pending_type type, struct wl_proxy *surface, struct wl_proxy *proxy, uint64_t due)
+{
+  struct replay_pending *pending = wl_array_add(&replay.pending, sizeof *pending);
+  pending->type = type;
+  pending->surface = surface;
+  pending->proxy = proxy;
+  pending->due = due;
+}
+
+static void remove_pending(size_t i)
+{
+  struct replay_pending *pendings = replay.pending.data;
+  size_t count = replay.pending.size / sizeof *pendings;
+  memmove(&pendings[i], &pendings[i+1], (count - i - 1) * sizeof *pendings);
+  replay.pending.size -= sizeof *pendings;
+}
+
+static void commit_surface(struct wl_proxy *surface)
+{
+  replay.commits += 1;
+
+  // Pretend to copy the buffer right away, and to present at the next vblank.
+  uint64_t vblank = (replay.time / FRAME_INTERVAL + 1) * FRAME_INTERVAL;
+
+  struct replay_pending *pendings = replay.pending.data;
+  size_t count = replay.pending.size / sizeof *pendings;
+  for(size_t i=0; i<count; ++i)
+    if(pendings[i].surface == surface)
+      switch(pendings[i].type)
+      {
+      case REPLAY_PENDING_ATTACH:
+        pendings[i].type = REPLAY_PENDING_RELEASE;
+        pendings[i].due = replay.time;
+        break;
+      case REPLAY_PENDING_FRAME:
+        pendings[i].type = REPLAY_PENDING_DONE;
+        pendings[i].due = vblank;
+        break;
+      default:
+        break;
+      }
+}
+
+static void handle_request(struct wl_proxy *proxy, uint32_t opcode, struct wl_proxy *new_proxy, va_list args)
+{
+  const struct wl_interface *interface = fake_proxy_get_interface(proxy);
+
+  if(interface == &wl_display_interface && opcode == WL_DISPLAY_GET_REGISTRY)
+  {
+    replay.wl_registry = new_proxy;
+    return;
+  }
+
+  if(interface == &wl_registry_interface && opcode == WL_REGISTRY_BIND)
+  {
+    uint32_t name = va_arg(args, uint32_t);
+
+    struct replay_output *output;
+    wl_array_for_each(output, &replay.outputs)
+      if(output->global_name == name)
+        output->wl_output = (struct wl_output *)new_proxy;
+
+    struct replay_seat *seat;
+    wl_array_for_each(seat, &replay.seats)
+      if(seat->global_name == name)
+        seat->wl_seat = (struct wl_seat *)new_proxy;
+    return;
+  }
+
+  if(interface == &zwlr_layer_shell_v1_interface && opcode == ZWLR_LAYER_SHELL_V1_GET_LAYER_SURFACE)
+  {
+    (void)va_arg(args, void *); // new_id
+    struct wl_surface *wl_surface = va_arg(args, struct wl_surface *);
+    struct wl_output *wl_output = va_arg(args, struct wl_output *);
+
+    struct replay_output *output;
+    wl_array_for_each(output, &replay.outputs)
+      if(output->wl_output == wl_output)
+      {
+        output->wl_surface = wl_surface;
+        output->zwlr_layer_surface_v1 = (struct zwlr_layer_surface_v1 *)new_proxy;
+      }
+    return;
+  }
+
+  if(interface == &wl_seat_interface && (opcode == WL_SEAT_GET_POINTER || opcode == WL_SEAT_GET_KEYBOARD))
+  {
+    struct replay_seat *seat;
+    wl_array_for_each(seat, &replay.seats)
+      if(seat->wl_seat == (struct wl_seat *)proxy)
+      {
+        if(opcode == WL_SEAT_GET_POINTER)
+          seat->wl_pointer = (struct wl_pointer *)new_proxy;
+        else
+          seat->wl_keyboard = (struct wl_keyboard *)new_proxy;
+      }
+    return;
+  }
+
+  if(interface == &wl_surface_interface)
+    switch(opcode)
+    {
+    case WL_SURFACE_ATTACH:
+      {
+        struct wl_proxy *buffer = va_arg(args, struct wl_proxy *);
+        if(buffer)
+          add_pending(REPLAY_PENDING_ATTACH, proxy, buffer, 0);
+      }
+      break;
+    case WL_SURFACE_FRAME:
+      add_pending(REPLAY_PENDING_FRAME, proxy, new_proxy, 0);
+      break;
+    case WL_SURFACE_COMMIT:
+      commit_surface(proxy);
+      break;
+    }
+}
+
+static void handle_destroy(struct wl_proxy *proxy)
+{
+  struct replay_pending *pendings = replay.pending.data;
+  for(size_t i = replay.pending.size / sizeof *pendings; i-- > 0;)
+    if(pendings[i].surface == proxy || pendings[i].proxy == proxy)
+      remove_pending(i);
+
+  struct replay_output *output;
+  wl_array_for_each(output, &replay.outputs)
+  {
+    if(output->wl_surface == (struct wl_surface *)proxy)
+      output->wl_surface = NULL;
+    if(output->zwlr_layer_surface_v1 == (struct zwlr_layer_surface_v1 *)proxy)
+      output->zwlr_layer_surface_v1 = NULL;
+  }
+
+  struct replay_seat *seat;
+  wl_array_for_each(seat, &replay.seats)
+  {
+    if(seat->wl_pointer == (struct wl_pointer *)proxy)
+      seat->wl_pointer = NULL;
+    if(seat->wl_keyboard == (struct wl_keyboard *)proxy)
+      seat->wl_keyboard = NULL;
+  }
+}
+
+// Advance the virtual clock, sleeping along in real time mode.
+static void advance(uint64_t time)
+{
+  if(time <= replay.time)
+    return;
+
+  replay.time = time;
+  if(replay.realtime)
+  {
+    uint64_t deadline = replay.start + time;
+    struct timespec ts = { deadline / 1000000, deadline % 1000000 * 1000 };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+  }
+}
+
+// Send events for buffers and frame callbacks that are due by the given time.
+static void deliver_due(uint64_t time)
+{
+  for(;;)
+  {
+    struct replay_pending *pendings = replay.pending.data;
+    size_t count = replay.pending.size / sizeof *pendings;
+
+    size_t next = count;
+    for(size_t i=0; i<count; ++i)
+      if((pendings[i].type == REPLAY_PENDING_RELEASE || pendings[i].type == REPLAY_PENDING_DONE) &&
+          pendings[i].due <= time &&
+          (next == count || pendings[i].due < pendings[next].due))
+        next = i;
+
+    if(next == count)
+      break;
+
+    struct replay_pending pending = pendings[next];
+    remove_pending(next);
+    advance(pending.due);
+
+    // Either may well destroy the proxy, which would have it removed from the
+    // pending events.
+    if(pending.type == REPLAY_PENDING_RELEASE)
+      fake_buffer_release((struct wl_buffer *)pending.proxy);
+    else
+    {
+      const struct wl_callback_listener *listener = wl_proxy_get_listener(pending.proxy);
+      if(listener)
+        listener->done(wl_proxy_get_user_data(pending.proxy), (struct wl_callback *)pending.proxy, pending.due / 1000);
+    }
+  }
+}
+
+static uint32_t announce_global(const char *interface, uint32_t version)
+{
+  uint32_t name = replay.next_global_name++;
+  const struct wl_registry_listener *listener = wl_proxy_get_listener(replay.wl_registry);
+  listener->global(wl_proxy_get_user_data(replay.wl_registry), (struct wl_registry *)replay.wl_registry, name, interface, version);
+  return name;
+}
+
+static int send_keymap(const struct wl_array *keymap)
+{
+  int fd = allocate_shm_file(keymap->size);
+  if(fd < 0 || pwrite(fd, keymap->data, keymap->size, 0) != (ssize_t)keymap->size)
+  {
+    fprintf(stderr, "error: failed to write keymap file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+#define LISTENER(type, proxy) ((const struct type##_listener *)wl_proxy_get_listener((struct wl_proxy *)(proxy)))
+#define USER_DATA(proxy) wl_proxy_get_user_data((struct wl_proxy *)(proxy))
+
+static struct wl_pointer *get_pointer(uint32_t index)
+{
+  struct replay_seat *seat = get_seat(index);
+  if(!seat->wl_pointer)
+    mismatch("pointer event on a seat without a pointer");
+  return seat->wl_pointer;
+}
+
+static struct wl_keyboard *get_keyboard(uint32_t index)
+{
+  struct replay_seat *seat = get_seat(index);
+  if(!seat->wl_keyboard)
+    mismatch("keyboard event on a seat without a keyboard");
+  return seat->wl_keyboard;
+}
+
+static void send_event(const struct trace_event *event)
+{
+  const uint32_t *args = event->args;
+  uint32_t time = event->timestamp / 1000;
+
+  switch(event->type)
+  {
+  case TRACE_EVENT_OUTPUT:
+    {
+      struct replay_output *output = wl_array_add(&replay.outputs, sizeof *output);
+      memset(output, 0, sizeof *output);
+      if(args[0] != replay.outputs.size / sizeof *output - 1)
+        mismatch("outputs out of order");
+
+      output->global_name = replay.next_global_name;
+      announce_global(wl_output_interface.name, args[1]);
+    }
+    break;
+  case TRACE_EVENT_OUTPUT_NAME:
+    {
+      struct wl_output *wl_output = get_output(args[0])->wl_output;
+      LISTENER(wl_output, wl_output)->name(USER_DATA(wl_output), wl_output, event->data.data);
+    }
+    break;
+  case TRACE_EVENT_SEAT:
+    {
+      struct replay_seat *seat = wl_array_add(&replay.seats, sizeof *seat);
+      memset(seat, 0, sizeof *seat);
+      if(args[0] != replay.seats.size / sizeof *seat - 1)
+        mismatch("seats out of order");
+
+      seat->global_name = replay.next_global_name;
+      announce_global(wl_seat_interface.name, args[1]);
+    }
+    break;
+  case TRACE_EVENT_SEAT_CAPABILITIES:
+    {
+      struct wl_seat *wl_seat = get_seat(args[0])->wl_seat;
+      LISTENER(wl_seat, wl_seat)->capabilities(USER_DATA(wl_seat), wl_seat, args[1]);
+    }
+    break;
+  case TRACE_EVENT_CONFIGURE:
+    {
+      struct zwlr_layer_surface_v1 *surface = get_output(args[0])->zwlr_layer_surface_v1;
+      if(!surface)
+        mismatch("configure on an output without a layer surface");
+      LISTENER(zwlr_layer_surface_v1, surface)->configure(USER_DATA(surface), surface, ++replay.serial, args[1], args[2]);
+    }
+    break;
+  case TRACE_EVENT_KEYMAP:
+    {
+      struct wl_keyboard *wl_keyboard = get_keyboard(args[0]);
+      LISTENER(wl_keyboard, wl_keyboard)->keymap(USER_DATA(wl_keyboard), wl_keyboard, args[1], send_keymap(&event->data), event->data.size);
+    }
+    break;
+  case TRACE_EVENT_KEYBOARD_ENTER:
+    {
+      struct wl_keyboard *wl_keyboard = get_keyboard(args[0]);
+      struct wl_array keys;
+      wl_array_init(&keys);
+      LISTENER(wl_keyboard, wl_keyboard)->enter(USER_DATA(wl_keyboard), wl_keyboard, ++replay.serial, get_output_surface(args[1]), &keys);
+    }
+    break;
+  case TRACE_EVENT_KEYBOARD_LEAVE:
+    {
+      struct wl_keyboard *wl_keyboard = get_keyboard(args[0]);
+      LISTENER(wl_keyboard, wl_keyboard)->leave(USER_DATA(wl_keyboard), wl_keyboard, ++replay.serial, get_output_surface(args[1]));
+    }
+    break;
+  case TRACE_EVENT_KEY:
+    {
+      struct wl_keyboard *wl_keyboard = get_keyboard(args[0]);
+      LISTENER(wl_keyboard, wl_keyboard)->key(USER_DATA(wl_keyboard), wl_keyboard, ++replay.serial, time, args[1], args[2]);
+    }
+    break;
+  case TRACE_EVENT_MODIFIERS:
+    {
+      struct wl_keyboard *wl_keyboard = get_keyboard(args[0]);
+      LISTENER(wl_keyboard, wl_keyboard)->modifiers(USER_DATA(wl_keyboard), wl_keyboard, ++replay.serial, args[1], args[2], args[3], args[4]);
+    }
+    break;
+  case TRACE_EVENT_POINTER_ENTER:
+    {
+      struct wl_pointer *wl_pointer = get_pointer(args[0]);
+      LISTENER(wl_pointer, wl_pointer)->enter(USER_DATA(wl_pointer), wl_pointer, ++replay.serial, get_output_surface(args[1]), args[2], args[3]);
+    }
+    break;
+  case TRACE_EVENT_POINTER_LEAVE:
+    {
+      struct wl_pointer *wl_pointer = get_pointer(args[0]);
+      LISTENER(wl_pointer, wl_pointer)->leave(USER_DATA(wl_pointer), wl_pointer, ++replay.serial, get_output_surface(args[1]));
+    }
+    break;
+  case TRACE_EVENT_POINTER_MOTION:
+    {
+      struct wl_pointer *wl_pointer = get_pointer(args[0]);
+      LISTENER(wl_pointer, wl_pointer)->motion(USER_DATA(wl_pointer), wl_pointer, time, args[1], args[2]);
+    }
+    break;
+  case TRACE_EVENT_POINTER_BUTTON:
+    {
+      struct wl_pointer *wl_pointer = get_pointer(args[0]);
+      LISTENER(wl_pointer, wl_pointer)->button(USER_DATA(wl_pointer), wl_pointer, ++replay.serial, time, args[1], args[2]);
+    }
+    break;
+  case TRACE_EVENT_POINTER_AXIS:
+    {
+      struct wl_pointer *wl_pointer = get_pointer(args[0]);
+      LISTENER(wl_pointer, wl_pointer)->axis(USER_DATA(wl_pointer), wl_pointer, time, args[1], args[2]);
+    }
+    break;
+  case TRACE_EVENT_POINTER_FRAME:
+    {
+      struct wl_pointer *wl_pointer = get_pointer(args[0]);
+      LISTENER(wl_pointer, wl_pointer)->frame(USER_DATA(wl_pointer), wl_pointer);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+struct wl_display *wl_display_connect(const char *name)
+{
+  (void)name;
+
+  const char *path = getenv("WAYDRAW_REPLAY");
+  if(!path)
+  {
+    fprintf(stderr, "error: no trace to replay\n");
+    fprintf(stderr, "note: set WAYDRAW_REPLAY to a trace recorded with WAYDRAW_RECORD\n");
+    exit(EXIT_FAILURE);
+  }
+
+  replay.trace = trace_open(path);
+  replay.realtime = getenv("WAYDRAW_REPLAY_REALTIME") != NULL;
+  replay.next_global_name = 1;
+
+  wl_array_init(&replay.outputs);
+  wl_array_init(&replay.seats);
+  wl_array_init(&replay.pending);
+
+  fake_wayland_hooks.request = &handle_request;
+  fake_wayland_hooks.destroy = &handle_destroy;
+
+  replay.fd = eventfd(1, EFD_CLOEXEC);
+  if(replay.fd < 0)
+  {
+    fprintf(stderr, "error: failed to create eventfd: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  replay.wl_display = fake_proxy_create(&wl_display_interface, 1);
+  replay.start = now();
+  return (struct wl_display *)replay.wl_display;
+}
+
+// The display is always readable, and reading from it reads the next event from
+// the trace, which is then sent by wl_display_dispatch_pending().
+int wl_display_get_fd(struct wl_display *wl_display)
+{
+  (void)wl_display;
+  return replay.fd;
+}
+
+int wl_display_prepare_read(struct wl_display *wl_display)
+{
+  (void)wl_display;
+  return !replay.announced || replay.queued ? -1 : 0;
+}
+
+void wl_display_cancel_read(struct wl_display *wl_display)
+{
+  (void)wl_display;
+}
+
+int wl_display_read_events(struct wl_display *wl_display)
+{
+  (void)wl_display;
+
+  if(!trace_read(replay.trace, &replay.event))
+  {
+    deliver_due(UINT64_MAX);
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  replay.queued = true;
+  return 0;
+}
+
+int wl_display_dispatch_pending(struct wl_display *wl_display)
+{
+  (void)wl_display;
+
+  // The globals every compositor that waydraw works with has, which are not
+  // part of the trace.
+  if(!replay.announced)
+  {
+    assert(replay.wl_registry);
+    replay.announced = true;
+    announce_global(wl_compositor_interface.name, wl_compositor_interface.version);
+    announce_global(wl_subcompositor_interface.name, wl_subcompositor_interface.version);
+    announce_global(wl_shm_interface.name, wl_shm_interface.version);
+    announce_global(zwlr_layer_shell_v1_interface.name, zwlr_layer_shell_v1_interface.version);
+    return 4;
+  }
+
+  if(!replay.queued)
+    return 0;
+
+  deliver_due(replay.event.timestamp);
+  advance(replay.event.timestamp);
+  send_event(&replay.event);
+  replay.queued = false;
+  replay.events += 1;
+  return 1;
+}
+
+int wl_display_flush(struct wl_display *wl_display)
+{
+  (void)wl_display;
+  return 0;
+}
+
+void wl_display_disconnect(struct wl_display *wl_display)
+{
+  (void)wl_display;
+
+  uint64_t elapsed = now() - replay.start;
+  fprintf(stderr, "replay: %lu events over %.3fs of trace replayed in %.3fs, %lu commits, %lu requests\n",
+      (unsigned long)replay.events,
+      replay.time / 1e6,
+      elapsed / 1e6,
+      (unsigned long)replay.commits,
+      (unsigned long)fake_wayland_stats.requests);
+
+  trace_close(replay.trace);
+  close(replay.fd);
+}
+
+// There is no other instance to resume or to be resumed by.
+void try_resume(void) {}
+int control_fd(void) { return -1; }
+bool read_command(struct control_message *message) { (void)message; return false; }
+void reply_command(int32_t status, const char *text, size_t size) { (void)status; (void)text; (void)size; }
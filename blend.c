@@ -0,0 +1,330 @@
+#include "blend.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86
+#endif
+
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define BLEND_NEON
+#endif
+
+struct blend_kernels
+{
+  const char *name;
+  bool (*supported)(void);
+
+  // Composite a span of premultiplied pixels with CAIRO_OPERATOR_OVER.
+  void (*over)(uint32_t *dst, const uint32_t *src, int width);
+};
+
+// Multiplying two 8-bit values and dividing by 255 is done the same way as in
+// pixman, which is what cairo uses under the hood:
+//
+//   t = x * y + 0x80
+//   x * y / 255 = (t + (t >> 8)) >> 8
+//
+// followed by a saturating addition of the source. Every kernel has to stick to
+// this exactly to give bit-exact results.
+static uint32_t over_pixel(uint32_t dst, uint32_t src)
+{
+  uint32_t alpha = 255 - (src >> 24);
+  uint32_t result = 0;
+  for(int shift=0; shift<32; shift+=8)
+  {
+    uint32_t t = ((dst >> shift) & 0xff) * alpha + 0x80;
+    t = ((t + (t >> 8)) >> 8) + ((src >> shift) & 0xff);
+    result |= (t > 0xff ? 0xff : t) << shift;
+  }
+  return result;
+}
+
+static bool supported_generic(void)
+{
+  return true;
+}
+
+static void over_generic(uint32_t *dst, const uint32_t *src, int width)
+{
+  for(int i=0; i<width; ++i)
+    if(src[i] != 0)
+      dst[i] = src[i] >> 24 == 0xff ? src[i] : over_pixel(dst[i], src[i]);
+}
+
+#ifdef BLEND_X86
+static bool supported_sse2(void)
+{
+  return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static void over_sse2(uint32_t *dst, const uint32_t *src, int width)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+  const __m128i channel_mask = _mm_set1_epi16(0xff);
+  const __m128i bias = _mm_set1_epi16(0x80);
+  const __m128i scale = _mm_set1_epi16(0x101);
+
+  int i = 0;
+  for(; i + 4 <= width; i += 4)
+  {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+      continue;
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha_mask), alpha_mask)) == 0xffff)
+    {
+      _mm_storeu_si128((__m128i *)(dst + i), s);
+      continue;
+    }
+
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+    __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+    // 255 minus the alpha of each pixel, in every channel.
+    __m128i a_lo = _mm_unpacklo_epi8(s, zero);
+    __m128i a_hi = _mm_unpackhi_epi8(s, zero);
+    a_lo = _mm_xor_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(a_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), channel_mask);
+    a_hi = _mm_xor_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(a_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), channel_mask);
+
+    // (t * 0x101) >> 16 is the same as (t + (t >> 8)) >> 8 for 16-bit t.
+    d_lo = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(d_lo, a_lo), bias), scale);
+    d_hi = _mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(d_hi, a_hi), bias), scale);
+
+    d = _mm_adds_epu8(_mm_packus_epi16(d_lo, d_hi), s);
+    _mm_storeu_si128((__m128i *)(dst + i), d);
+  }
+  over_generic(dst + i, src + i, width - i);
+}
+
+static bool supported_avx2(void)
+{
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void over_avx2(uint32_t *dst, const uint32_t *src, int width)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+  const __m256i channel_mask = _mm256_set1_epi16(0xff);
+  const __m256i bias = _mm256_set1_epi16(0x80);
+  const __m256i scale = _mm256_set1_epi16(0x101);
+
+  // Unpacking and packing both work within each 128-bit lane, so pixels end up
+  // where they started.
+  int i = 0;
+  for(; i + 8 <= width; i += 8)
+  {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(s, zero)) == -1)
+      continue;
+
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, alpha_mask), alpha_mask)) == -1)
+    {
+      _mm256_storeu_si256((__m256i *)(dst + i), s);
+      continue;
+    }
+
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i d_lo = _mm256_unpacklo_epi8(d, zero);
+    __m256i d_hi = _mm256_unpackhi_epi8(d, zero);
+
+    __m256i a_lo = _mm256_unpacklo_epi8(s, zero);
+    __m256i a_hi = _mm256_unpackhi_epi8(s, zero);
+    a_lo = _mm256_xor_si256(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(a_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), channel_mask);
+    a_hi = _mm256_xor_si256(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(a_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), channel_mask);
+
+    d_lo = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(d_lo, a_lo), bias), scale);
+    d_hi = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_mullo_epi16(d_hi, a_hi), bias), scale);
+
+    d = _mm256_adds_epu8(_mm256_packus_epi16(d_lo, d_hi), s);
+    _mm256_storeu_si256((__m256i *)(dst + i), d);
+  }
+  over_sse2(dst + i, src + i, width - i);
+}
+#endif // BLEND_X86
+
+#ifdef BLEND_NEON
+static bool supported_neon(void)
+{
+  return true;
+}
+
+static void over_neon(uint32_t *dst, const uint32_t *src, int width)
+{
+  // Deinterleave 8 pixels at a time into one vector per channel, with the alpha
+  // channel last.
+  int i = 0;
+  for(; i + 8 <= width; i += 8)
+  {
+    uint8x8x4_t s = vld4_u8((const uint8_t *)(src + i));
+    uint8x8_t any = vorr_u8(vorr_u8(s.val[0], s.val[1]), vorr_u8(s.val[2], s.val[3]));
+    if(vget_lane_u64(vreinterpret_u64_u8(any), 0) == 0)
+      continue;
+
+    uint8x8x4_t d = vld4_u8((const uint8_t *)(dst + i));
+    uint8x8_t alpha = vmvn_u8(s.val[3]);
+    for(int c=0; c<4; ++c)
+    {
+      // ((t + ((t + 0x80) >> 8)) + 0x80) >> 8 for t = x * y, which is the same
+      // as in over_pixel().
+      uint16x8_t t = vmull_u8(d.val[c], alpha);
+      d.val[c] = vqadd_u8(vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8), s.val[c]);
+    }
+    vst4_u8((uint8_t *)(dst + i), d);
+  }
+  over_generic(dst + i, src + i, width - i);
+}
+#endif // BLEND_NEON
+
+// From the best to the worst.
+static const struct blend_kernels KERNELS[] = {
+#ifdef BLEND_X86
+  { "avx2", supported_avx2, over_avx2 },
+  { "sse2", supported_sse2, over_sse2 },
+#endif
+#ifdef BLEND_NEON
+  { "neon", supported_neon, over_neon },
+#endif
+  { "generic", supported_generic, over_generic },
+};
+
+static const struct blend_kernels *kernels = &KERNELS[sizeof KERNELS / sizeof *KERNELS - 1];
+
+// Run before main() so that the kernels never change once there may be other
+// threads using them.
+__attribute__((constructor))
+static void blend_init(void)
+{
+#ifdef BLEND_X86
+  __builtin_cpu_init();
+#endif
+
+  for(size_t i=0; i<sizeof KERNELS / sizeof *KERNELS; ++i)
+    if(KERNELS[i].supported())
+    {
+      kernels = &KERNELS[i];
+      return;
+    }
+}
+
+bool blend_select(const char *name)
+{
+  for(size_t i=0; i<sizeof KERNELS / sizeof *KERNELS; ++i)
+    if(strcmp(KERNELS[i].name, name) == 0)
+    {
+      if(!KERNELS[i].supported())
+        return false;
+
+      kernels = &KERNELS[i];
+      return true;
+    }
+  return false;
+}
+
+const char *blend_selected(void)
+{
+  return kernels->name;
+}
+
+static bool intersect(cairo_rectangle_int_t *rect, const cairo_rectangle_int_t *other)
+{
+  int x1 = rect->x > other->x ? rect->x : other->x;
+  int y1 = rect->y > other->y ? rect->y : other->y;
+  int x2 = rect->x + rect->width < other->x + other->width ? rect->x + rect->width : other->x + other->width;
+  int y2 = rect->y + rect->height < other->y + other->height ? rect->y + rect->height : other->y + other->height;
+  if(x1 >= x2 || y1 >= y2)
+    return false;
+
+  rect->x = x1;
+  rect->y = y1;
+  rect->width = x2 - x1;
+  rect->height = y2 - y1;
+  return true;
+}
+
+static void blend(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region, bool over)
+{
+  unsigned char *dst_data = cairo_image_surface_get_data(dst);
+  int dst_stride = cairo_image_surface_get_stride(dst);
+
+  cairo_rectangle_int_t bounds = { 0, 0, cairo_image_surface_get_width(dst), cairo_image_surface_get_height(dst) };
+
+  const unsigned char *src_data = NULL;
+  int src_stride = 0;
+  if(src)
+  {
+    src_data = cairo_image_surface_get_data(src);
+    src_stride = cairo_image_surface_get_stride(src);
+
+    cairo_rectangle_int_t src_bounds = { src_x, src_y, cairo_image_surface_get_width(src), cairo_image_surface_get_height(src) };
+    if(!intersect(&bounds, &src_bounds))
+      return;
+  }
+
+  int n = region ? cairo_region_num_rectangles(region) : 1;
+  for(int i=0; i<n; ++i)
+  {
+    cairo_rectangle_int_t rect = bounds;
+    if(region)
+    {
+      cairo_region_get_rectangle(region, i, &rect);
+      if(!intersect(&rect, &bounds))
+        continue;
+    }
+
+    for(int y=rect.y; y<rect.y + rect.height; ++y)
+    {
+      uint32_t *dst_row = (uint32_t *)(dst_data + (size_t)y * dst_stride) + rect.x;
+      if(!src)
+      {
+        memset(dst_row, 0, rect.width * sizeof *dst_row);
+        continue;
+      }
+
+      const uint32_t *src_row = (const uint32_t *)(src_data + (size_t)(y - src_y) * src_stride) + (rect.x - src_x);
+      if(over)
+        kernels->over(dst_row, src_row, rect.width);
+      else
+        memcpy(dst_row, src_row, rect.width * sizeof *dst_row);
+    }
+  }
+}
+
+void blend_copy_unlocked(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region)
+{
+  blend(dst, src, src_x, src_y, region, false);
+}
+
+void blend_over_unlocked(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region)
+{
+  if(src)
+    blend(dst, src, src_x, src_y, region, true);
+}
+
+void blend_copy(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region)
+{
+  if(src)
+    cairo_surface_flush(src);
+  cairo_surface_flush(dst);
+  blend_copy_unlocked(dst, src, src_x, src_y, region);
+  cairo_surface_mark_dirty(dst);
+}
+
+void blend_over(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region)
+{
+  if(!src)
+    return;
+
+  cairo_surface_flush(src);
+  cairo_surface_flush(dst);
+  blend_over_unlocked(dst, src, src_x, src_y, region);
+  cairo_surface_mark_dirty(dst);
+}
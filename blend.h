@@ -0,0 +1,37 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+// Compositing kernels for ARGB32 image surfaces, which give bit-exact results
+// to cairo with CAIRO_OPERATOR_OVER and CAIRO_OPERATOR_SOURCE, but skip fully
+// transparent pixels of the source and avoid the per-call setup of cairo.
+//
+// The best kernels supported by the CPU are selected at startup.
+
+#include <cairo.h>
+
+#include <stdbool.h>
+
+// Select kernels by name, one of "avx2", "sse2", "neon" or "generic". Returns
+// false if they are not supported by this build or this CPU.
+bool blend_select(const char *name);
+
+// Name of the kernels in use.
+const char *blend_selected(void);
+
+// Copy src, whose top-left corner is at (src_x, src_y) on dst, onto dst within
+// region, or everywhere if region is NULL. If src is NULL, dst is cleared to
+// transparent instead.
+void blend_copy(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region);
+
+// Composite src, whose top-left corner is at (src_x, src_y) on dst, onto dst
+// with CAIRO_OPERATOR_OVER within region, or everywhere if region is NULL.
+void blend_over(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region);
+
+// Same as blend_copy() and blend_over(), except that neither surface is
+// flushed before, nor is dst marked dirty after, which is left to the caller.
+// As a result, they can be called on the same dst from multiple threads at
+// once, as long as the regions do not overlap.
+void blend_copy_unlocked(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region);
+void blend_over_unlocked(cairo_surface_t *dst, cairo_surface_t *src, int src_x, int src_y, const cairo_region_t *region);
+
+#endif // BLEND_H
@@ -1,6 +1,7 @@
 #include "cairo-utils.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -33,3 +34,89 @@ cairo_surface_t *cairo_image_surface_clone(cairo_surface_t *surface)
   return new_surface;
 }
 
+void cairo_rectangle_int_downsample(cairo_rectangle_int_t *rect, int factor)
+{
+  int x1 = floor((double)rect->x / factor);
+  int y1 = floor((double)rect->y / factor);
+  int x2 = ceil((double)(rect->x + rect->width) / factor);
+  int y2 = ceil((double)(rect->y + rect->height) / factor);
+  *rect = (cairo_rectangle_int_t){ x1, y1, x2 - x1, y2 - y1 };
+}
+
+cairo_region_t *cairo_region_downsample(const cairo_region_t *region, int factor)
+{
+  cairo_region_t *result = cairo_region_create();
+
+  int n = cairo_region_num_rectangles(region);
+  for(int i=0; i<n; ++i)
+  {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(region, i, &rect);
+    cairo_rectangle_int_downsample(&rect, factor);
+    cairo_region_union_rectangle(result, &rect);
+  }
+
+  return result;
+}
+
+void cairo_rectangle_int_union(cairo_rectangle_int_t *rect, const cairo_rectangle_int_t *other)
+{
+  if(other->width <= 0 || other->height <= 0)
+    return;
+
+  if(rect->width <= 0 || rect->height <= 0)
+  {
+    *rect = *other;
+    return;
+  }
+
+  int x1 = rect->x < other->x ? rect->x : other->x;
+  int y1 = rect->y < other->y ? rect->y : other->y;
+  int x2 = rect->x + rect->width > other->x + other->width ? rect->x + rect->width : other->x + other->width;
+  int y2 = rect->y + rect->height > other->y + other->height ? rect->y + rect->height : other->y + other->height;
+
+  rect->x = x1;
+  rect->y = y1;
+  rect->width = x2 - x1;
+  rect->height = y2 - y1;
+}
+
+bool cairo_rectangle_int_intersect(cairo_rectangle_int_t *rect, const cairo_rectangle_int_t *other)
+{
+  int x1 = rect->x > other->x ? rect->x : other->x;
+  int y1 = rect->y > other->y ? rect->y : other->y;
+  int x2 = rect->x + rect->width < other->x + other->width ? rect->x + rect->width : other->x + other->width;
+  int y2 = rect->y + rect->height < other->y + other->height ? rect->y + rect->height : other->y + other->height;
+  if(x1 >= x2 || y1 >= y2)
+    return false;
+
+  rect->x = x1;
+  rect->y = y1;
+  rect->width = x2 - x1;
+  rect->height = y2 - y1;
+  return true;
+}
+
+void cairo_clip_region(cairo_t *cairo, const cairo_region_t *region)
+{
+  int n = cairo_region_num_rectangles(region);
+  for(int i=0; i<n; ++i)
+  {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(region, i, &rect);
+    cairo_rectangle(cairo, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_clip(cairo);
+}
+
+void cairo_stroke_extents_int(cairo_t *cairo, cairo_rectangle_int_t *extents)
+{
+  double x1, y1, x2, y2;
+  cairo_stroke_extents(cairo, &x1, &y1, &x2, &y2);
+
+  // Round outwards and leave one more pixel on each side for antialiasing.
+  extents->x = floor(x1) - 1;
+  extents->y = floor(y1) - 1;
+  extents->width = ceil(x2) + 1 - extents->x;
+  extents->height = ceil(y2) + 1 - extents->y;
+}
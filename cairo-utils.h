@@ -8,7 +8,29 @@
 
 #include <cairo.h>
 
+#include <stdbool.h>
+
 void cairo_image_surface_copy(cairo_surface_t *dst, cairo_surface_t *src);
 cairo_surface_t *cairo_image_surface_clone(cairo_surface_t *surface);
 
+// Shrink a rectangle by an integer factor to the smallest one covering it.
+void cairo_rectangle_int_downsample(cairo_rectangle_int_t *rect, int factor);
+
+// Create the smallest region covering region once shrunk by an integer factor.
+cairo_region_t *cairo_region_downsample(const cairo_region_t *region, int factor);
+
+// Grow a rectangle to also cover another rectangle. Empty rectangles are
+// ignored.
+void cairo_rectangle_int_union(cairo_rectangle_int_t *rect, const cairo_rectangle_int_t *other);
+
+// Shrink a rectangle to its intersection with another rectangle. Return false,
+// leaving the rectangle untouched, if they do not intersect.
+bool cairo_rectangle_int_intersect(cairo_rectangle_int_t *rect, const cairo_rectangle_int_t *other);
+
+// Intersect the current clip with a region.
+void cairo_clip_region(cairo_t *cairo, const cairo_region_t *region);
+
+// Compute the integer extents of the current path if it were to be stroked.
+void cairo_stroke_extents_int(cairo_t *cairo, cairo_rectangle_int_t *extents);
+
 #endif // CAIRO_UTILS_H
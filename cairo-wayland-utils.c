@@ -1,6 +1,7 @@
 #include "cairo-wayland-utils.h"
 
 #include "shm.h"
+#include "stats.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -59,6 +60,7 @@ struct wl_buffer *wl_buffer_from_cairo_surface(cairo_surface_t *surface,
   }
 
   memcpy(storage, data, size);
+  stats_count(STATS_SHM_BYTES, size);
   cairo_surface_unmap_image(surface, image);
 
   struct wl_shm_pool *shm_pool = wl_shm_create_pool(shm, fd, size);
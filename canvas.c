@@ -0,0 +1,338 @@
+#include "canvas.h"
+
+#include "blend.h"
+#include "rle.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+// Updated by workers compositing strokes too.
+static struct
+{
+  atomic_size_t tiles;
+  atomic_size_t compressed_tiles;
+  atomic_size_t compressed_bytes;
+  atomic_size_t mapped_tiles;
+} canvas_stats;
+
+static void tile_map(struct tile *tile)
+{
+  tile->cairo_surface = cairo_image_surface_create_for_data((unsigned char *)tile->data,
+      CAIRO_FORMAT_ARGB32,
+      TILE_SIZE,
+      TILE_SIZE,
+      TILE_SIZE * sizeof *tile->data);
+}
+
+static struct tile *tile_new(void)
+{
+  struct tile *tile = calloc(1, sizeof *tile);
+  tile->refcount = 1;
+  tile->data = calloc(TILE_PIXELS, sizeof *tile->data);
+  tile_map(tile);
+
+  canvas_stats.tiles += 1;
+  return tile;
+}
+
+struct tile *tile_new_mapped(uint32_t *data)
+{
+  struct tile *tile = calloc(1, sizeof *tile);
+  tile->refcount = 1;
+  tile->data = data;
+  tile->mapped = true;
+  tile_map(tile);
+
+  canvas_stats.tiles += 1;
+  canvas_stats.mapped_tiles += 1;
+  return tile;
+}
+
+struct tile *tile_ref(struct tile *tile)
+{
+  if(tile)
+    tile->refcount += 1;
+  return tile;
+}
+
+void tile_unref(struct tile *tile)
+{
+  if(!tile)
+    return;
+
+  assert(tile->refcount > 0);
+  if(--tile->refcount == 0)
+  {
+    if(tile->compressed)
+    {
+      canvas_stats.compressed_tiles -= 1;
+      canvas_stats.compressed_bytes -= tile->compressed_size;
+      free(tile->compressed);
+    }
+    else
+    {
+      cairo_surface_destroy(tile->cairo_surface);
+      if(tile->mapped)
+        canvas_stats.mapped_tiles -= 1;
+      else
+        free(tile->data);
+    }
+
+    canvas_stats.tiles -= 1;
+    free(tile);
+  }
+}
+
+void tile_compress(struct tile *tile)
+{
+  if(tile->compressed || tile->mapped)
+    return;
+
+  cairo_surface_flush(tile->cairo_surface);
+
+  uint8_t *buffer = malloc(rle_bound(TILE_PIXELS));
+  size_t size = rle_encode(tile->data, TILE_PIXELS, TILE_SIZE, buffer);
+
+  // Not worth it.
+  if(size >= TILE_PIXELS * sizeof *tile->data)
+  {
+    free(buffer);
+    return;
+  }
+
+  tile->compressed = realloc(buffer, size);
+  tile->compressed_size = size;
+
+  cairo_surface_destroy(tile->cairo_surface);
+  free(tile->data);
+  tile->cairo_surface = NULL;
+  tile->data = NULL;
+
+  canvas_stats.compressed_tiles += 1;
+  canvas_stats.compressed_bytes += size;
+}
+
+void tile_decompress(struct tile *tile)
+{
+  if(!tile->compressed)
+    return;
+
+  tile->data = malloc(TILE_PIXELS * sizeof *tile->data);
+  rle_decode(tile->compressed, tile->compressed_size, tile->data, TILE_PIXELS, TILE_SIZE);
+  tile_map(tile);
+
+  canvas_stats.compressed_tiles -= 1;
+  canvas_stats.compressed_bytes -= tile->compressed_size;
+
+  free(tile->compressed);
+  tile->compressed = NULL;
+  tile->compressed_size = 0;
+}
+
+void canvas_get_stats(struct canvas_stats *stats)
+{
+  stats->tiles = canvas_stats.tiles;
+  stats->compressed_tiles = canvas_stats.compressed_tiles;
+  stats->compressed_bytes = canvas_stats.compressed_bytes;
+  stats->mapped_tiles = canvas_stats.mapped_tiles;
+  stats->bytes = (stats->tiles - stats->compressed_tiles - stats->mapped_tiles) * TILE_PIXELS * sizeof(uint32_t) + stats->compressed_bytes;
+}
+
+struct canvas *canvas_new(uint32_t width, uint32_t height)
+{
+  struct canvas *canvas = calloc(1, sizeof *canvas);
+  canvas->width = width;
+  canvas->height = height;
+  canvas->columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+  canvas->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  canvas->tiles = calloc((size_t)canvas->columns * canvas->rows, sizeof *canvas->tiles);
+  return canvas;
+}
+
+struct canvas *canvas_clone(const struct canvas *canvas)
+{
+  struct canvas *new_canvas = canvas_new(canvas->width, canvas->height);
+  for(size_t i=0; i<(size_t)canvas->columns * canvas->rows; ++i)
+    new_canvas->tiles[i] = tile_ref(canvas->tiles[i]);
+  return new_canvas;
+}
+
+void canvas_destroy(struct canvas *canvas)
+{
+  for(size_t i=0; i<(size_t)canvas->columns * canvas->rows; ++i)
+    tile_unref(canvas->tiles[i]);
+
+  free(canvas->tiles);
+  free(canvas);
+}
+
+// Compute the range of tiles intersecting a rectangle, clamped to the canvas.
+static bool canvas_tile_range(const struct canvas *canvas, int x1, int y1, int x2, int y2,
+                              uint32_t *column_begin, uint32_t *row_begin,
+                              uint32_t *column_end, uint32_t *row_end)
+{
+  if(x1 < 0) x1 = 0;
+  if(y1 < 0) y1 = 0;
+  if(x2 > (int)canvas->width) x2 = canvas->width;
+  if(y2 > (int)canvas->height) y2 = canvas->height;
+  if(x1 >= x2 || y1 >= y2)
+    return false;
+
+  *column_begin = x1 / TILE_SIZE;
+  *row_begin = y1 / TILE_SIZE;
+  *column_end = (x2 + TILE_SIZE - 1) / TILE_SIZE;
+  *row_end = (y2 + TILE_SIZE - 1) / TILE_SIZE;
+  return true;
+}
+
+void canvas_decompress(struct canvas *canvas, const cairo_region_t *region)
+{
+  cairo_rectangle_int_t extents;
+  cairo_region_get_extents(region, &extents);
+
+  uint32_t column_begin, row_begin, column_end, row_end;
+  if(!canvas_tile_range(canvas, extents.x, extents.y, extents.x + extents.width, extents.y + extents.height, &column_begin, &row_begin, &column_end, &row_end))
+    return;
+
+  for(uint32_t row=row_begin; row<row_end; ++row)
+    for(uint32_t column=column_begin; column<column_end; ++column)
+    {
+      struct tile *tile = canvas->tiles[row * canvas->columns + column];
+      if(!tile)
+        continue;
+
+      cairo_rectangle_int_t rect = { column * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE };
+      if(cairo_region_contains_rectangle(region, &rect) != CAIRO_REGION_OVERLAP_OUT)
+        tile_decompress(tile);
+    }
+}
+
+void canvas_compress(struct canvas *canvas)
+{
+  for(size_t i=0; i<(size_t)canvas->columns * canvas->rows; ++i)
+    if(canvas->tiles[i])
+      tile_compress(canvas->tiles[i]);
+}
+
+void canvas_clear(struct canvas *canvas)
+{
+  for(size_t i=0; i<(size_t)canvas->columns * canvas->rows; ++i)
+  {
+    tile_unref(canvas->tiles[i]);
+    canvas->tiles[i] = NULL;
+  }
+}
+
+void canvas_paint(const struct canvas *canvas, cairo_surface_t *surface, const cairo_region_t *region)
+{
+  cairo_rectangle_int_t extents;
+  cairo_region_get_extents(region, &extents);
+
+  uint32_t column_begin, row_begin, column_end, row_end;
+  if(!canvas_tile_range(canvas, extents.x, extents.y, extents.x + extents.width, extents.y + extents.height, &column_begin, &row_begin, &column_end, &row_end))
+    return;
+
+  // The damage of an output is usually a handful of small rectangles scattered
+  // all over it, whose extents cover most of the output. Skip the tiles in
+  // between.
+  for(uint32_t row=row_begin; row<row_end; ++row)
+    for(uint32_t column=column_begin; column<column_end; ++column)
+    {
+      struct tile *tile = canvas->tiles[row * canvas->columns + column];
+
+      int x = column * TILE_SIZE;
+      int y = row * TILE_SIZE;
+      int width = canvas->width - x < TILE_SIZE ? (int)canvas->width - x : TILE_SIZE;
+      int height = canvas->height - y < TILE_SIZE ? (int)canvas->height - y : TILE_SIZE;
+
+      cairo_rectangle_int_t rect = { x, y, width, height };
+      cairo_region_t *part;
+      switch(cairo_region_contains_rectangle(region, &rect))
+      {
+      case CAIRO_REGION_OVERLAP_OUT:
+        continue;
+      case CAIRO_REGION_OVERLAP_IN:
+        part = cairo_region_create_rectangle(&rect);
+        break;
+      case CAIRO_REGION_OVERLAP_PART:
+      default:
+        part = cairo_region_copy(region);
+        cairo_region_intersect_rectangle(part, &rect);
+        break;
+      }
+
+      if(tile)
+      {
+        assert(!tile->compressed);
+        blend_copy_unlocked(surface, tile->cairo_surface, x, y, part);
+      }
+      else
+        blend_copy_unlocked(surface, NULL, 0, 0, part);
+
+      cairo_region_destroy(part);
+    }
+}
+
+static bool is_transparent(cairo_surface_t *surface, int x1, int y1, int x2, int y2)
+{
+  int width = cairo_image_surface_get_width(surface);
+  int height = cairo_image_surface_get_height(surface);
+  if(x1 < 0) x1 = 0;
+  if(y1 < 0) y1 = 0;
+  if(x2 > width) x2 = width;
+  if(y2 > height) y2 = height;
+
+  const unsigned char *data = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  for(int y=y1; y<y2; ++y)
+  {
+    const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+    for(int x=x1; x<x2; ++x)
+      if(row[x] != 0)
+        return false;
+  }
+  return true;
+}
+
+void canvas_composite(struct canvas *canvas, cairo_surface_t *layer, int layer_x, int layer_y, const cairo_rectangle_int_t *extents)
+{
+  cairo_surface_flush(layer);
+
+  uint32_t column_begin, row_begin, column_end, row_end;
+  if(!canvas_tile_range(canvas, extents->x, extents->y, extents->x + extents->width, extents->y + extents->height, &column_begin, &row_begin, &column_end, &row_end))
+    return;
+
+  for(uint32_t row=row_begin; row<row_end; ++row)
+    for(uint32_t column=column_begin; column<column_end; ++column)
+    {
+      int x = column * TILE_SIZE;
+      int y = row * TILE_SIZE;
+      int x2 = x + TILE_SIZE < (int)canvas->width ? x + TILE_SIZE : (int)canvas->width;
+      int y2 = y + TILE_SIZE < (int)canvas->height ? y + TILE_SIZE : (int)canvas->height;
+
+      // The extents of a stroke is a lot larger than what it actually covers
+      // for anything that is not axis-aligned. Do not unshare a tile unless we
+      // really have to.
+      if(is_transparent(layer, x - layer_x, y - layer_y, x2 - layer_x, y2 - layer_y))
+        continue;
+
+      struct tile **slot = &canvas->tiles[row * canvas->columns + column];
+      struct tile *tile = tile_new();
+      if(*slot)
+      {
+        tile_decompress(*slot);
+        memcpy(tile->data, (*slot)->data, TILE_PIXELS * sizeof *tile->data);
+        stats_count(STATS_TILE_BYTES, TILE_PIXELS * sizeof *tile->data);
+        cairo_surface_mark_dirty(tile->cairo_surface);
+      }
+
+      tile_unref(*slot);
+      *slot = tile;
+
+      blend_over(tile->cairo_surface, layer, layer_x - x, layer_y - y, NULL);
+    }
+}
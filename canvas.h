@@ -0,0 +1,105 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+// A canvas is an image split into a grid of fixed-size tiles.
+//
+// Tiles are reference counted and never modified once they are shared, so
+// that cloning a canvas only costs a grid of pointers, and a modified canvas
+// only owns the tiles that actually got modified. A fully transparent tile is
+// represented by NULL.
+//
+// Tiles that are not going to be needed anytime soon can be compressed. A
+// compressed tile is decompressed again transparently as soon as its content
+// is needed.
+//
+// A tile can also borrow its pixels from a mapping it does not own, such as a
+// session file. Such tiles are never compressed, since their pages can already
+// be dropped and read back by the kernel for free.
+//
+// Reference counts and stats are atomic, so that a clone of a canvas can be
+// modified on another thread, as long as the tiles it shares are neither
+// compressed nor decompressed in the meantime.
+
+#include <cairo.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TILE_SIZE 64
+
+struct tile
+{
+  atomic_uint refcount; // shared with workers compositing strokes
+  unsigned mark;
+
+  // Either both of these, if the tile is not compressed...
+  uint32_t *data;
+  cairo_surface_t *cairo_surface;
+
+  // ...or this.
+  uint8_t *compressed;
+  size_t compressed_size;
+
+  bool mapped;             // data is borrowed from a mapping
+  uint64_t session_offset; // offset of the pixels in the session file, 0 if not saved
+};
+
+// Create a tile whose pixels are borrowed from data, which must stay valid and
+// unmodified for as long as the tile lives.
+struct tile *tile_new_mapped(uint32_t *data);
+
+struct tile *tile_ref(struct tile *tile);
+void tile_unref(struct tile *tile);
+
+void tile_compress(struct tile *tile);
+void tile_decompress(struct tile *tile);
+
+struct canvas_stats
+{
+  size_t tiles;            // number of live tiles
+  size_t compressed_tiles; // number of those which are compressed
+  size_t compressed_bytes; // size of compressed tiles after compression
+  size_t mapped_tiles;     // number of tiles borrowing their pixels
+  size_t bytes;            // memory used by pixels of all tiles, except borrowed ones
+};
+
+void canvas_get_stats(struct canvas_stats *stats);
+
+struct canvas
+{
+  uint32_t width, height;
+  uint32_t columns, rows;
+  struct tile **tiles;
+};
+
+struct canvas *canvas_new(uint32_t width, uint32_t height);
+struct canvas *canvas_clone(const struct canvas *canvas);
+void canvas_destroy(struct canvas *canvas);
+
+// Decompress every tile within region.
+void canvas_decompress(struct canvas *canvas, const cairo_region_t *region);
+
+// Compress every tile, for a canvas that is not going to be looked at for a
+// while even though it is current.
+void canvas_compress(struct canvas *canvas);
+
+// Make every tile fully transparent.
+void canvas_clear(struct canvas *canvas);
+
+// Copy the part of the canvas within region onto surface, including fully
+// transparent tiles. Tiles outside region are skipped altogether.
+//
+// The tiles within region must have been decompressed with canvas_decompress()
+// beforehand. Like blend_copy_unlocked(), surface is not flushed nor marked
+// dirty, and it is fine to paint disjoint regions of the same surface from
+// multiple threads at once.
+void canvas_paint(const struct canvas *canvas, cairo_surface_t *surface, const cairo_region_t *region);
+
+// Composite layer, whose top-left corner is at (layer_x, layer_y) on the
+// canvas, onto the canvas with CAIRO_OPERATOR_OVER. Only tiles intersecting
+// extents in which the layer is not fully transparent are touched.
+void canvas_composite(struct canvas *canvas, cairo_surface_t *layer, int layer_x, int layer_y, const cairo_rectangle_int_t *extents);
+
+#endif // CANVAS_H
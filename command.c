@@ -0,0 +1,347 @@
+#include "command.h"
+
+#include "cairo-utils.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+void command_init(struct command *command, enum waydraw_mode mode, const double color[4], double weight)
+{
+  command->mode = mode;
+  command->smoothing = COMMAND_SMOOTHING_NONE;
+  memcpy(command->color, color, sizeof command->color);
+  command->weight = weight;
+  wl_array_init(&command->points);
+  command->extents = (cairo_rectangle_int_t){0};
+  command->finished = false;
+  command->previewed = 0;
+}
+
+void command_release(struct command *command)
+{
+  wl_array_release(&command->points);
+}
+
+size_t command_point_count(const struct command *command)
+{
+  return command->points.size / sizeof(struct command_point);
+}
+
+void command_add_point(struct command *command, double x, double y)
+{
+  struct command_point *point;
+  if(command->mode != WAYDRAW_MODE_BRUSH && command_point_count(command) == 2)
+    point = (struct command_point *)command->points.data + 1;
+  else
+    point = wl_array_add(&command->points, sizeof *point);
+
+  point->x = x;
+  point->y = y;
+
+  // Any other shape than a brush stroke has to be drawn all over again.
+  if(command->mode != WAYDRAW_MODE_BRUSH)
+    command->previewed = 0;
+}
+
+void command_finish(struct command *command)
+{
+  command->finished = true;
+}
+
+void command_setup(const struct command *command, cairo_t *cairo)
+{
+  cairo_set_source_rgba(cairo,
+      command->color[0],
+      command->color[1],
+      command->color[2],
+      command->color[3]
+  );
+
+  cairo_set_line_width(cairo, command->weight);
+  cairo_set_line_cap(cairo, CAIRO_LINE_CAP_ROUND);
+  cairo_set_line_join(cairo, CAIRO_LINE_JOIN_ROUND);
+}
+
+size_t command_segment_count(const struct command *command)
+{
+  size_t count = command_point_count(command);
+  if(count == 0)
+    return 0;
+  if(command->mode != WAYDRAW_MODE_BRUSH)
+    return 1;
+
+  switch(command->smoothing)
+  {
+  case COMMAND_SMOOTHING_QUADRATIC:
+    return command->finished && count > 1 ? count + 1 : count;
+  case COMMAND_SMOOTHING_CATMULL_ROM:
+    return command->finished || count == 1 ? count : count - 1;
+  default:
+    return count;
+  }
+}
+
+static struct command_point lerp(const struct command_point *a, const struct command_point *b, double t)
+{
+  return (struct command_point){ a->x + (b->x - a->x) * t, a->y + (b->y - a->y) * t };
+}
+
+// Tangent of a Catmull-Rom spline at one end of the segment from a to b, given
+// the points before and after that end, scaled to the offset of the control
+// point of the matching bezier curve. It is kept within a third of the segment,
+// since points left by the input filter can be spaced very unevenly, and the
+// curve would loop around otherwise.
+static struct command_point catmull_rom_tangent(const struct command_point *before, const struct command_point *after, const struct command_point *a, const struct command_point *b)
+{
+  double dx = (after->x - before->x) / 6.0;
+  double dy = (after->y - before->y) / 6.0;
+  double length = sqrt(dx * dx + dy * dy);
+  double limit = hypot(b->x - a->x, b->y - a->y) / 3.0;
+  if(length > limit)
+  {
+    dx *= limit / length;
+    dy *= limit / length;
+  }
+  return (struct command_point){ dx, dy };
+}
+
+// Control points of a segment of a brush stroke as a cubic bezier curve. Return
+// false if it is a straight line, in which case the two in the middle are the
+// same as the ends.
+static bool brush_segment(const struct command *command, size_t index, struct command_point curve[4])
+{
+  const struct command_point *points = command->points.data;
+  size_t count = command_point_count(command);
+
+  // The first segment of a brush stroke is a single dot where the stroke
+  // starts.
+  if(index == 0)
+  {
+    curve[0] = curve[1] = curve[2] = curve[3] = points[0];
+    return false;
+  }
+
+  switch(command->smoothing)
+  {
+  case COMMAND_SMOOTHING_QUADRATIC:
+    {
+      // From the middle of the previous line to the middle of this one, with
+      // the point in between as control point. The first and the last
+      // segments only go half way along a line, and stay straight.
+      const struct command_point *control = &points[index - 1];
+      curve[0] = index == 1 ? points[0] : lerp(&points[index - 2], control, 0.5);
+      curve[3] = index == count ? points[count - 1] : lerp(control, &points[index], 0.5);
+      if(index == 1 || index == count)
+      {
+        curve[1] = curve[0];
+        curve[2] = curve[3];
+        return false;
+      }
+
+      curve[1] = lerp(&curve[0], control, 2.0 / 3.0);
+      curve[2] = lerp(&curve[3], control, 2.0 / 3.0);
+      return true;
+    }
+  case COMMAND_SMOOTHING_CATMULL_ROM:
+    {
+      // The points before and after the segment are the ends themselves at
+      // either end of the stroke.
+      const struct command_point *a = &points[index - 1];
+      const struct command_point *b = &points[index];
+      const struct command_point *before = &points[index >= 2 ? index - 2 : index - 1];
+      const struct command_point *after = &points[index + 1 < count ? index + 1 : index];
+
+      struct command_point ta = catmull_rom_tangent(before, b, a, b);
+      struct command_point tb = catmull_rom_tangent(a, after, a, b);
+      curve[0] = *a;
+      curve[1] = (struct command_point){ a->x + ta.x, a->y + ta.y };
+      curve[2] = (struct command_point){ b->x - tb.x, b->y - tb.y };
+      curve[3] = *b;
+      return true;
+    }
+  default:
+    curve[0] = curve[1] = points[index - 1];
+    curve[2] = curve[3] = points[index];
+    return false;
+  }
+}
+
+void command_segment_path(const struct command *command, size_t index, cairo_t *cairo)
+{
+  const struct command_point *points = command->points.data;
+  size_t count = command_point_count(command);
+  assert(index < command_segment_count(command));
+
+  const struct command_point *from = &points[0];
+  const struct command_point *to = &points[count - 1];
+
+  switch(command->mode)
+  {
+  case WAYDRAW_MODE_BRUSH:
+    {
+      struct command_point curve[4];
+      bool curved = brush_segment(command, index, curve);
+      cairo_move_to(cairo, curve[0].x, curve[0].y);
+      if(curved)
+        cairo_curve_to(cairo, curve[1].x, curve[1].y, curve[2].x, curve[2].y, curve[3].x, curve[3].y);
+      else
+        cairo_line_to(cairo, curve[3].x, curve[3].y);
+    }
+    break;
+  case WAYDRAW_MODE_LINE:
+    cairo_move_to(cairo, from->x, from->y);
+    cairo_line_to(cairo, to->x, to->y);
+    break;
+  case WAYDRAW_MODE_RECTANGLE:
+    cairo_rectangle(cairo, from->x, from->y, to->x - from->x, to->y - from->y);
+    break;
+  case WAYDRAW_MODE_CIRCLE:
+    {
+      double dx = to->x - from->x;
+      double dy = to->y - from->y;
+      double radius = sqrt(dx * dx + dy * dy);
+      cairo_arc(cairo, from->x, from->y, radius, 0, 2.0 * M_PI);
+    }
+    break;
+  case WAYDRAW_MODE_CLEAR:
+  case WAYDRAW_MODE_COUNT:
+    break;
+  }
+}
+
+void command_segment_bounds(const struct command *command, size_t index, cairo_rectangle_int_t *bounds)
+{
+  const struct command_point *points = command->points.data;
+  size_t count = command_point_count(command);
+  assert(index < command_segment_count(command));
+
+  const struct command_point *from = &points[0];
+  const struct command_point *to = &points[count - 1];
+
+  // Round caps and joins never reach further than half of the line width from
+  // the path, which never leaves the convex hull of its control points.
+  double x1 = fmin(from->x, to->x);
+  double y1 = fmin(from->y, to->y);
+  double x2 = fmax(from->x, to->x);
+  double y2 = fmax(from->y, to->y);
+  double margin = command->weight / 2.0;
+  if(command->mode == WAYDRAW_MODE_BRUSH)
+  {
+    struct command_point curve[4];
+    brush_segment(command, index, curve);
+    x1 = x2 = curve[0].x;
+    y1 = y2 = curve[0].y;
+    for(int i=1; i<4; ++i)
+    {
+      x1 = fmin(x1, curve[i].x);
+      y1 = fmin(y1, curve[i].y);
+      x2 = fmax(x2, curve[i].x);
+      y2 = fmax(y2, curve[i].y);
+    }
+  }
+  else if(command->mode == WAYDRAW_MODE_CIRCLE)
+  {
+    double dx = to->x - from->x;
+    double dy = to->y - from->y;
+    double radius = sqrt(dx * dx + dy * dy);
+    x1 = x2 = from->x;
+    y1 = y2 = from->y;
+    margin += radius;
+  }
+
+  // Same rounding as cairo_stroke_extents_int(), with one more pixel for the
+  // tolerance cairo flattens curves with.
+  bounds->x = floor(x1 - margin) - 2;
+  bounds->y = floor(y1 - margin) - 2;
+  bounds->width = ceil(x2 + margin) + 2 - bounds->x;
+  bounds->height = ceil(y2 + margin) + 2 - bounds->y;
+}
+
+bool command_preview_bounds(const struct command *command, cairo_rectangle_int_t *bounds)
+{
+  size_t count = command_segment_count(command);
+  size_t first = command->previewed;
+  if(first >= count)
+    return false;
+
+  command_segment_bounds(command, first, bounds);
+  for(size_t i=first+1; i<count; ++i)
+  {
+    cairo_rectangle_int_t segment_bounds;
+    command_segment_bounds(command, i, &segment_bounds);
+    cairo_rectangle_int_union(bounds, &segment_bounds);
+  }
+  return true;
+}
+
+void command_preview(struct command *command, cairo_t *cairo, cairo_region_t *damage)
+{
+  cairo_rectangle_int_t extents;
+  if(command->mode == WAYDRAW_MODE_BRUSH)
+  {
+    size_t count = command_segment_count(command);
+    for(; command->previewed < count; ++command->previewed)
+    {
+      command_segment_path(command, command->previewed, cairo);
+      cairo_stroke_extents_int(cairo, &extents);
+      cairo_stroke(cairo);
+
+      cairo_region_union_rectangle(damage, &extents);
+      cairo_rectangle_int_union(&command->extents, &extents);
+      stats_count(STATS_PREVIEW_SEGMENTS, 1);
+    }
+    return;
+  }
+
+  // Nothing but the previous shape has been drawn, so only its extents, which
+  // already account for the line width, need to be cleared. They are rounded
+  // out to whole device pixels, or a scaled preview would only partly clear
+  // the pixels along the edges.
+  double x1 = command->extents.x;
+  double y1 = command->extents.y;
+  double x2 = command->extents.x + command->extents.width;
+  double y2 = command->extents.y + command->extents.height;
+  cairo_user_to_device(cairo, &x1, &y1);
+  cairo_user_to_device(cairo, &x2, &y2);
+  x1 = floor(x1);
+  y1 = floor(y1);
+  x2 = ceil(x2);
+  y2 = ceil(y2);
+  cairo_device_to_user(cairo, &x1, &y1);
+  cairo_device_to_user(cairo, &x2, &y2);
+
+  cairo_save(cairo);
+  cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+  cairo_rectangle(cairo, x1, y1, x2 - x1, y2 - y1);
+  cairo_fill(cairo);
+  cairo_restore(cairo);
+
+  command_segment_path(command, 0, cairo);
+  cairo_stroke_extents_int(cairo, &extents);
+  cairo_stroke(cairo);
+  stats_count(STATS_PREVIEW_SEGMENTS, 1);
+  command->previewed = 1;
+
+  // The old shape has been erased and the new shape has been drawn, so both of
+  // them need to be redrawn.
+  cairo_region_union_rectangle(damage, &command->extents);
+  cairo_region_union_rectangle(damage, &extents);
+  command->extents = extents;
+}
+
+void command_render(const struct command *command, cairo_t *cairo)
+{
+  cairo_save(cairo);
+  command_setup(command, cairo);
+
+  size_t count = command_segment_count(command);
+  for(size_t i=0; i<count; ++i)
+  {
+    command_segment_path(command, i, cairo);
+    cairo_stroke(cairo);
+  }
+
+  cairo_restore(cairo);
+}
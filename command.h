@@ -0,0 +1,106 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+// A drawing command records everything needed to redraw a single stroke from
+// scratch: the mode, the style and the points captured while drawing it.
+//
+// A command is drawn as a sequence of segments, each of which is stroked on
+// its own. The preview while drawing and the replay from history go through
+// the same segments in the same order, which is what makes a replayed stroke
+// identical to the one the user saw down to the last pixel.
+
+#include <cairo.h>
+
+#include <wayland-util.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum waydraw_mode
+{
+  WAYDRAW_MODE_BRUSH,
+
+  WAYDRAW_MODE_LINE,
+  WAYDRAW_MODE_RECTANGLE,
+  WAYDRAW_MODE_CIRCLE,
+
+  // Erase the whole canvas. Such a command has no points, and the whole canvas
+  // as extents.
+  WAYDRAW_MODE_CLEAR,
+
+  WAYDRAW_MODE_COUNT,
+};
+
+// How the segments of a brush stroke go from one point to the next. Curves
+// only get drawn up to a point once the next one is known, so they trail the
+// pointer by a point until the stroke is finished.
+enum command_smoothing
+{
+  COMMAND_SMOOTHING_NONE,        // straight lines
+  COMMAND_SMOOTHING_QUADRATIC,   // through the middle of each line
+  COMMAND_SMOOTHING_CATMULL_ROM, // through every point
+
+  COMMAND_SMOOTHING_COUNT,
+};
+
+struct command_point
+{
+  double x, y;
+};
+
+struct command
+{
+  enum waydraw_mode mode;
+  enum command_smoothing smoothing; // COMMAND_SMOOTHING_NONE unless set
+  double color[4];
+  double weight;
+
+  // In brush mode, every point kept by the input filter. Otherwise, only the
+  // start and the end point.
+  struct wl_array points;
+
+  // Extents of everything drawn by the command.
+  cairo_rectangle_int_t extents;
+
+  // Whether no more points are going to be added, which is always the case for
+  // commands in the history.
+  bool finished;
+
+  size_t previewed; // segments drawn by command_preview() so far
+};
+
+void command_init(struct command *command, enum waydraw_mode mode, const double color[4], double weight);
+void command_release(struct command *command);
+
+size_t command_point_count(const struct command *command);
+void command_add_point(struct command *command, double x, double y);
+
+// Mark the command as finished, which in brush mode may add a last segment up
+// to the last point.
+void command_finish(struct command *command);
+
+// Setup the source and the line style of cairo for drawing the command.
+void command_setup(const struct command *command, cairo_t *cairo);
+
+size_t command_segment_count(const struct command *command);
+void command_segment_path(const struct command *command, size_t index, cairo_t *cairo);
+
+// Compute integer bounds of everything stroking a segment may touch, without a
+// cairo context. These are never smaller than its stroke extents.
+void command_segment_bounds(const struct command *command, size_t index, cairo_rectangle_int_t *bounds);
+
+// Compute bounds of everything the next command_preview() may draw, or return
+// false if there is nothing new to draw.
+bool command_preview_bounds(const struct command *command, cairo_rectangle_int_t *bounds);
+
+// Update the preview of the command on cairo, which holds the preview drawn so
+// far, after points got added. In brush mode, only the new segments are drawn.
+// Otherwise, the extents of the previous shape are cleared and the new one is
+// drawn, so that the cost depends on the size of the shapes rather than that of
+// the surface. The area that changed is added to damage.
+void command_preview(struct command *command, cairo_t *cairo, cairo_region_t *damage);
+
+// Draw every segment of the command.
+void command_render(const struct command *command, cairo_t *cairo);
+
+#endif // COMMAND_H
@@ -0,0 +1,257 @@
+#include "control.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#include <sys/file.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// Seconds to wait for the running instance to answer a command.
+#define CONTROL_TIMEOUT 5
+
+
+// This should really be in the standard but it is not.
+static char *aprintf(const char *restrict format, ...)
+{
+  va_list ap;
+
+  va_start(ap, format);
+  int n = vsnprintf(NULL, 0, format, ap);
+  assert(n >= 0);
+  va_end(ap);
+
+  size_t size = n + 1;
+  char *buf = malloc(size);
+  assert(buf);
+
+  va_start(ap, format);
+  vsnprintf(buf, size, format, ap);
+  va_end(ap);
+
+  return buf;
+}
+
+char *control_path(void)
+{
+  char *wayland_display = getenv("WAYLAND_DISPLAY");
+  if(!wayland_display)
+  {
+    fprintf(stderr, "error: control: WAYLAND_DISPLAY not set - not running under a wayland compositor\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char *waydraw_display = getenv("WAYDRAW_DISPLAY");
+  if(!waydraw_display)
+    waydraw_display = "waydraw";
+
+  char *xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if(!xdg_runtime_dir)
+    xdg_runtime_dir = "/tmp";
+
+  return aprintf("%s/%s-%s", xdg_runtime_dir, waydraw_display, wayland_display);
+}
+
+static bool make_address(struct sockaddr_un *address, const char *path)
+{
+  *address = (struct sockaddr_un){ .sun_family = AF_UNIX };
+  if(strlen(path) >= sizeof address->sun_path)
+  {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+static char *path;
+static int fd = -1;
+
+// Where the last command read came from.
+static struct sockaddr_un sender;
+static socklen_t sender_size;
+
+void try_resume(void)
+{
+  path = control_path();
+
+  // Whoever holds the lock is the running instance, and keeps it until it
+  // exits.
+  char *lock_path = aprintf("%s.lock", path);
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(lock_fd < 0)
+  {
+    fprintf(stderr, "error: control: failed to open lock file at %s:%s\n", lock_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if(flock(lock_fd, LOCK_EX | LOCK_NB) < 0)
+  {
+    if(errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      fprintf(stderr, "error: control: failed to acquire lock on %s:%s\n", lock_path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    // The running instance might have only just taken the lock, and not be
+    // listening yet.
+    struct control_message message = { .command = CONTROL_COMMAND_RESUME };
+    int status;
+    for(int i=0; (status = send_command(path, &message, NULL, 0, NULL)) < 0 && (errno == ENOENT || errno == ECONNREFUSED) && i<100; ++i)
+      usleep(10000);
+
+    if(status < 0)
+    {
+      fprintf(stderr, "error: control: failed to send command to control socket at %s:%s\n", path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+  }
+  free(lock_path);
+
+  // Anything still at path was left behind by an instance that is gone, or is
+  // the named pipe older versions used.
+  if(unlink(path) < 0 && errno != ENOENT)
+  {
+    fprintf(stderr, "error: control: failed to remove stale control socket at %s:%s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_un address;
+  if(!make_address(&address, path))
+  {
+    fprintf(stderr, "error: control: path of control socket is too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if(fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof address) < 0)
+  {
+    fprintf(stderr, "error: control: failed to create control socket at %s:%s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+int control_fd(void)
+{
+  return fd;
+}
+
+bool read_command(struct control_message *message)
+{
+  for(;;)
+  {
+    sender_size = sizeof sender;
+    ssize_t n = recvfrom(fd, message, sizeof *message, MSG_TRUNC, (struct sockaddr *)&sender, &sender_size);
+    if(n < 0)
+    {
+      if(errno == EWOULDBLOCK || errno == EAGAIN)
+        return false;
+      if(errno == EINTR)
+        continue;
+
+      fprintf(stderr, "error: control: failed to read from control socket at %s: %s\n", path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    if((size_t)n == sizeof *message)
+      return true;
+
+    reply_command(CONTROL_STATUS_INVALID, NULL, 0);
+  }
+}
+
+void reply_command(int32_t status, const char *text, size_t size)
+{
+  // A sender that is not bound to an address cannot be answered.
+  if(sender_size <= sizeof(sa_family_t))
+    return;
+
+  struct iovec iov[] = {
+    { .iov_base = &status, .iov_len = sizeof status },
+    { .iov_base = (char *)text, .iov_len = size },
+  };
+
+  struct msghdr msghdr = {
+    .msg_name = &sender,
+    .msg_namelen = sender_size,
+    .msg_iov = iov,
+    .msg_iovlen = sizeof iov / sizeof iov[0],
+  };
+
+  // The sender might have given up already, which is fine.
+  sendmsg(fd, &msghdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+int send_command(const char *socket_path, const struct control_message *message, char *text, size_t size, size_t *text_size)
+{
+  struct sockaddr_un address;
+  if(!make_address(&address, socket_path))
+    return -1;
+
+  int client_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if(client_fd < 0)
+    return -1;
+
+  // Binding to an empty address gets an abstract one assigned, so that there
+  // is somewhere to answer to.
+  struct sockaddr_un local = { .sun_family = AF_UNIX };
+  struct timeval timeout = { .tv_sec = CONTROL_TIMEOUT };
+  if(bind(client_fd, (struct sockaddr *)&local, sizeof(sa_family_t)) < 0
+      || setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0
+      || connect(client_fd, (struct sockaddr *)&address, sizeof address) < 0
+      || send(client_fd, message, sizeof *message, 0) < 0)
+    goto fail;
+
+  int32_t status;
+  struct iovec iov[] = {
+    { .iov_base = &status, .iov_len = sizeof status },
+    { .iov_base = text, .iov_len = size },
+  };
+
+  struct msghdr msghdr = {
+    .msg_iov = iov,
+    .msg_iovlen = sizeof iov / sizeof iov[0],
+  };
+
+  ssize_t n = recvmsg(client_fd, &msghdr, 0);
+  if(n < 0)
+  {
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+      errno = ETIMEDOUT;
+    goto fail;
+  }
+
+  if((size_t)n < sizeof status)
+  {
+    errno = EPROTO;
+    goto fail;
+  }
+
+  if(text_size)
+    *text_size = n - sizeof status;
+
+  close(client_fd);
+  return status;
+
+fail:
+  {
+    int error = errno;
+    close(client_fd);
+    errno = error;
+    return -1;
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+// Commands sent to the running instance through its control socket, which is
+// a unix datagram socket at $XDG_RUNTIME_DIR/waydraw-$WAYLAND_DISPLAY.
+//
+// Each datagram is a single struct control_message, and is answered with a
+// datagram starting with a status as an int32_t, followed by text to be shown
+// to the user for some commands. A datagram of any other size is answered with
+// CONTROL_STATUS_INVALID.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum control_command
+{
+  CONTROL_COMMAND_RESUME = 'E',
+  CONTROL_COMMAND_HIBERNATE = 'h',
+  CONTROL_COMMAND_DETACH = 'H', // hibernate and stop showing the canvas
+  CONTROL_COMMAND_CLEAR = 'c',
+  CONTROL_COMMAND_UNDO = 'u',
+  CONTROL_COMMAND_REDO = 'r',
+  CONTROL_COMMAND_COLOR = 'C',
+  CONTROL_COMMAND_WEIGHT = 'w',
+  CONTROL_COMMAND_STATS = 's', // answered with the statistics
+};
+
+// Largest weight of the brush that can be set, far beyond any output, but
+// small enough for the cursor of that size to be allocated.
+#define CONTROL_MAX_WEIGHT 1024.0
+
+enum control_status
+{
+  CONTROL_STATUS_OK,
+  CONTROL_STATUS_INVALID,
+};
+
+struct control_message
+{
+  uint32_t command;
+  uint32_t reserved;
+  union
+  {
+    double color[4]; // CONTROL_COMMAND_COLOR
+    double weight;   // CONTROL_COMMAND_WEIGHT
+  };
+};
+
+// Path of the control socket. Exit if not running under a wayland compositor.
+char *control_path(void);
+
+// Become the running instance and start listening on the control socket, or
+// if there already is one, tell it to resume and exit.
+void try_resume(void);
+
+// The control socket, which becomes readable once a command has been sent.
+int control_fd(void);
+
+// Read the next command that has been sent into message, or return false if
+// there is none. Every command read must be answered with reply_command()
+// before reading the next one.
+bool read_command(struct control_message *message);
+
+// Answer the last command read, with text of the given size which may be 0.
+// The sender is not waited for if it is not reading.
+void reply_command(int32_t status, const char *text, size_t size);
+
+// Send a command to the running instance listening at socket_path and wait
+// for its answer. Return its status, with the text that came with it stored in
+// text up to size bytes and its size in *text_size, or -1 with errno set if
+// the command could not be sent or was not answered in time.
+int send_command(const char *socket_path, const struct control_message *message, char *text, size_t size, size_t *text_size);
+
+#endif // CONTROL_H
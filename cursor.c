@@ -0,0 +1,209 @@
+#include "cursor.h"
+
+#include "shm.h"
+#include "stats.h"
+
+#include <cairo.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+// Weights are quantized to this fraction of a pixel, which is finer than what
+// anyone can tell apart on a cursor.
+#define CURSOR_WEIGHT_STEPS 4
+
+// Enough for a dozen cursors of a typical size before the pool has to grow.
+#define CURSOR_POOL_SIZE (64 * 1024)
+
+static void release_buffer(void *data, struct wl_buffer *wl_buffer)
+{
+  (void)wl_buffer;
+
+  struct cursor *cursor = data;
+  cursor->busy = false;
+}
+
+static struct wl_buffer_listener buffer_listener = {
+  .release = &release_buffer,
+};
+
+static void map_pool(struct cursor_cache *cache)
+{
+  cache->data = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+  if(cache->data == MAP_FAILED)
+  {
+    fprintf(stderr, "error: failed to mmap shm file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+struct cursor_cache *cursor_cache_new(struct wl_shm *wl_shm)
+{
+  struct cursor_cache *cache = calloc(1, sizeof *cache);
+  cache->wl_shm = wl_shm;
+  cache->size = CURSOR_POOL_SIZE;
+  wl_list_init(&cache->cursors);
+
+  cache->fd = allocate_shm_file(cache->size);
+  if(cache->fd < 0)
+  {
+    fprintf(stderr, "error: failed to open shm file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  map_pool(cache);
+  cache->wl_shm_pool = wl_shm_create_pool(wl_shm, cache->fd, cache->size);
+  return cache;
+}
+
+static void cursor_destroy(struct cursor_cache *cache, struct cursor *cursor)
+{
+  wl_list_remove(&cursor->link);
+  wl_buffer_destroy(cursor->wl_buffer);
+  free(cursor);
+  cache->count -= 1;
+}
+
+void cursor_cache_destroy(struct cursor_cache *cache)
+{
+  struct cursor *cursor, *tmp;
+  wl_list_for_each_safe(cursor, tmp, &cache->cursors, link)
+    cursor_destroy(cache, cursor);
+
+  wl_shm_pool_destroy(cache->wl_shm_pool);
+  munmap(cache->data, cache->size);
+  close(cache->fd);
+  free(cache);
+}
+
+int cursor_size(double weight)
+{
+  long quantized = lround(weight * CURSOR_WEIGHT_STEPS);
+  return ceil((double)quantized / CURSOR_WEIGHT_STEPS);
+}
+
+static bool range_is_free(struct cursor_cache *cache, size_t offset, size_t size)
+{
+  if(offset + size > cache->size)
+    return false;
+
+  struct cursor *cursor;
+  wl_list_for_each(cursor, &cache->cursors, link)
+  {
+    size_t bytes = (size_t)cursor->size * cursor->size * 4;
+    if(offset < cursor->offset + bytes && cursor->offset < offset + size)
+      return false;
+  }
+  return true;
+}
+
+// Find room for size bytes in the pool, right after one of the cursors or at
+// the start, and grow the pool if there is none.
+static size_t allocate(struct cursor_cache *cache, size_t size)
+{
+  if(range_is_free(cache, 0, size))
+    return 0;
+
+  size_t end = 0;
+  struct cursor *cursor;
+  wl_list_for_each(cursor, &cache->cursors, link)
+  {
+    size_t offset = cursor->offset + (size_t)cursor->size * cursor->size * 4;
+    if(range_is_free(cache, offset, size))
+      return offset;
+
+    if(offset > end)
+      end = offset;
+  }
+
+  // A pool can only grow, but buffers already created from it keep their
+  // offsets.
+  size_t new_size = cache->size * 2 > end + size ? cache->size * 2 : end + size;
+  if(ftruncate(cache->fd, new_size) != 0)
+  {
+    fprintf(stderr, "error: failed to resize shm file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  munmap(cache->data, cache->size);
+  cache->size = new_size;
+  map_pool(cache);
+  wl_shm_pool_resize(cache->wl_shm_pool, cache->size);
+  return end;
+}
+
+static void draw(void *data, int size, const double color[4], double weight)
+{
+  int hsize = round(size * 0.5);
+
+  cairo_surface_t *cairo_surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32, size, size, size * 4);
+  cairo_t *cairo = cairo_create(cairo_surface);
+
+  cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(cairo);
+  cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+
+  cairo_set_source_rgba(cairo, color[0], color[1], color[2], color[3]);
+  cairo_arc(cairo, hsize, hsize, weight * 0.5, 0, 2*M_PI);
+  cairo_fill(cairo);
+
+  cairo_destroy(cairo);
+  cairo_surface_destroy(cairo_surface);
+}
+
+struct cursor *cursor_cache_get(struct cursor_cache *cache, const double color[4], double weight)
+{
+  long quantized = lround(weight * CURSOR_WEIGHT_STEPS);
+
+  struct cursor *cursor;
+  wl_list_for_each(cursor, &cache->cursors, link)
+    if(cursor->weight == quantized && memcmp(cursor->color, color, sizeof cursor->color) == 0)
+    {
+      wl_list_remove(&cursor->link);
+      wl_list_insert(&cache->cursors, &cursor->link);
+      cursor->busy = true;
+      cache->stats.hits += 1;
+      return cursor;
+    }
+
+  cache->stats.misses += 1;
+
+  // Make room before allocating, so that the memory of evicted cursors can be
+  // reused right away.
+  struct cursor *tmp;
+  wl_list_for_each_reverse_safe(cursor, tmp, &cache->cursors, link)
+  {
+    if(cache->count < CURSOR_CACHE_SIZE)
+      break;
+    if(!cursor->busy)
+      cursor_destroy(cache, cursor);
+  }
+
+  int size = cursor_size(weight);
+  size_t bytes = (size_t)size * size * 4;
+
+  cursor = calloc(1, sizeof *cursor);
+  memcpy(cursor->color, color, sizeof cursor->color);
+  cursor->weight = quantized;
+  cursor->size = size;
+  cursor->offset = allocate(cache, bytes);
+
+  draw((char *)cache->data + cursor->offset, size, color, (double)quantized / CURSOR_WEIGHT_STEPS);
+  stats_count(STATS_SHM_BYTES, bytes);
+
+  cursor->wl_buffer = wl_shm_pool_create_buffer(cache->wl_shm_pool, cursor->offset, size, size, size * 4, WL_SHM_FORMAT_ARGB8888);
+  wl_buffer_add_listener(cursor->wl_buffer, &buffer_listener, cursor);
+  cursor->busy = true;
+
+  wl_list_insert(&cache->cursors, &cursor->link);
+  cache->count += 1;
+  return cursor;
+}
@@ -0,0 +1,66 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+// A cache of the wl_buffer cursors are drawn with, so that changing the color
+// or the weight of a brush back and forth is only an attach and a commit.
+//
+// Cursors are keyed by color and by weight quantized to a fraction of a pixel,
+// and are carved out of a single shm pool that only grows when they do not fit
+// anymore. The least recently used ones are evicted past a handful of them, as
+// long as the compositor is not holding on to them.
+
+#include <wayland-client.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CURSOR_CACHE_SIZE 16
+
+struct cursor
+{
+  struct wl_list link; // most recently used first
+
+  double color[4];
+  long weight; // quantized
+
+  int size;
+  size_t offset;
+  struct wl_buffer *wl_buffer;
+  bool busy;
+};
+
+struct cursor_cache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct cursor_cache
+{
+  struct wl_shm *wl_shm;
+
+  int fd;
+  void *data;
+  size_t size;
+  struct wl_shm_pool *wl_shm_pool;
+
+  struct wl_list cursors;
+  unsigned count;
+
+  struct cursor_cache_stats stats;
+};
+
+struct cursor_cache *cursor_cache_new(struct wl_shm *wl_shm);
+void cursor_cache_destroy(struct cursor_cache *cache);
+
+// Width and height of the cursor for a brush of the given weight. Its hotspot
+// is at round(size * 0.5).
+int cursor_size(double weight);
+
+// Get the cursor for a brush of the given color and weight, drawing it if it is
+// not cached. It is considered busy until the compositor releases it, so the
+// caller must attach and commit it.
+struct cursor *cursor_cache_get(struct cursor_cache *cache, const double color[4], double weight);
+
+#endif // CURSOR_H
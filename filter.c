@@ -0,0 +1,61 @@
+#include "filter.h"
+
+#include <math.h>
+
+// Distance from p to the segment from a to b.
+static double segment_distance(const struct command_point *p, const struct command_point *a, const struct command_point *b)
+{
+  double dx = b->x - a->x;
+  double dy = b->y - a->y;
+  double length = dx * dx + dy * dy;
+
+  double t = length > 0.0 ? ((p->x - a->x) * dx + (p->y - a->y) * dy) / length : 0.0;
+  t = fmin(fmax(t, 0.0), 1.0);
+  return hypot(p->x - (a->x + t * dx), p->y - (a->y + t * dy));
+}
+
+static void keep(struct filter *filter, struct command *command, struct command_point point)
+{
+  command_add_point(command, point.x, point.y);
+  filter->last = point;
+  filter->pending_count = 0;
+}
+
+void filter_init(struct filter *filter)
+{
+  filter->started = false;
+  filter->pending_count = 0;
+}
+
+void filter_add(struct filter *filter, struct command *command, double x, double y)
+{
+  struct command_point point = { x, y };
+  if(!filter->started)
+  {
+    filter->started = true;
+    keep(filter, command, point);
+    return;
+  }
+
+  const struct command_point *previous = filter->pending_count ? &filter->pending[filter->pending_count - 1] : &filter->last;
+  if(hypot(point.x - previous->x, point.y - previous->y) < FILTER_MIN_DISTANCE)
+    return;
+
+  // The line from the last point has to pass by every position held back,
+  // otherwise it bent at the latest of them. Distances are to the segment
+  // rather than to the whole line, so that turning back counts as bending.
+  bool straight = filter->pending_count < FILTER_MAX_PENDING;
+  for(size_t i=0; straight && i<filter->pending_count; ++i)
+    straight = segment_distance(&filter->pending[i], &filter->last, &point) <= FILTER_TOLERANCE;
+
+  if(!straight)
+    keep(filter, command, filter->pending[filter->pending_count - 1]);
+
+  filter->pending[filter->pending_count++] = point;
+}
+
+void filter_flush(struct filter *filter, struct command *command)
+{
+  if(filter->pending_count)
+    keep(filter, command, filter->pending[filter->pending_count - 1]);
+}
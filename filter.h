@@ -0,0 +1,50 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+// Thins out positions of the pointer before they become points of a brush
+// stroke, so that a pointer sending thousands of positions per second does not
+// have a segment stroked for each of them.
+//
+// Positions closer than FILTER_MIN_DISTANCE to the previous one are dropped,
+// and positions along a straight line are held back until the line bends, so
+// that the whole line becomes a single segment. Whatever is held back is added
+// by filter_flush(), which is meant to be called right before a frame is
+// drawn, so that what is shown never trails the pointer.
+//
+// Only the points the filter keeps are added to the command, so a replayed
+// stroke goes through the same segments as its preview did.
+
+#include "command.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// In pixels.
+#define FILTER_MIN_DISTANCE 0.5
+#define FILTER_TOLERANCE 0.25
+
+// Positions held back at most, after which the line is cut short anyway.
+#define FILTER_MAX_PENDING 64
+
+struct filter
+{
+  bool started;
+
+  struct command_point last; // last point added to the command
+
+  // Positions along the line from the last point, in order.
+  struct command_point pending[FILTER_MAX_PENDING];
+  size_t pending_count;
+};
+
+void filter_init(struct filter *filter);
+
+// Feed a position to the filter, which adds points to command as it decides to
+// keep them. The first position is always kept.
+void filter_add(struct filter *filter, struct command *command, double x, double y);
+
+// Add whatever is held back to command, which leaves it at most
+// FILTER_MIN_DISTANCE away from the latest position.
+void filter_flush(struct filter *filter, struct command *command);
+
+#endif // FILTER_H
@@ -1,8 +0,0 @@
-#ifndef HIBERNATE_H
-#define HIBERNATE_H
-
-void try_resume(void);
-
-void suspend(void);
-
-#endif // HIBERNATE_H
@@ -0,0 +1,159 @@
+#include "layer.h"
+
+#include "cairo-utils.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Grow a layer by at least this much on each side beyond what is needed, so
+// that a stroke does not have to move to a new surface every few points.
+#define LAYER_MARGIN 64
+
+// A new stroke is usually started while the previous one is still being
+// committed, so at least two buffers are needed to never allocate.
+#define LAYER_POOL_SIZE 4
+
+struct buffer
+{
+  void *data;
+  size_t size;
+};
+
+// Buffers of destroyed layers, all of them cleared. Layers are only ever
+// created and destroyed on the main thread.
+static struct buffer pool[LAYER_POOL_SIZE];
+static unsigned pool_count;
+
+// Take the smallest buffer in the pool that is large enough, or allocate one.
+static struct buffer buffer_take(size_t size)
+{
+  unsigned best = pool_count;
+  for(unsigned i=0; i<pool_count; ++i)
+    if(pool[i].size >= size && (best == pool_count || pool[i].size < pool[best].size))
+      best = i;
+
+  if(best != pool_count)
+  {
+    struct buffer buffer = pool[best];
+    pool[best] = pool[--pool_count];
+    return buffer;
+  }
+
+  stats_count(STATS_LAYER_BYTES, size);
+  return (struct buffer){ calloc(1, size), size };
+}
+
+// Put a buffer back into the pool, of which only the first used bytes may have
+// been drawn on. If the pool is full, the smallest buffer goes, since larger
+// ones are the most expensive to fault in again.
+static void buffer_give(struct buffer buffer, size_t used)
+{
+  memset(buffer.data, 0, used);
+  if(pool_count < LAYER_POOL_SIZE)
+  {
+    pool[pool_count++] = buffer;
+    return;
+  }
+
+  unsigned smallest = 0;
+  for(unsigned i=1; i<pool_count; ++i)
+    if(pool[i].size < pool[smallest].size)
+      smallest = i;
+
+  if(pool[smallest].size < buffer.size)
+  {
+    free(pool[smallest].data);
+    pool[smallest] = buffer;
+  }
+  else
+    free(buffer.data);
+}
+
+void layer_release_pool(void)
+{
+  for(unsigned i=0; i<pool_count; ++i)
+    free(pool[i].data);
+  pool_count = 0;
+}
+
+struct layer *layer_new(int width, int height)
+{
+  struct layer *layer = calloc(1, sizeof *layer);
+  layer->width = width;
+  layer->height = height;
+  return layer;
+}
+
+static void layer_release(struct layer *layer)
+{
+  if(!layer->cairo_surface)
+    return;
+
+  cairo_surface_finish(layer->cairo_surface);
+  cairo_surface_destroy(layer->cairo_surface);
+
+  size_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, layer->rect.width);
+  buffer_give((struct buffer){ layer->data, layer->size }, stride * layer->rect.height);
+}
+
+void layer_destroy(struct layer *layer)
+{
+  layer_release(layer);
+  free(layer);
+}
+
+bool layer_reserve(struct layer *layer, const cairo_rectangle_int_t *rect)
+{
+  cairo_rectangle_int_t bounds = { 0, 0, layer->width, layer->height };
+  cairo_rectangle_int_t needed = *rect;
+  if(!cairo_rectangle_int_intersect(&needed, &bounds))
+  {
+    // Nothing would be visible anyway, but there has to be something to draw
+    // on.
+    if(layer->cairo_surface)
+      return false;
+    needed = (cairo_rectangle_int_t){ 0, 0, 1, 1 };
+  }
+
+  cairo_rectangle_int_t grown = layer->rect;
+  cairo_rectangle_int_union(&grown, &needed);
+  if(layer->cairo_surface && grown.x == layer->rect.x && grown.y == layer->rect.y && grown.width == layer->rect.width && grown.height == layer->rect.height)
+    return false;
+
+  // Grow by at least half of the current size, so that a stroke that keeps
+  // going in one direction only gets moved a logarithmic number of times.
+  int margin_x = layer->rect.width / 2 > LAYER_MARGIN ? layer->rect.width / 2 : LAYER_MARGIN;
+  int margin_y = layer->rect.height / 2 > LAYER_MARGIN ? layer->rect.height / 2 : LAYER_MARGIN;
+  grown.x -= margin_x;
+  grown.y -= margin_y;
+  grown.width += 2 * margin_x;
+  grown.height += 2 * margin_y;
+  cairo_rectangle_int_intersect(&grown, &bounds);
+
+  int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, grown.width);
+  struct buffer buffer = buffer_take((size_t)stride * grown.height);
+
+  if(layer->cairo_surface)
+  {
+    cairo_surface_flush(layer->cairo_surface);
+
+    const unsigned char *data = cairo_image_surface_get_data(layer->cairo_surface);
+    int old_stride = cairo_image_surface_get_stride(layer->cairo_surface);
+    for(int y=0; y<layer->rect.height; ++y)
+      memcpy(
+          (unsigned char *)buffer.data + (size_t)(layer->rect.y - grown.y + y) * stride + (layer->rect.x - grown.x) * 4,
+          data + (size_t)y * old_stride,
+          layer->rect.width * 4
+      );
+
+    layer_release(layer);
+  }
+
+  layer->rect = grown;
+  layer->data = buffer.data;
+  layer->size = buffer.size;
+  layer->cairo_surface = cairo_image_surface_create_for_data(buffer.data, CAIRO_FORMAT_ARGB32, grown.width, grown.height, stride);
+  cairo_surface_set_device_offset(layer->cairo_surface, -grown.x, -grown.y);
+  return true;
+}
@@ -0,0 +1,44 @@
+#ifndef LAYER_H
+#define LAYER_H
+
+// A surface a stroke is drawn on while it is in progress, before it gets
+// composited into a canvas.
+//
+// A layer does not cover the whole output, only the part of it the stroke has
+// reached so far, and grows along with the stroke. The surface has a device
+// offset, so it is drawn on in output coordinates all the same, but anything
+// reading its pixels directly has to offset them by the position of the layer.
+//
+// The memory behind layers is recycled once they are destroyed, so that most
+// strokes start on memory that is already faulted in.
+
+#include <cairo.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct layer
+{
+  int width, height; // of the output
+
+  // Part of the output covered, and the surface covering it. Both are empty
+  // until the layer is first reserved.
+  cairo_rectangle_int_t rect;
+  cairo_surface_t *cairo_surface;
+
+  void *data;
+  size_t size;
+};
+
+struct layer *layer_new(int width, int height);
+void layer_destroy(struct layer *layer);
+
+// Make sure the layer covers rect, as far as it is within the output. If the
+// layer has to grow, its content is moved to a new surface, in which case true
+// is returned and any cairo_t drawing on the old one must be recreated.
+bool layer_reserve(struct layer *layer, const cairo_rectangle_int_t *rect);
+
+// Free the memory kept around for layers to come.
+void layer_release_pool(void);
+
+#endif // LAYER_H
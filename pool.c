@@ -0,0 +1,195 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+struct pool
+{
+  pthread_t *threads;
+  unsigned workers;
+
+  // Jobs waiting for a worker, in the order they are submitted.
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct pool_job *head, *tail;
+  bool stopping;
+
+  // Jobs that are done, most recent first. Workers push onto it, and the owner
+  // takes everything at once, so there is no ABA problem to worry about.
+  _Atomic(struct pool_job *) completed;
+  int event_fd; // readable once there are jobs that are done
+};
+
+static void complete(struct pool *pool, struct pool_job *job)
+{
+  job->next = atomic_load_explicit(&pool->completed, memory_order_relaxed);
+  while(!atomic_compare_exchange_weak_explicit(&pool->completed, &job->next, job, memory_order_release, memory_order_relaxed))
+    ;
+
+  uint64_t one = 1;
+  while(write(pool->event_fd, &one, sizeof one) < 0 && errno == EINTR)
+    ;
+}
+
+static void *work(void *data)
+{
+  struct pool *pool = data;
+
+  pthread_mutex_lock(&pool->mutex);
+  for(;;)
+  {
+    while(!pool->head && !pool->stopping)
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+
+    if(!pool->head)
+      break;
+
+    struct pool_job *job = pool->head;
+    pool->head = job->next;
+    if(!pool->head)
+      pool->tail = NULL;
+
+    pthread_mutex_unlock(&pool->mutex);
+    job->run(job);
+    complete(pool, job);
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+struct pool *pool_new(unsigned workers)
+{
+  struct pool *pool = calloc(1, sizeof *pool);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  atomic_init(&pool->completed, NULL);
+
+  pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(pool->event_fd < 0)
+  {
+    fprintf(stderr, "error: failed to create eventfd: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  pool->threads = calloc(workers, sizeof *pool->threads);
+  for(; pool->workers<workers; ++pool->workers)
+  {
+    int error = pthread_create(&pool->threads[pool->workers], NULL, &work, pool);
+    if(error)
+    {
+      fprintf(stderr, "error: failed to create worker thread: %s\n", strerror(error));
+      exit(EXIT_FAILURE);
+    }
+  }
+  return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  // Workers finish the jobs that are left before stopping.
+  for(unsigned i=0; i<pool->workers; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  while(pool_dispatch(pool, false) != 0)
+    ;
+
+  close(pool->event_fd);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->threads);
+  free(pool);
+}
+
+unsigned pool_workers(const struct pool *pool)
+{
+  return pool->workers;
+}
+
+int pool_fd(const struct pool *pool)
+{
+  return pool->event_fd;
+}
+
+void pool_submit(struct pool *pool, struct pool_job *job)
+{
+  if(pool->workers == 0)
+  {
+    job->run(job);
+    complete(pool, job);
+    return;
+  }
+
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if(pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+unsigned pool_dispatch(struct pool *pool, bool block)
+{
+  struct pool_job *job;
+  for(;;)
+  {
+    // Reset the eventfd before taking the jobs that are done, so that a job
+    // done in between wakes us up next time.
+    uint64_t count;
+    if(read(pool->event_fd, &count, sizeof count) < 0 && errno != EAGAIN && errno != EINTR)
+    {
+      fprintf(stderr, "error: failed to read eventfd: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    job = atomic_exchange_explicit(&pool->completed, NULL, memory_order_acquire);
+    if(job || !block)
+      break;
+
+    struct pollfd fd = { .fd = pool->event_fd, .events = POLLIN };
+    if(poll(&fd, 1, -1) < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "error: failed to poll: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Reverse the list to get the jobs in the order they got done.
+  struct pool_job *jobs = NULL;
+  while(job)
+  {
+    struct pool_job *next = job->next;
+    job->next = jobs;
+    jobs = job;
+    job = next;
+  }
+
+  unsigned n = 0;
+  while(jobs)
+  {
+    job = jobs;
+    jobs = job->next;
+    job->done(job);
+    n += 1;
+  }
+  return n;
+}
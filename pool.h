@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+// A pool of worker threads.
+//
+// A job is run on whichever worker is free first. Once it is done, it is put
+// on a lock-free completion queue, and its completion callback is invoked on
+// the thread that owns the pool the next time pool_dispatch() is called. That
+// way, workers only ever touch what a job hands them, and everything else,
+// including the Wayland connection, stays on the thread that owns the pool.
+
+#include <stdbool.h>
+
+struct pool_job
+{
+  void (*run)(struct pool_job *job);  // on a worker
+  void (*done)(struct pool_job *job); // on the owner, after run
+
+  struct pool_job *next;
+};
+
+struct pool;
+
+// Create a pool with a number of workers. With no workers at all, jobs are run
+// right away by pool_submit() instead.
+struct pool *pool_new(unsigned workers);
+void pool_destroy(struct pool *pool);
+
+unsigned pool_workers(const struct pool *pool);
+
+void pool_submit(struct pool *pool, struct pool_job *job);
+
+// A file descriptor that becomes readable once there are jobs that are done,
+// for waiting on them together with other file descriptors.
+int pool_fd(const struct pool *pool);
+
+// Invoke the completion callback of every job that is done, in the order they
+// got done. If block is true and none is done yet, wait for one first. Return
+// the number of jobs dispatched.
+unsigned pool_dispatch(struct pool *pool, bool block);
+
+#endif // POOL_H
@@ -0,0 +1,200 @@
+#include "rle.h"
+
+#include <assert.h>
+#include <string.h>
+
+enum rle_run
+{
+  RLE_RUN_TRANSPARENT,
+  RLE_RUN_REPEAT,
+  RLE_RUN_ABOVE,
+  RLE_RUN_LITERAL,
+};
+
+// A run starts with a tag byte holding the kind of the run in the lowest two
+// bits and the length in the remaining six. Lengths that do not fit are
+// continued in the following bytes, seven bits at a time.
+#define RLE_TAG_LENGTH_MAX 63
+
+static uint8_t *put_run(uint8_t *out, enum rle_run run, size_t length)
+{
+  assert(length > 0);
+  length -= 1;
+
+  if(length < RLE_TAG_LENGTH_MAX)
+  {
+    *out++ = run | length << 2;
+    return out;
+  }
+
+  *out++ = run | RLE_TAG_LENGTH_MAX << 2;
+  length -= RLE_TAG_LENGTH_MAX;
+  while(length >= 0x80)
+  {
+    *out++ = 0x80 | (length & 0x7f);
+    length >>= 7;
+  }
+  *out++ = length;
+  return out;
+}
+
+static const uint8_t *get_run(const uint8_t *in, enum rle_run *run, size_t *length)
+{
+  uint8_t tag = *in++;
+  *run = tag & 0x3;
+  *length = tag >> 2;
+
+  if(*length == RLE_TAG_LENGTH_MAX)
+  {
+    size_t extra = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do
+    {
+      byte = *in++;
+      extra |= (size_t)(byte & 0x7f) << shift;
+      shift += 7;
+    } while(byte & 0x80);
+    *length += extra;
+  }
+
+  *length += 1;
+  return in;
+}
+
+size_t rle_bound(size_t count)
+{
+  // Worst case is everything in a single literal run.
+  return 1 + (sizeof(size_t) * 8 + 6) / 7 + count * sizeof(uint32_t);
+}
+
+static size_t run_transparent(const uint32_t *pixels, size_t i, size_t count)
+{
+  size_t n = 0;
+  while(i + n < count && pixels[i + n] == 0)
+    ++n;
+  return n;
+}
+
+static size_t run_repeat(const uint32_t *pixels, size_t i, size_t count)
+{
+  size_t n = 1;
+  while(i + n < count && pixels[i + n] == pixels[i])
+    ++n;
+  return n;
+}
+
+static size_t run_above(const uint32_t *pixels, size_t i, size_t count, size_t width)
+{
+  if(i < width)
+    return 0;
+
+  size_t n = 0;
+  while(i + n < count && pixels[i + n] == pixels[i + n - width])
+    ++n;
+  return n;
+}
+
+size_t rle_encode(const uint32_t *pixels, size_t count, size_t width, uint8_t *out)
+{
+  uint8_t *begin = out;
+
+  size_t literal = 0; // start of pending literal run
+  size_t i = 0;
+  while(i < count)
+  {
+    enum rle_run run = RLE_RUN_TRANSPARENT;
+    size_t length = run_transparent(pixels, i, count);
+
+    size_t above = run_above(pixels, i, count, width);
+    if(above > length)
+    {
+      run = RLE_RUN_ABOVE;
+      length = above;
+    }
+
+    size_t repeat = run_repeat(pixels, i, count);
+    if(repeat > length)
+    {
+      run = RLE_RUN_REPEAT;
+      length = repeat;
+    }
+
+    // Runs that are too short are cheaper to keep as part of a literal run,
+    // except for transparent runs which are always worth it.
+    if(run != RLE_RUN_TRANSPARENT && length < 2)
+    {
+      ++i;
+      continue;
+    }
+
+    if(literal < i)
+    {
+      out = put_run(out, RLE_RUN_LITERAL, i - literal);
+      memcpy(out, &pixels[literal], (i - literal) * sizeof *pixels);
+      out += (i - literal) * sizeof *pixels;
+    }
+
+    out = put_run(out, run, length);
+    if(run == RLE_RUN_REPEAT)
+    {
+      memcpy(out, &pixels[i], sizeof *pixels);
+      out += sizeof *pixels;
+    }
+
+    i += length;
+    literal = i;
+  }
+
+  if(literal < count)
+  {
+    out = put_run(out, RLE_RUN_LITERAL, count - literal);
+    memcpy(out, &pixels[literal], (count - literal) * sizeof *pixels);
+    out += (count - literal) * sizeof *pixels;
+  }
+
+  return out - begin;
+}
+
+void rle_decode(const uint8_t *in, size_t size, uint32_t *pixels, size_t count, size_t width)
+{
+  const uint8_t *end = in + size;
+
+  size_t i = 0;
+  while(in < end)
+  {
+    enum rle_run run;
+    size_t length;
+    in = get_run(in, &run, &length);
+    assert(i + length <= count);
+
+    switch(run)
+    {
+    case RLE_RUN_TRANSPARENT:
+      memset(&pixels[i], 0, length * sizeof *pixels);
+      break;
+    case RLE_RUN_REPEAT:
+      {
+        uint32_t pixel;
+        memcpy(&pixel, in, sizeof pixel);
+        in += sizeof pixel;
+        for(size_t j=0; j<length; ++j)
+          pixels[i + j] = pixel;
+      }
+      break;
+    case RLE_RUN_ABOVE:
+      assert(i >= width);
+      for(size_t j=0; j<length; ++j)
+        pixels[i + j] = pixels[i + j - width];
+      break;
+    case RLE_RUN_LITERAL:
+      memcpy(&pixels[i], in, length * sizeof *pixels);
+      in += length * sizeof *pixels;
+      break;
+    }
+
+    i += length;
+  }
+
+  assert(i == count);
+}
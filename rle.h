@@ -0,0 +1,29 @@
+#ifndef RLE_H
+#define RLE_H
+
+// A run-length codec for ARGB8888 images that are mostly transparent, such as
+// our tiles.
+//
+// Pixels are encoded as a sequence of runs, each of which is one of:
+//  - a run of fully transparent pixels
+//  - a run of a single repeated pixel
+//  - a run of pixels equal to the pixels one row above
+//  - a run of literal pixels
+// The first two cover the background and the inside of strokes, and the third
+// is a match at a fixed distance of one row, which covers most of the
+// antialiased edges of strokes.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Upper bound on the size of the encoding of count pixels.
+size_t rle_bound(size_t count);
+
+// Encode count pixels of an image width pixels wide. Return the number of
+// bytes written to out, which must be at least rle_bound(count) bytes large.
+size_t rle_encode(const uint32_t *pixels, size_t count, size_t width, uint8_t *out);
+
+// Decode count pixels of an image width pixels wide.
+void rle_decode(const uint8_t *in, size_t size, uint32_t *pixels, size_t count, size_t width);
+
+#endif // RLE_H
@@ -0,0 +1,1061 @@
+#include "session.h"
+
+#include "canvas.h"
+#include "command.h"
+
+#include <wayland-util.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SESSION_MAGIC "WAYDRAW\003"
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE * sizeof(uint32_t))
+
+// Checkpoints in a row that only hold what changed since the previous one, at
+// most. Restoring has to go through all of them.
+#define SESSION_MAX_CHAIN 64
+
+struct session_header
+{
+  char magic[8];
+  uint32_t width, height;
+  uint32_t tile_size;
+  uint32_t padding;
+  uint64_t checkpoint; // offset of the latest checkpoint record
+};
+
+enum session_record_type
+{
+  SESSION_RECORD_TILE = 1,
+  SESSION_RECORD_NODE,
+  SESSION_RECORD_CHECKPOINT,
+};
+
+// Every record is 8 bytes aligned, and is referred to by the offset of its
+// payload, which is never 0.
+struct session_record
+{
+  uint32_t type;
+  uint32_t size; // size of the payload
+};
+
+// Followed by point_count points, and by the offsets of the tiles of the
+// keyframe, if it is one.
+struct session_node
+{
+  uint64_t parent; // 0 for the root
+  uint32_t mode;
+  uint32_t keyframe;
+  uint32_t smoothing;
+  uint32_t padding;
+  double color[4];
+  double weight;
+  int32_t extents[4];
+  uint64_t point_count;
+};
+
+// Followed by entry_count entries for the tiles of the current canvas that
+// changed since the base checkpoint, or for every tile that is not empty if
+// there is none.
+struct session_checkpoint
+{
+  uint64_t node;
+  uint64_t base; // 0 for none
+  uint64_t entry_count;
+};
+
+struct session_grid_entry
+{
+  uint64_t index;
+  uint64_t tile; // 0 for an empty tile
+};
+
+// Open addressing hash map from record offsets to whatever is loaded from
+// them.
+struct offset_map
+{
+  size_t capacity;
+  size_t count;
+  uint64_t *keys;
+  void **values;
+};
+
+struct session
+{
+  char *path;
+  int fd;
+  bool failed;
+
+  uint32_t width, height;
+  uint32_t columns, rows;
+
+  uint64_t size;       // size of the file
+  uint64_t checkpoint; // node of the latest checkpoint
+
+  // The latest checkpoint record, and the offsets of the tiles of the canvas
+  // as of then, which the next checkpoint only holds the changes to.
+  uint64_t checkpoint_offset;
+  uint64_t *grid;
+  unsigned chain_length;  // checkpoints since the latest one with no base
+  uint64_t chain_entries; // entries in them
+
+  // Latest checkpoint record of each node checkpointed so far.
+  struct offset_map checkpoints;
+
+  // Mapping of the file as it was when restored.
+  void *map;
+  size_t map_size;
+
+  // Node the snapshot got restored to, and tiles already loaded from the
+  // mapping, each holding a reference, until the history is loaded.
+  struct snapshot_node *restored;
+  struct offset_map tiles;
+  bool history_loaded;
+};
+
+static size_t offset_map_slot(const struct offset_map *map, uint64_t key)
+{
+  size_t mask = map->capacity - 1;
+  size_t slot = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+  while(map->keys[slot] && map->keys[slot] != key)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+static void *offset_map_get(const struct offset_map *map, uint64_t key)
+{
+  if(!map->capacity)
+    return NULL;
+
+  size_t slot = offset_map_slot(map, key);
+  return map->keys[slot] ? map->values[slot] : NULL;
+}
+
+static void offset_map_put(struct offset_map *map, uint64_t key, void *value)
+{
+  if(2 * (map->count + 1) > map->capacity)
+  {
+    struct offset_map new_map = {0};
+    new_map.capacity = map->capacity ? 2 * map->capacity : 64;
+    new_map.keys = calloc(new_map.capacity, sizeof *new_map.keys);
+    new_map.values = calloc(new_map.capacity, sizeof *new_map.values);
+    for(size_t i=0; i<map->capacity; ++i)
+      if(map->keys[i])
+        offset_map_put(&new_map, map->keys[i], map->values[i]);
+
+    free(map->keys);
+    free(map->values);
+    *map = new_map;
+  }
+
+  size_t slot = offset_map_slot(map, key);
+  if(!map->keys[slot])
+  {
+    map->keys[slot] = key;
+    map->count += 1;
+  }
+  map->values[slot] = value;
+}
+
+static void offset_map_release(struct offset_map *map)
+{
+  free(map->keys);
+  free(map->values);
+  *map = (struct offset_map){0};
+}
+
+// Write everything or return false with errno set.
+static bool write_all(int fd, uint64_t offset, const void *data, size_t size)
+{
+  const char *p = data;
+  while(size > 0)
+  {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if(n < 0 && errno == EINTR)
+      continue;
+
+    if(n <= 0)
+    {
+      if(n == 0)
+        errno = ENOSPC;
+      return false;
+    }
+
+    p += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Append a record to the file ending at *end, and return the offset of its
+// payload, or 0 with errno set on failure.
+static uint64_t append_to(int fd, uint64_t *end, uint32_t type, const void *payload, size_t size)
+{
+  struct session_record record = { .type = type, .size = size };
+  uint64_t offset = *end;
+  if(!write_all(fd, offset, &record, sizeof record) || !write_all(fd, offset + sizeof record, payload, size))
+    return 0;
+
+  *end += sizeof record + size;
+  return offset + sizeof record;
+}
+
+static void write_failed(struct session *session)
+{
+  fprintf(stderr, "error: failed to write session file %s: %s\n", session->path, strerror(errno));
+  fprintf(stderr, "note: the session will no longer be saved\n");
+  session->failed = true;
+}
+
+static bool write_at(struct session *session, uint64_t offset, const void *data, size_t size)
+{
+  if(!write_all(session->fd, offset, data, size))
+  {
+    write_failed(session);
+    return false;
+  }
+  return true;
+}
+
+// Append a record and return the offset of its payload, or 0 on failure.
+static uint64_t append_record(struct session *session, uint32_t type, const void *payload, size_t size)
+{
+  if(session->failed)
+    return 0;
+
+  uint64_t offset = append_to(session->fd, &session->size, type, payload, size);
+  if(!offset)
+    write_failed(session);
+  return offset;
+}
+
+// Read the payload of the record at offset if it is of the given type and at
+// least size bytes large, into a new allocation. Its size is stored in
+// *payload_size.
+static void *read_record(const struct session *session, uint64_t offset, uint32_t type, uint64_t size, uint64_t *payload_size)
+{
+  struct session_record record;
+  if(offset < sizeof(struct session_header) + sizeof record || offset % 8 || offset > session->size
+      || pread(session->fd, &record, sizeof record, offset - sizeof record) != sizeof record
+      || record.type != type || record.size < size || record.size > session->size - offset)
+    return NULL;
+
+  void *payload = malloc(record.size ? record.size : 1);
+  if(pread(session->fd, payload, record.size, offset) != (ssize_t)record.size)
+  {
+    free(payload);
+    return NULL;
+  }
+
+  *payload_size = record.size;
+  return payload;
+}
+
+// Recover the offsets of the tiles of the canvas at the checkpoint at offset
+// into grid, going through the checkpoints it is based on. The offset of its
+// node, and the end of its record are stored in *node and *end, and the number
+// of checkpoints with a base and of their entries into *length and *entries.
+static bool read_checkpoint(const struct session *session, uint64_t offset, uint64_t *node, uint64_t *end, uint64_t *grid, unsigned *length, uint64_t *entries)
+{
+  size_t count = (size_t)session->columns * session->rows;
+  memset(grid, 0, count * sizeof *grid);
+  bool *seen = calloc(count, sizeof *seen);
+  bool success = false;
+
+  *length = 0;
+  *entries = 0;
+
+  for(bool first=true; offset; first=false)
+  {
+    uint64_t size;
+    struct session_checkpoint *checkpoint = read_record(session, offset, SESSION_RECORD_CHECKPOINT, sizeof *checkpoint, &size);
+    if(!checkpoint)
+      goto out;
+
+    // Bases always come before, so that a corrupted file cannot loop.
+    const struct session_grid_entry *entries_data = (const void *)(checkpoint + 1);
+    if(checkpoint->entry_count > (size - sizeof *checkpoint) / sizeof *entries_data || checkpoint->base >= offset)
+    {
+      free(checkpoint);
+      goto out;
+    }
+
+    if(first)
+    {
+      *node = checkpoint->node;
+      *end = offset + size;
+    }
+
+    for(uint64_t i=0; i<checkpoint->entry_count; ++i)
+    {
+      uint64_t index = entries_data[i].index;
+      if(index >= count)
+      {
+        free(checkpoint);
+        goto out;
+      }
+
+      if(!seen[index])
+      {
+        seen[index] = true;
+        grid[index] = entries_data[i].tile;
+      }
+    }
+
+    if(checkpoint->base)
+    {
+      *length += 1;
+      *entries += checkpoint->entry_count;
+    }
+
+    offset = checkpoint->base;
+    free(checkpoint);
+  }
+  success = true;
+
+out:
+  free(seen);
+  return success;
+}
+
+static uint64_t save_tile(struct session *session, struct tile *tile)
+{
+  if(!tile)
+    return 0;
+
+  if(!tile->session_offset)
+  {
+    tile_decompress(tile);
+    cairo_surface_flush(tile->cairo_surface);
+    tile->session_offset = append_record(session, SESSION_RECORD_TILE, tile->data, TILE_BYTES);
+  }
+  return tile->session_offset;
+}
+
+static void save_grid(struct session *session, const struct canvas *canvas, struct wl_array *payload)
+{
+  size_t count = (size_t)canvas->columns * canvas->rows;
+  uint64_t *offsets = wl_array_add(payload, count * sizeof *offsets);
+  for(size_t i=0; i<count; ++i)
+    offsets[i] = save_tile(session, canvas->tiles[i]);
+}
+
+static void save_node(struct session *session, struct snapshot_node *node)
+{
+  if(node->session_offset)
+    return;
+
+  if(node->parent)
+  {
+    save_node(session, node->parent);
+    if(!node->parent->session_offset)
+      return;
+  }
+
+  const struct command *command = &node->command;
+
+  struct wl_array payload;
+  wl_array_init(&payload);
+
+  struct session_node *record = wl_array_add(&payload, sizeof *record);
+  *record = (struct session_node){
+    .parent = node->parent ? node->parent->session_offset : 0,
+    .mode = command->mode,
+    .smoothing = command->smoothing,
+    .keyframe = node->canvas != NULL,
+    .color = { command->color[0], command->color[1], command->color[2], command->color[3] },
+    .weight = command->weight,
+    .extents = { command->extents.x, command->extents.y, command->extents.width, command->extents.height },
+    .point_count = command_point_count(command),
+  };
+
+  if(command->points.size)
+    memcpy(wl_array_add(&payload, command->points.size), command->points.data, command->points.size);
+
+  if(node->canvas)
+    save_grid(session, node->canvas, &payload);
+
+  node->session_offset = append_record(session, SESSION_RECORD_NODE, payload.data, payload.size);
+  wl_array_release(&payload);
+}
+
+// Going back to a node checkpointed before, by undo or redo for example,
+// replays the same commands from the same keyframe, so the tiles saved for the
+// earlier checkpoint are used rather than saved again.
+static void reuse_checkpoint(struct session *session, uint64_t node, const struct canvas *canvas)
+{
+  uint64_t offset = (uintptr_t)offset_map_get(&session->checkpoints, node);
+  if(!offset)
+    return;
+
+  size_t count = (size_t)canvas->columns * canvas->rows;
+  uint64_t *grid = malloc(count * sizeof *grid);
+  uint64_t checkpoint_node, end, entries;
+  unsigned length;
+  if(read_checkpoint(session, offset, &checkpoint_node, &end, grid, &length, &entries) && checkpoint_node == node)
+    for(size_t i=0; i<count; ++i)
+      if(canvas->tiles[i] && !canvas->tiles[i]->session_offset)
+        canvas->tiles[i]->session_offset = grid[i];
+  free(grid);
+}
+
+void session_save(struct session *session, struct snapshot *snapshot)
+{
+  if(!session || session->failed)
+    return;
+
+  save_node(session, snapshot->current);
+  uint64_t node = snapshot->current->session_offset;
+  if(!node || node == session->checkpoint)
+    return;
+
+  const struct canvas *canvas = snapshot->canvas;
+  size_t count = (size_t)canvas->columns * canvas->rows;
+  reuse_checkpoint(session, node, canvas);
+
+  uint64_t *grid = malloc(count * sizeof *grid);
+  uint64_t changed = 0;
+  for(size_t i=0; i<count; ++i)
+  {
+    grid[i] = save_tile(session, canvas->tiles[i]);
+    changed += grid[i] != session->grid[i];
+  }
+
+  // A checkpoint only holds what changed since the previous one, unless the
+  // chain of them would get longer to restore than a whole grid.
+  bool full = !session->checkpoint_offset
+    || session->chain_length >= SESSION_MAX_CHAIN
+    || session->chain_entries + changed > count;
+
+  struct wl_array payload;
+  wl_array_init(&payload);
+
+  struct session_checkpoint *record = wl_array_add(&payload, sizeof *record);
+  *record = (struct session_checkpoint){
+    .node = node,
+    .base = full ? 0 : session->checkpoint_offset,
+  };
+
+  uint64_t entry_count = 0;
+  for(size_t i=0; i<count; ++i)
+  {
+    if(full ? !grid[i] : grid[i] == session->grid[i])
+      continue;
+
+    struct session_grid_entry *entry = wl_array_add(&payload, sizeof *entry);
+    *entry = (struct session_grid_entry){ .index = i, .tile = grid[i] };
+    entry_count += 1;
+  }
+  ((struct session_checkpoint *)payload.data)->entry_count = entry_count;
+
+  uint64_t offset = session->failed ? 0 : append_record(session, SESSION_RECORD_CHECKPOINT, payload.data, payload.size);
+  wl_array_release(&payload);
+
+  if(offset && write_at(session, offsetof(struct session_header, checkpoint), &offset, sizeof offset))
+  {
+    session->checkpoint = node;
+    session->checkpoint_offset = offset;
+    session->chain_length = full ? 0 : session->chain_length + 1;
+    session->chain_entries = full ? 0 : session->chain_entries + entry_count;
+    offset_map_put(&session->checkpoints, node, (void *)(uintptr_t)offset);
+
+    uint64_t *old_grid = session->grid;
+    session->grid = grid;
+    grid = old_grid;
+  }
+  free(grid);
+}
+
+// Return the payload of the record at offset in the mapping if it is of the
+// given type and at least size bytes large.
+static const void *map_record(const struct session *session, uint64_t offset, uint32_t type, uint64_t size)
+{
+  if(offset < sizeof(struct session_header) + sizeof(struct session_record) || offset % 8 || offset > session->map_size)
+    return NULL;
+
+  const char *payload = (const char *)session->map + offset;
+  const struct session_record *record = (const void *)(payload - sizeof *record);
+  if(record->type != type || record->size < size || record->size > session->map_size - offset)
+    return NULL;
+
+  return payload;
+}
+
+static bool load_grid(struct session *session, const uint64_t *offsets, struct canvas *canvas)
+{
+  for(size_t i=0; i<(size_t)canvas->columns * canvas->rows; ++i)
+  {
+    if(!offsets[i])
+      continue;
+
+    struct tile *tile = offset_map_get(&session->tiles, offsets[i]);
+    if(!tile)
+    {
+      void *data = (void *)map_record(session, offsets[i], SESSION_RECORD_TILE, TILE_BYTES);
+      if(!data)
+        return false;
+
+      tile = tile_new_mapped(data);
+      tile->session_offset = offsets[i];
+      offset_map_put(&session->tiles, offsets[i], tile);
+    }
+    canvas->tiles[i] = tile_ref(tile);
+  }
+  return true;
+}
+
+// Read the header of the file into header, and the size of the file into
+// session->size, if it holds a session of the same size.
+static bool read_header(struct session *session, struct session_header *header)
+{
+  struct stat stat;
+  if(fstat(session->fd, &stat) != 0 || (uint64_t)stat.st_size < sizeof *header)
+    return false;
+
+  if(pread(session->fd, header, sizeof *header, 0) != sizeof *header)
+    return false;
+
+  session->size = stat.st_size;
+  return memcmp(header->magic, SESSION_MAGIC, sizeof header->magic) == 0
+    && header->width == session->width
+    && header->height == session->height
+    && header->tile_size == TILE_SIZE;
+}
+
+static bool restore(struct session *session, struct snapshot *snapshot)
+{
+  struct session_header header;
+  if(!read_header(session, &header))
+    return false;
+
+  uint64_t node, end;
+  if(!read_checkpoint(session, header.checkpoint, &node, &end, session->grid, &session->chain_length, &session->chain_entries))
+    return false;
+
+  // Anything after the latest checkpoint was never completely written.
+  session->map_size = end;
+  session->map = mmap(NULL, session->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, session->fd, 0);
+  if(session->map == MAP_FAILED)
+  {
+    session->map = NULL;
+    return false;
+  }
+
+  if(!map_record(session, node, SESSION_RECORD_NODE, sizeof(struct session_node)))
+    return false;
+
+  struct canvas *canvas = canvas_new(session->width, session->height);
+  if(!load_grid(session, session->grid, canvas))
+  {
+    canvas_destroy(canvas);
+    return false;
+  }
+
+  if(end < session->size && ftruncate(session->fd, end) != 0)
+  {
+    canvas_destroy(canvas);
+    return false;
+  }
+  session->size = end;
+
+  // The snapshot starts out as a single keyframe for the checkpoint. Nodes
+  // before it are grafted once the history is loaded.
+  struct snapshot_node *root = snapshot->current;
+  canvas_destroy(root->canvas);
+  root->canvas = canvas;
+  canvas_destroy(snapshot->canvas);
+  snapshot->canvas = canvas_clone(canvas);
+
+  root->session_offset = node;
+  session->checkpoint = node;
+  session->checkpoint_offset = header.checkpoint;
+  offset_map_put(&session->checkpoints, node, (void *)(uintptr_t)header.checkpoint);
+  session->restored = root;
+  return true;
+}
+
+static bool create(struct session *session, struct snapshot *snapshot)
+{
+  if(ftruncate(session->fd, 0) != 0)
+    return false;
+
+  struct session_header header = {
+    .width = session->width,
+    .height = session->height,
+    .tile_size = TILE_SIZE,
+  };
+  memcpy(header.magic, SESSION_MAGIC, sizeof header.magic);
+
+  if(!write_at(session, 0, &header, sizeof header))
+    return false;
+
+  session->size = sizeof header;
+  session->checkpoint = 0;
+  session->checkpoint_offset = 0;
+  memset(session->grid, 0, (size_t)session->columns * session->rows * sizeof *session->grid);
+  session->chain_length = 0;
+  session->chain_entries = 0;
+  offset_map_release(&session->checkpoints);
+  session->history_loaded = true;
+  session_save(session, snapshot);
+  return !session->failed;
+}
+
+// Return the grid of the keyframe in the node record at payload, or NULL if it
+// is not one.
+static const uint64_t *node_grid(const struct session *session, const void *payload, const struct session_record *record)
+{
+  const struct session_node *data = payload;
+  if(record->size < sizeof *data || !data->keyframe || data->point_count > (record->size - sizeof *data) / sizeof(struct command_point))
+    return NULL;
+
+  size_t points_size = data->point_count * sizeof(struct command_point);
+  size_t grid_size = (size_t)session->columns * session->rows * sizeof(uint64_t);
+  if(record->size < sizeof *data + points_size + grid_size)
+    return NULL;
+
+  return (const uint64_t *)((const char *)(data + 1) + points_size);
+}
+
+// Tiles are never removed from the file, even once no keyframe nor the latest
+// checkpoint refers to them anymore, and neither are older checkpoints. Once
+// they make up most of the file, it is rewritten without them, with the latest
+// checkpoint written back in full.
+static void compact(struct session *session)
+{
+  struct session_header header;
+  if(!read_header(session, &header))
+    return;
+
+  size_t count = (size_t)session->columns * session->rows;
+  uint64_t *grid = malloc(count * sizeof *grid);
+  uint64_t node, end, chain_entries;
+  unsigned chain_length;
+  if(!read_checkpoint(session, header.checkpoint, &node, &end, grid, &chain_length, &chain_entries))
+  {
+    free(grid);
+    return;
+  }
+
+  const char *map = mmap(NULL, end, PROT_READ, MAP_PRIVATE, session->fd, 0);
+  if(map == MAP_FAILED)
+  {
+    free(grid);
+    return;
+  }
+
+  // Find out which tiles are still referred to, and how much is not.
+  struct offset_map live = {0};
+  for(size_t i=0; i<count; ++i)
+    if(grid[i])
+      offset_map_put(&live, grid[i], &live);
+
+  uint64_t tiles_size = 0;
+  uint64_t checkpoints_size = 0;
+  for(uint64_t offset = sizeof header; offset + sizeof(struct session_record) <= end; )
+  {
+    const struct session_record *record = (const void *)(map + offset);
+    uint64_t payload = offset + sizeof *record;
+    offset = payload + record->size;
+    if(record->size > end - payload)
+      break;
+
+    if(record->type == SESSION_RECORD_TILE)
+      tiles_size += sizeof *record + record->size;
+    else if(record->type == SESSION_RECORD_CHECKPOINT)
+      checkpoints_size += sizeof *record + record->size;
+    else if(record->type == SESSION_RECORD_NODE)
+    {
+      const uint64_t *offsets = node_grid(session, map + payload, record);
+      for(size_t i=0; offsets && i<count; ++i)
+        if(offsets[i])
+          offset_map_put(&live, offsets[i], &live);
+    }
+  }
+
+  uint64_t garbage_size = tiles_size - live.count * (sizeof(struct session_record) + TILE_BYTES) + checkpoints_size;
+  if(live.count * (sizeof(struct session_record) + TILE_BYTES) > tiles_size || garbage_size <= end / 2)
+  {
+    offset_map_release(&live);
+    munmap((void *)map, end);
+    free(grid);
+    return;
+  }
+
+  size_t length = strlen(session->path) + sizeof ".compact";
+  char *compact_path = malloc(length);
+  snprintf(compact_path, length, "%s.compact", session->path);
+
+  // Everything kept is copied in the same order, so records still only refer
+  // to earlier ones, and moved tells where each of them went.
+  struct offset_map moved = {0};
+  uint64_t size = sizeof header;
+  bool corrupted = false;
+  header.checkpoint = 0;
+
+  int fd = open(compact_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  bool success = fd >= 0 && write_all(fd, 0, &header, sizeof header);
+  for(uint64_t offset = sizeof header; success && offset + sizeof(struct session_record) <= end; )
+  {
+    const struct session_record *record = (const void *)(map + offset);
+    uint64_t payload = offset + sizeof *record;
+    offset = payload + record->size;
+    if(record->size > end - payload)
+      break;
+
+    uint64_t new_payload = 0;
+    if(record->type == SESSION_RECORD_TILE && offset_map_get(&live, payload))
+    {
+      new_payload = append_to(fd, &size, record->type, map + payload, record->size);
+      success = new_payload != 0;
+    }
+    else if(record->type == SESSION_RECORD_NODE && record->size >= sizeof(struct session_node))
+    {
+      struct session_node *data = malloc(record->size);
+      memcpy(data, map + payload, record->size);
+
+      if(data->parent)
+      {
+        data->parent = (uintptr_t)offset_map_get(&moved, data->parent);
+        corrupted = !data->parent;
+      }
+
+      uint64_t *offsets = (uint64_t *)node_grid(session, data, record);
+      for(size_t i=0; !corrupted && offsets && i<count; ++i)
+      {
+        if(offsets[i])
+        {
+          offsets[i] = (uintptr_t)offset_map_get(&moved, offsets[i]);
+          corrupted = !offsets[i];
+        }
+      }
+
+      if(!corrupted)
+      {
+        new_payload = append_to(fd, &size, record->type, data, record->size);
+        success = new_payload != 0;
+      }
+      free(data);
+    }
+
+    if(corrupted)
+      break;
+
+    if(new_payload)
+      offset_map_put(&moved, payload, (void *)(uintptr_t)new_payload);
+  }
+
+  // Whatever cannot be made sense of is left for restoring to deal with.
+  uint64_t new_node = (uintptr_t)offset_map_get(&moved, node);
+  corrupted = corrupted || !new_node;
+
+  if(success && !corrupted)
+  {
+    struct wl_array payload;
+    wl_array_init(&payload);
+
+    struct session_checkpoint *record = wl_array_add(&payload, sizeof *record);
+    *record = (struct session_checkpoint){ .node = new_node };
+
+    uint64_t entry_count = 0;
+    for(size_t i=0; !corrupted && i<count; ++i)
+    {
+      if(!grid[i])
+        continue;
+
+      struct session_grid_entry *entry = wl_array_add(&payload, sizeof *entry);
+      *entry = (struct session_grid_entry){ .index = i, .tile = (uintptr_t)offset_map_get(&moved, grid[i]) };
+      corrupted = !entry->tile;
+      entry_count += 1;
+    }
+    ((struct session_checkpoint *)payload.data)->entry_count = entry_count;
+
+    if(!corrupted)
+    {
+      uint64_t checkpoint = append_to(fd, &size, SESSION_RECORD_CHECKPOINT, payload.data, payload.size);
+      success = checkpoint
+        && write_all(fd, offsetof(struct session_header, checkpoint), &checkpoint, sizeof checkpoint)
+        && fsync(fd) == 0
+        && rename(compact_path, session->path) == 0;
+    }
+    wl_array_release(&payload);
+  }
+
+  if(!success)
+  {
+    fprintf(stderr, "error: failed to compact session file %s: %s\n", session->path, strerror(errno));
+    fprintf(stderr, "note: the session file is kept as it is\n");
+  }
+
+  if(success && !corrupted)
+  {
+    close(session->fd);
+    session->fd = fd;
+  }
+  else
+  {
+    if(fd >= 0)
+      close(fd);
+    unlink(compact_path);
+  }
+
+  free(compact_path);
+  offset_map_release(&moved);
+  offset_map_release(&live);
+  munmap((void *)map, end);
+  free(grid);
+}
+
+struct session *session_open(const char *path, struct snapshot *snapshot)
+{
+  struct session *session = calloc(1, sizeof *session);
+  session->path = strdup(path);
+  session->width = snapshot->width;
+  session->height = snapshot->height;
+  session->columns = snapshot->canvas->columns;
+  session->rows = snapshot->canvas->rows;
+  session->grid = calloc((size_t)session->columns * session->rows, sizeof *session->grid);
+
+  session->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(session->fd < 0)
+  {
+    fprintf(stderr, "error: failed to open session file %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  compact(session);
+  if(restore(session, snapshot))
+    return session;
+
+  struct offset_map tiles = session->tiles;
+  for(size_t i=0; i<tiles.capacity; ++i)
+    if(tiles.keys[i])
+      tile_unref(tiles.values[i]);
+  offset_map_release(&session->tiles);
+
+  if(session->map)
+  {
+    munmap(session->map, session->map_size);
+    session->map = NULL;
+    session->map_size = 0;
+  }
+
+  // Do not throw away a session we cannot make sense of.
+  struct stat stat;
+  if(fstat(session->fd, &stat) == 0 && stat.st_size > 0)
+  {
+    size_t length = strlen(path) + sizeof ".old";
+    char *old_path = malloc(length);
+    snprintf(old_path, length, "%s.old", path);
+    if(rename(path, old_path) == 0)
+    {
+      fprintf(stderr, "note: session file %s cannot be restored, moved to %s\n", path, old_path);
+      close(session->fd);
+      session->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    free(old_path);
+
+    if(session->fd < 0)
+    {
+      fprintf(stderr, "error: failed to open session file %s: %s\n", path, strerror(errno));
+      goto fail;
+    }
+  }
+
+  if(create(session, snapshot))
+    return session;
+
+  fprintf(stderr, "error: failed to create session file %s\n", path);
+
+fail:
+  session_close(session);
+  return NULL;
+}
+
+void session_close(struct session *session)
+{
+  if(!session)
+    return;
+
+  for(size_t i=0; i<session->tiles.capacity; ++i)
+    if(session->tiles.keys[i])
+      tile_unref(session->tiles.values[i]);
+  offset_map_release(&session->tiles);
+  offset_map_release(&session->checkpoints);
+
+  // Tiles restored from the mapping may still be alive, so the mapping is
+  // intentionally leaked.
+  if(session->fd >= 0)
+    close(session->fd);
+
+  free(session->grid);
+  free(session->path);
+  free(session);
+}
+
+static struct snapshot_node *load_node(struct session *session, struct snapshot_node *node, uint64_t offset, const struct session_record *record)
+{
+  const struct session_node *data = (const void *)((const char *)session->map + offset);
+  if(record->size < sizeof *data || data->point_count > (record->size - sizeof *data) / sizeof(struct command_point))
+    return NULL;
+
+  size_t points_size = data->point_count * sizeof(struct command_point);
+  size_t grid_size = (size_t)session->columns * session->rows * sizeof(uint64_t);
+  if(data->keyframe && record->size < sizeof *data + points_size + grid_size)
+    return NULL;
+
+  struct canvas *canvas = NULL;
+  if(data->keyframe && !node)
+  {
+    canvas = canvas_new(session->width, session->height);
+    if(!load_grid(session, (const uint64_t *)((const char *)(data + 1) + points_size), canvas))
+    {
+      canvas_destroy(canvas);
+      return NULL;
+    }
+  }
+
+  if(!node)
+  {
+    node = calloc(1, sizeof *node);
+    wl_list_init(&node->childs);
+    node->canvas = canvas;
+  }
+  else
+    command_release(&node->command);
+
+  double color[4] = { data->color[0], data->color[1], data->color[2], data->color[3] };
+  command_init(&node->command, data->mode, color, data->weight);
+  node->command.smoothing = data->smoothing;
+  node->command.extents = (cairo_rectangle_int_t){ data->extents[0], data->extents[1], data->extents[2], data->extents[3] };
+  if(points_size)
+    memcpy(wl_array_add(&node->command.points, points_size), data + 1, points_size);
+  command_finish(&node->command);
+
+  node->session_offset = offset;
+  return node;
+}
+
+void session_load_history(struct session *session, struct snapshot *snapshot)
+{
+  if(!session || session->history_loaded)
+    return;
+
+  session->history_loaded = true;
+
+  // Nodes pushed since the restore are the most recent ones, so they are kept
+  // after the loaded nodes, both in chronological order and among the
+  // children of the restored node.
+  struct snapshot_node *restored = session->restored;
+  struct wl_list childs;
+  wl_list_init(&childs);
+  wl_list_insert_list(&childs, &restored->childs);
+  wl_list_init(&restored->childs);
+  wl_list_remove(&restored->link);
+  snapshot->bytes -= snapshot_node_bytes(restored);
+
+  struct offset_map nodes = {0};
+  struct wl_list *position = &snapshot->nodes;
+  bool found = false;
+
+  // Nodes after the restored node in the file are still part of the history
+  // if it got undone, so the whole file is read.
+  uint64_t offset = sizeof(struct session_header);
+  while(offset + sizeof(struct session_record) <= session->map_size)
+  {
+    const struct session_record *record = (const void *)((const char *)session->map + offset);
+    offset += sizeof *record;
+    if(record->size > session->map_size - offset)
+      break;
+
+    uint64_t payload = offset;
+    offset += record->size;
+
+    // Checkpoints tell which tiles can be reused when going back to a node.
+    if(record->type == SESSION_RECORD_CHECKPOINT && record->size >= sizeof(struct session_checkpoint))
+    {
+      const struct session_checkpoint *checkpoint = (const void *)((const char *)session->map + payload);
+      offset_map_put(&session->checkpoints, checkpoint->node, (void *)(uintptr_t)payload);
+    }
+
+    if(record->type != SESSION_RECORD_NODE)
+      continue;
+
+    const struct session_node *data = (const void *)((const char *)session->map + payload);
+    if(record->size < sizeof *data || data->mode >= WAYDRAW_MODE_COUNT || data->smoothing >= COMMAND_SMOOTHING_COUNT)
+      break;
+
+    bool is_restored = payload == restored->session_offset;
+
+    struct snapshot_node *parent = NULL;
+    if(data->parent)
+    {
+      parent = offset_map_get(&nodes, data->parent);
+      if(!parent)
+        break;
+    }
+    else if(!data->keyframe && !is_restored)
+      break;
+
+    struct snapshot_node *node = load_node(session, is_restored ? restored : NULL, payload, record);
+    if(!node)
+      break;
+
+    node->parent = parent;
+    if(parent)
+      wl_list_insert(parent->childs.prev, &node->silbing_link);
+    node->distance = node->canvas ? 0 : parent->distance + 1;
+
+    wl_list_insert(position, &node->link);
+    position = &node->link;
+    offset_map_put(&nodes, payload, node);
+
+    if(is_restored)
+      found = true;
+    else
+      snapshot->count += 1;
+    snapshot->bytes += snapshot_node_bytes(node);
+  }
+
+  if(!found)
+  {
+    fprintf(stderr, "error: session file %s is corrupted, history before the restored state is lost\n", session->path);
+
+    // Drop whatever got loaded and make the restored node the root again.
+    struct snapshot_node *node, *tmp;
+    wl_list_for_each_safe(node, tmp, &snapshot->nodes, link)
+    {
+      if(node == restored || offset_map_get(&nodes, node->session_offset) != node)
+        continue;
+
+      wl_list_remove(&node->link);
+      snapshot->count -= 1;
+      snapshot->bytes -= snapshot_node_bytes(node);
+      command_release(&node->command);
+      if(node->canvas)
+        canvas_destroy(node->canvas);
+      free(node);
+    }
+
+    wl_list_insert(&snapshot->nodes, &restored->link);
+    snapshot->bytes += snapshot_node_bytes(restored);
+  }
+
+  wl_list_insert_list(restored->childs.prev, &childs);
+  offset_map_release(&nodes);
+
+  for(size_t i=0; i<session->tiles.capacity; ++i)
+    if(session->tiles.keys[i])
+      tile_unref(session->tiles.values[i]);
+  offset_map_release(&session->tiles);
+}
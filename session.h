@@ -0,0 +1,50 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+// A session file keeps the snapshot of an output across restarts.
+//
+// The file is append-only. It starts with a header, followed by records for
+// tiles, snapshot nodes and checkpoints of the current node:
+//   - a tile record holds the raw pixels of a tile, so that a tile can be
+//     used straight from a mapping of the file,
+//   - a node record holds the command of a node, the offset of its parent
+//     node record, and the offsets of its tiles if it is a keyframe,
+//   - a checkpoint record holds the offset of the current node record, and
+//     the offsets of the tiles of the current canvas which changed since the
+//     checkpoint it is based on, or of all of them if it has no base.
+// The header points at the latest checkpoint, which is only updated once
+// everything it refers to has been written.
+//
+// Tiles are only appended when they are new, so going back to a node which
+// was checkpointed before, by undo for example, only appends a checkpoint.
+// Tiles and checkpoints which are no longer needed are dropped when the file
+// is opened, once they make up most of it.
+//
+// Restoring only maps the file and follows the latest checkpoint, so that the
+// output can be displayed right away however long the history is. The rest of
+// the history is only read once it is actually needed, by undo for example.
+//
+// Records are written in the native byte order and layout, so session files
+// are not portable between architectures.
+
+#include "snapshot.h"
+
+struct session;
+
+// Open the session file at path for snapshot, which must have just been
+// created. If the file holds a session of the same size, the snapshot is
+// restored from it. Otherwise, a new session is started, and any existing
+// file is moved out of the way. Return NULL if the file cannot be opened.
+struct session *session_open(const char *path, struct snapshot *snapshot);
+void session_close(struct session *session);
+
+// Append the nodes of snapshot which have not been saved yet up to the current
+// node, and a checkpoint of the current node. Does nothing if session is NULL.
+void session_save(struct session *session, struct snapshot *snapshot);
+
+// Load the history of a restored snapshot which has not been loaded yet. This
+// must be done before the history is used or modified in any way other than
+// pushing new nodes. Does nothing if session is NULL.
+void session_load_history(struct session *session, struct snapshot *snapshot);
+
+#endif // SESSION_H
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
+
 #include "shm.h"
 
+#include "stats.h"
+
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
@@ -25,6 +29,12 @@ randname(char *buf)
 static int
 create_shm_file(void)
 {
+    /* Prefer an anonymous memfd, which needs neither a name nor a retry loop,
+     * and only fall back to shm_open on kernels that lack it. */
+    int fd = memfd_create("waydraw-shm", MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+
     int retries = 100;
     do {
         char name[] = "/wl_shm-XXXXXX";
@@ -53,5 +63,6 @@ allocate_shm_file(size_t size)
         close(fd);
         return -1;
     }
+    stats_count(STATS_SHM_FILES, 1);
     return fd;
 }
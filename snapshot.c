@@ -7,31 +7,143 @@
 
 #include <stdlib.h>
 
+size_t snapshot_node_bytes(const struct snapshot_node *node)
+{
+  size_t bytes = sizeof *node + node->command.points.alloc;
+  if(node->canvas)
+    bytes += (size_t)node->canvas->columns * node->canvas->rows * sizeof *node->canvas->tiles;
+  return bytes;
+}
+
 struct snapshot *snapshot_new(uint32_t width, uint32_t height)
 {
   struct snapshot_node *node = calloc(1, sizeof *node);
   wl_list_init(&node->childs);
-  node->cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  wl_array_init(&node->command.points);
+  node->canvas = canvas_new(width, height);
 
   struct snapshot *snapshot = calloc(1, sizeof *snapshot);
+  snapshot->width = width;
+  snapshot->height = height;
   wl_list_init(&snapshot->nodes);
   wl_list_insert(&snapshot->nodes, &node->link);
 
   snapshot->current = node;
+  snapshot->canvas = canvas_clone(node->canvas);
+  snapshot->keyframe_interval = SNAPSHOT_DEFAULT_KEYFRAME_INTERVAL;
+  snapshot->count = 1;
+  snapshot->bytes = snapshot_node_bytes(node);
   return snapshot;
 }
 
-void snapshot_push(struct snapshot *snapshot, cairo_surface_t *surface)
+void snapshot_destroy(struct snapshot *snapshot)
+{
+  struct snapshot_node *node, *tmp;
+  wl_list_for_each_safe(node, tmp, &snapshot->nodes, link)
+  {
+    command_release(&node->command);
+    if(node->canvas)
+      canvas_destroy(node->canvas);
+    free(node);
+  }
+
+  canvas_destroy(snapshot->canvas);
+  free(snapshot);
+}
+
+void snapshot_push(struct snapshot *snapshot, struct command *command, struct canvas *canvas)
 {
   struct snapshot_node *node = calloc(1, sizeof *node);
   wl_list_init(&node->childs);
-  node->cairo_surface = surface;
+  node->command = *command;
+
+  node->distance = snapshot->current->distance + 1;
+  if(node->distance >= snapshot->keyframe_interval)
+  {
+    node->canvas = canvas_clone(canvas);
+    node->distance = 0;
+  }
 
   wl_list_insert(snapshot->nodes.prev, &node->link);
   wl_list_insert(snapshot->current->childs.prev, &node->silbing_link);
 
   node->parent = snapshot->current;
   snapshot->current = node;
+
+  snapshot->count += 1;
+  snapshot->bytes += snapshot_node_bytes(node);
+
+  canvas_destroy(snapshot->canvas);
+  snapshot->canvas = canvas;
+}
+
+static void apply_command(struct canvas *canvas, const struct command *command)
+{
+  const cairo_rectangle_int_t *extents = &command->extents;
+  if(extents->width <= 0 || extents->height <= 0)
+    return;
+
+  if(command->mode == WAYDRAW_MODE_CLEAR)
+  {
+    canvas_clear(canvas);
+    return;
+  }
+
+  // Only a layer as large as the command is needed. Since the offset is an
+  // integer, the command is rasterized exactly the same as it was while it
+  // was drawn on a layer as large as the output.
+  cairo_surface_t *layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, extents->width, extents->height);
+  cairo_t *cairo = cairo_create(layer);
+  cairo_translate(cairo, -extents->x, -extents->y);
+  command_render(command, cairo);
+  cairo_destroy(cairo);
+
+  canvas_composite(canvas, layer, extents->x, extents->y, extents);
+  cairo_surface_destroy(layer);
+}
+
+// Make node the current node and recover its canvas.
+static void snapshot_checkout(struct snapshot *snapshot, struct snapshot_node *node)
+{
+  struct snapshot_node *current = snapshot->current;
+  snapshot->current = node;
+
+  if(node == current)
+    return;
+
+  // Stepping forward by one node, which is what redo does most of the time,
+  // only needs a single command applied on top of what we have.
+  if(node->parent == current && !node->canvas)
+  {
+    apply_command(snapshot->canvas, &node->command);
+    return;
+  }
+
+  struct snapshot_node **path = calloc(node->distance, sizeof *path);
+  struct snapshot_node *keyframe = node;
+  for(unsigned i=node->distance; i>0; --i)
+  {
+    path[i-1] = keyframe;
+    keyframe = keyframe->parent;
+  }
+
+  struct canvas *canvas = canvas_clone(keyframe->canvas);
+  for(unsigned i=0; i<node->distance; ++i)
+    apply_command(canvas, &path[i]->command);
+  free(path);
+
+  canvas_destroy(snapshot->canvas);
+  snapshot->canvas = canvas;
+}
+
+void snapshot_clear(struct snapshot *snapshot)
+{
+  static const double transparent[4] = {0};
+
+  struct command command;
+  command_init(&command, WAYDRAW_MODE_CLEAR, transparent, 0.0);
+  command.extents = (cairo_rectangle_int_t){ 0, 0, snapshot->width, snapshot->height };
+  snapshot_push(snapshot, &command, canvas_new(snapshot->width, snapshot->height));
 }
 
 void snapshot_undo(struct snapshot *snapshot)
@@ -43,7 +155,7 @@ void snapshot_undo(struct snapshot *snapshot)
   wl_list_remove(&snapshot->current->silbing_link);
   wl_list_insert(parent->childs.prev, &snapshot->current->silbing_link);
 
-  snapshot->current = parent;
+  snapshot_checkout(snapshot, parent);
 }
 
 void snapshot_redo(struct snapshot *snapshot)
@@ -53,7 +165,7 @@ void snapshot_redo(struct snapshot *snapshot)
 
   struct wl_list *elem = snapshot->current->childs.prev;
   struct snapshot_node *node = wl_container_of(elem, node, silbing_link);
-  snapshot->current = node;
+  snapshot_checkout(snapshot, node);
 }
 
 void snapshot_earlier(struct snapshot *snapshot)
@@ -63,7 +175,7 @@ void snapshot_earlier(struct snapshot *snapshot)
     return;
 
   struct snapshot_node *node = wl_container_of(elem, node, link);
-  snapshot->current = node;
+  snapshot_checkout(snapshot, node);
 }
 
 void snapshot_later(struct snapshot *snapshot)
@@ -73,6 +185,126 @@ void snapshot_later(struct snapshot *snapshot)
     return;
 
   struct snapshot_node *node = wl_container_of(elem, node, link);
-  snapshot->current = node;
+  snapshot_checkout(snapshot, node);
+}
+
+void snapshot_compress(struct snapshot *snapshot, unsigned distance)
+{
+  // Tiles are shared between keyframes and the current canvas, so the tiles
+  // that should stay uncompressed are marked first. Any mark not used before
+  // would do.
+  static unsigned mark;
+  mark += 1;
+
+  struct canvas *canvas = snapshot->canvas;
+  for(size_t i=0; i<(size_t)canvas->columns * canvas->rows; ++i)
+    if(canvas->tiles[i])
+      canvas->tiles[i]->mark = mark;
+
+  // Undo starts replaying from the closest keyframe.
+  struct snapshot_node *keyframe = snapshot->current;
+  while(!keyframe->canvas)
+    keyframe = keyframe->parent;
+
+  size_t current_index = 0;
+  struct snapshot_node *node;
+  wl_list_for_each(node, &snapshot->nodes, link)
+  {
+    if(node == snapshot->current)
+      break;
+    current_index += 1;
+  }
+
+  size_t index = 0;
+  wl_list_for_each(node, &snapshot->nodes, link)
+  {
+    size_t d = index > current_index ? index - current_index : current_index - index;
+    if(node->canvas && (d <= distance || node == keyframe))
+      for(size_t i=0; i<(size_t)node->canvas->columns * node->canvas->rows; ++i)
+        if(node->canvas->tiles[i])
+          node->canvas->tiles[i]->mark = mark;
+    index += 1;
+  }
+
+  wl_list_for_each(node, &snapshot->nodes, link)
+    if(node->canvas)
+      for(size_t i=0; i<(size_t)node->canvas->columns * node->canvas->rows; ++i)
+        if(node->canvas->tiles[i] && node->canvas->tiles[i]->mark != mark)
+          tile_compress(node->canvas->tiles[i]);
+}
+
+static void remove_node(struct snapshot *snapshot, struct snapshot_node *node)
+{
+  snapshot->count -= 1;
+  snapshot->bytes -= snapshot_node_bytes(node);
+
+  wl_list_remove(&node->link);
+  if(node->parent)
+    wl_list_remove(&node->silbing_link);
+
+  command_release(&node->command);
+  if(node->canvas)
+    canvas_destroy(node->canvas);
+
+  free(node);
+}
+
+// Recompute the distance to the closest keyframe for node and its descendants
+// after it became a keyframe.
+static void update_distance(struct snapshot_node *node)
+{
+  node->distance = node->canvas ? 0 : node->parent->distance + 1;
+
+  struct snapshot_node *child;
+  wl_list_for_each(child, &node->childs, silbing_link)
+    if(!child->canvas)
+      update_distance(child);
+}
+
+// Remove the root, which must have a single child, making its child the new
+// root.
+static void remove_root(struct snapshot *snapshot, struct snapshot_node *root)
+{
+  struct snapshot_node *node = wl_container_of(root->childs.next, node, silbing_link);
+
+  snapshot->bytes -= snapshot_node_bytes(node);
+  if(!node->canvas)
+  {
+    node->canvas = canvas_clone(root->canvas);
+    apply_command(node->canvas, &node->command);
+  }
+
+  // The command of the root is never used.
+  command_release(&node->command);
+  wl_array_init(&node->command.points);
+  snapshot->bytes += snapshot_node_bytes(node);
+
+  wl_list_remove(&node->silbing_link);
+  node->parent = NULL;
+  update_distance(node);
+
+  remove_node(snapshot, root);
 }
 
+bool snapshot_prune(struct snapshot *snapshot)
+{
+  struct snapshot_node *node;
+  wl_list_for_each(node, &snapshot->nodes, link)
+  {
+    if(node == snapshot->current)
+      continue;
+
+    if(wl_list_empty(&node->childs))
+    {
+      remove_node(snapshot, node);
+      return true;
+    }
+
+    if(!node->parent && node->childs.next == node->childs.prev)
+    {
+      remove_root(snapshot, node);
+      return true;
+    }
+  }
+  return false;
+}
@@ -11,15 +11,29 @@
 // participate in two container:
 //   - a linked list to support earlier/later command
 //   - a tree to support undo/redo command
+//
+// Each node records the drawing command that brings its parent to it. Only
+// every so often does a node also keep the resulting canvas as a keyframe, and
+// the canvas of any other node is recovered by replaying commands starting
+// from its closest ancestor that is a keyframe. The root is always a keyframe.
+//
+// To keep memory in check, keyframes far away from the current node can be
+// compressed, and nodes can be pruned starting from the oldest one.
+
+#include "canvas.h"
+#include "command.h"
 
 #include <cairo.h>
 
 #include <wayland-util.h>
 #include <wayland-client-protocol.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#define SNAPSHOT_DEFAULT_KEYFRAME_INTERVAL 32
+
 struct snapshot_node
 {
   struct wl_list link;
@@ -28,18 +42,42 @@ struct snapshot_node
   struct wl_list childs;
   struct wl_list silbing_link;
 
-  cairo_surface_t *cairo_surface;
+  struct command command;
+
+  struct canvas *canvas;  // only for keyframes
+  unsigned distance;      // number of commands since the closest keyframe
+
+  uint64_t session_offset; // offset of the node in the session file, 0 if not saved
 };
 
 struct snapshot
 {
+  uint32_t width, height;
+
   struct wl_list nodes; // list of nodes in chronological order
   struct snapshot_node *current; // current node we will act on
+
+  struct canvas *canvas; // canvas of the current node
+  unsigned keyframe_interval;
+
+  size_t count; // number of nodes
+  size_t bytes; // memory used by nodes and their commands, excluding tiles
 };
 
 struct snapshot *snapshot_new(uint32_t width, uint32_t height);
+void snapshot_destroy(struct snapshot *snapshot);
+
+// Memory used by node and its command, excluding tiles, as accounted in bytes.
+size_t snapshot_node_bytes(const struct snapshot_node *node);
 
-void snapshot_push(struct snapshot *snapshot, cairo_surface_t *surface);
+// Push a new node for command as a child of the current node. The snapshot
+// takes ownership of both the command and the canvas, which must be the result
+// of applying the command on the current canvas.
+void snapshot_push(struct snapshot *snapshot, struct command *command, struct canvas *canvas);
+
+// Push a node that clears the whole canvas, which can be undone like any
+// other.
+void snapshot_clear(struct snapshot *snapshot);
 
 void snapshot_undo(struct snapshot *snapshot);
 void snapshot_redo(struct snapshot *snapshot);
@@ -47,4 +85,13 @@ void snapshot_redo(struct snapshot *snapshot);
 void snapshot_earlier(struct snapshot *snapshot);
 void snapshot_later(struct snapshot *snapshot);
 
+// Compress tiles of keyframes which are more than distance nodes away from the
+// current node in chronological order, unless they are also used by the
+// current canvas or by a keyframe within that distance.
+void snapshot_compress(struct snapshot *snapshot, unsigned distance);
+
+// Remove the oldest node that is not needed to recover the current node,
+// either a leaf or the root. Return false if there is no such node.
+bool snapshot_prune(struct snapshot *snapshot);
+
 #endif // SNAPSHOT_H
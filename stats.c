@@ -0,0 +1,134 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <time.h>
+
+#define STATS_BUCKETS 64
+
+struct histogram
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+
+  // Bucket i counts values in [2^(i-1), 2^i), except that bucket 0 counts
+  // zeroes.
+  uint64_t buckets[STATS_BUCKETS];
+};
+
+static const struct
+{
+  const char *name;
+  const char *description;
+} COUNTERS[STATS_COUNTER_COUNT] = {
+  [STATS_SHM_FILES]        = { "shm_files", "shm files created" },
+  [STATS_SHM_BYTES]        = { "shm_bytes", "bytes written to shm buffers" },
+  [STATS_TILE_BYTES]       = { "tile_bytes", "bytes copied to unshare tiles" },
+  [STATS_LAYER_BYTES]      = { "layer_bytes", "bytes allocated for seat layers" },
+  [STATS_INPUT_POINTS]     = { "input_points", "pointer positions fed to strokes" },
+  [STATS_PREVIEW_SEGMENTS] = { "preview_segments", "segments stroked in previews" },
+};
+
+static const struct
+{
+  const char *name;
+  bool duration; // in nanoseconds, as opposed to a plain number
+} HISTOGRAMS[STATS_HISTOGRAM_COUNT] = {
+  [STATS_CLONE]            = { "clone", true },
+  [STATS_COMPOSITE]        = { "composite", true },
+  [STATS_UPLOAD]           = { "upload", true },
+  [STATS_COMMIT]           = { "commit", true },
+  [STATS_FRAME_CALLBACK]   = { "frame_callback", true },
+  [STATS_EVENTS_PER_FRAME] = { "events_per_frame", false },
+  [STATS_WAKEUP]           = { "wakeup", true },
+};
+
+// Counters are bumped by workers too.
+static _Atomic uint64_t counters[STATS_COUNTER_COUNT];
+static struct histogram histograms[STATS_HISTOGRAM_COUNT];
+
+void stats_count(enum stats_counter counter, uint64_t value)
+{
+  counters[counter] += value;
+}
+
+uint64_t stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(enum stats_histogram histogram, uint64_t value)
+{
+  struct histogram *h = &histograms[histogram];
+  h->count += 1;
+  h->sum += value;
+  if(value > h->max)
+    h->max = value;
+
+  unsigned bucket = value ? 64 - __builtin_clzll(value) : 0;
+  h->buckets[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1] += 1;
+}
+
+void stats_record_since(enum stats_histogram histogram, uint64_t start)
+{
+  stats_record(histogram, stats_now() - start);
+}
+
+// Upper bound of the values below the given fraction of values.
+static uint64_t percentile(const struct histogram *h, double fraction)
+{
+  uint64_t target = h->count * fraction;
+  uint64_t seen = 0;
+  for(unsigned i=0; i<STATS_BUCKETS; ++i)
+  {
+    seen += h->buckets[i];
+    if(seen > target)
+    {
+      uint64_t bound = ((uint64_t)1 << i) - 1;
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void print_value(FILE *file, bool duration, double value)
+{
+  if(!duration)
+    fprintf(file, "%.1f", value);
+  else if(value < 1e3)
+    fprintf(file, "%.0fns", value);
+  else if(value < 1e6)
+    fprintf(file, "%.1fus", value / 1e3);
+  else
+    fprintf(file, "%.1fms", value / 1e6);
+}
+
+void stats_dump(FILE *file)
+{
+  for(unsigned i=0; i<STATS_COUNTER_COUNT; ++i)
+    fprintf(file, "stats: %s: %lu %s\n", COUNTERS[i].name, (unsigned long)atomic_load(&counters[i]), COUNTERS[i].description);
+
+  for(unsigned i=0; i<STATS_HISTOGRAM_COUNT; ++i)
+  {
+    const struct histogram *h = &histograms[i];
+    bool duration = HISTOGRAMS[i].duration;
+
+    fprintf(file, "stats: %s: %lu samples", HISTOGRAMS[i].name, (unsigned long)h->count);
+    if(h->count)
+    {
+      fprintf(file, ", mean ");
+      print_value(file, duration, (double)h->sum / h->count);
+      fprintf(file, ", p50 <= ");
+      print_value(file, duration, percentile(h, 0.5));
+      fprintf(file, ", p99 <= ");
+      print_value(file, duration, percentile(h, 0.99));
+      fprintf(file, ", max ");
+      print_value(file, duration, h->max);
+    }
+    fprintf(file, "\n");
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Counters and histograms of where time goes on the hot path, cheap enough to
+// be always on and dumped on demand.
+//
+// Histograms have a bucket per power of two, so percentiles are only accurate
+// to within a factor of two. That is plenty to tell whether a frame took
+// microseconds or milliseconds.
+//
+// Counters can be updated from any thread, but histograms only from the main
+// thread.
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum stats_counter
+{
+  STATS_SHM_FILES,        // shm files created
+  STATS_SHM_BYTES,        // bytes rendered or copied into shm buffers
+  STATS_TILE_BYTES,       // bytes copied to unshare tiles of a canvas
+  STATS_LAYER_BYTES,      // bytes allocated for seat layers
+  STATS_INPUT_POINTS,     // pointer positions fed to strokes in progress
+  STATS_PREVIEW_SEGMENTS, // segments stroked to preview strokes in progress
+
+  STATS_COUNTER_COUNT,
+};
+
+enum stats_histogram
+{
+  STATS_CLONE,            // nanoseconds spent in canvas_clone()
+  STATS_COMPOSITE,        // nanoseconds spent compositing a stroke into a canvas
+  STATS_UPLOAD,           // nanoseconds spent rendering damage into a shm buffer
+  STATS_COMMIT,           // nanoseconds spent attaching and committing a buffer
+  STATS_FRAME_CALLBACK,   // nanoseconds from a commit until the compositor is done with the frame
+  STATS_EVENTS_PER_FRAME, // pointer events in each pointer frame
+  STATS_WAKEUP,           // nanoseconds from resuming until every output is shown again
+
+  STATS_HISTOGRAM_COUNT,
+};
+
+void stats_count(enum stats_counter counter, uint64_t value);
+
+// Current time in nanoseconds, to be passed to stats_record_since().
+uint64_t stats_now(void);
+
+void stats_record(enum stats_histogram histogram, uint64_t value);
+void stats_record_since(enum stats_histogram histogram, uint64_t start);
+
+void stats_dump(FILE *file);
+
+#endif // STATS_H
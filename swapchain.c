@@ -0,0 +1,134 @@
+#include "swapchain.h"
+
+#include "shm.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+static void release_buffer(void *data, struct wl_buffer *wl_buffer)
+{
+  (void)wl_buffer;
+
+  struct swapchain_buffer *buffer = data;
+  struct swapchain *swapchain = buffer->swapchain;
+  buffer->busy = false;
+
+  if(swapchain->waiting)
+  {
+    swapchain->waiting = false;
+    if(swapchain->release)
+      swapchain->release(swapchain->release_data);
+  }
+}
+
+static struct wl_buffer_listener buffer_listener = {
+  .release = &release_buffer,
+};
+
+struct swapchain *swapchain_new(struct wl_shm *wl_shm, uint32_t width, uint32_t height)
+{
+  struct swapchain *swapchain = calloc(1, sizeof *swapchain);
+  swapchain->wl_shm = wl_shm;
+  swapchain->width = width;
+  swapchain->height = height;
+  swapchain->stride = width * 4;
+
+  // The pool is sized for the maximum number of buffers up-front. Pages are
+  // only populated on first touch, so buffers that never get created cost
+  // nothing but address space.
+  swapchain->size = (size_t)swapchain->stride * height * SWAPCHAIN_MAX_BUFFERS;
+
+  swapchain->fd = allocate_shm_file(swapchain->size);
+  if(swapchain->fd < 0)
+  {
+    fprintf(stderr, "error: failed to open shm file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  swapchain->data = mmap(NULL, swapchain->size, PROT_READ | PROT_WRITE, MAP_SHARED, swapchain->fd, 0);
+  if(swapchain->data == MAP_FAILED)
+  {
+    fprintf(stderr, "error: failed to mmap shm file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  swapchain->wl_shm_pool = wl_shm_create_pool(wl_shm, swapchain->fd, swapchain->size);
+  return swapchain;
+}
+
+void swapchain_destroy(struct swapchain *swapchain)
+{
+  for(unsigned i=0; i<swapchain->count; ++i)
+  {
+    cairo_region_destroy(swapchain->buffers[i].damage);
+    cairo_surface_destroy(swapchain->buffers[i].cairo_surface);
+    wl_buffer_destroy(swapchain->buffers[i].wl_buffer);
+  }
+
+  wl_shm_pool_destroy(swapchain->wl_shm_pool);
+  munmap(swapchain->data, swapchain->size);
+  close(swapchain->fd);
+  free(swapchain);
+}
+
+struct swapchain_buffer *swapchain_acquire(struct swapchain *swapchain)
+{
+  struct swapchain_buffer *buffer = NULL;
+  for(unsigned i=0; i<swapchain->count; ++i)
+    if(!swapchain->buffers[i].busy)
+    {
+      buffer = &swapchain->buffers[i];
+      break;
+    }
+
+  if(!buffer && swapchain->count < SWAPCHAIN_MAX_BUFFERS)
+  {
+    size_t offset = (size_t)swapchain->stride * swapchain->height * swapchain->count;
+
+    buffer = &swapchain->buffers[swapchain->count++];
+    buffer->swapchain = swapchain;
+    buffer->data = (char *)swapchain->data + offset;
+    buffer->wl_buffer = wl_shm_pool_create_buffer(swapchain->wl_shm_pool,
+        offset,
+        swapchain->width,
+        swapchain->height,
+        swapchain->stride,
+        WL_SHM_FORMAT_ARGB8888);
+
+    buffer->cairo_surface = cairo_image_surface_create_for_data(buffer->data,
+        CAIRO_FORMAT_ARGB32,
+        swapchain->width,
+        swapchain->height,
+        swapchain->stride);
+
+    cairo_rectangle_int_t rect = { 0, 0, swapchain->width, swapchain->height };
+    buffer->damage = cairo_region_create_rectangle(&rect);
+
+    wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+  }
+
+  if(!buffer)
+  {
+    swapchain->waiting = true;
+    swapchain->stats.stalls += 1;
+    return NULL;
+  }
+
+  buffer->busy = true;
+  swapchain->stats.frames += 1;
+  return buffer;
+}
+
+void swapchain_damage(struct swapchain *swapchain, const cairo_region_t *region)
+{
+  for(unsigned i=0; i<swapchain->count; ++i)
+    cairo_region_union(swapchain->buffers[i].damage, region);
+}
@@ -0,0 +1,80 @@
+#ifndef SWAPCHAIN_H
+#define SWAPCHAIN_H
+
+// A small set of wl_buffer carved out of a single long-lived shm pool.
+//
+// Buffers are handed out by swapchain_acquire() and become available again
+// once the compositor sends wl_buffer.release for them. If every buffer is
+// still held by the compositor, swapchain_acquire() returns NULL and the
+// release callback is invoked as soon as one of them comes back, at which
+// point the caller should try again.
+//
+// A buffer returned by swapchain_acquire() is considered busy until it is
+// released by the compositor, so the caller must attach and commit it.
+
+#include <cairo.h>
+#include <wayland-client.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SWAPCHAIN_MAX_BUFFERS 3
+
+struct swapchain;
+
+struct swapchain_buffer
+{
+  struct swapchain *swapchain;
+  struct wl_buffer *wl_buffer;
+  void *data;
+  bool busy;
+
+  // A view over data so that we could render straight into the memory that
+  // is shared with the compositor.
+  cairo_surface_t *cairo_surface;
+
+  // Region of the buffer whose content is out of date, that is everything
+  // that has been damaged since the buffer was last rendered to.
+  cairo_region_t *damage;
+};
+
+struct swapchain_stats
+{
+  uint64_t frames; // number of successful swapchain_acquire()
+  uint64_t stalls; // number of swapchain_acquire() that found every buffer busy
+};
+
+struct swapchain
+{
+  struct wl_shm *wl_shm;
+
+  uint32_t width, height, stride;
+
+  int fd;
+  void *data;
+  size_t size;
+  struct wl_shm_pool *wl_shm_pool;
+
+  // Buffers are only created when there is no free one, so in the common case
+  // where the compositor releases the previous buffer in time only two of them
+  // ever get touched.
+  unsigned count;
+  struct swapchain_buffer buffers[SWAPCHAIN_MAX_BUFFERS];
+
+  bool waiting;
+  void (*release)(void *data);
+  void *release_data;
+
+  struct swapchain_stats stats;
+};
+
+struct swapchain *swapchain_new(struct wl_shm *wl_shm, uint32_t width, uint32_t height);
+void swapchain_destroy(struct swapchain *swapchain);
+
+struct swapchain_buffer *swapchain_acquire(struct swapchain *swapchain);
+
+// Mark region as out of date in every buffer.
+void swapchain_damage(struct swapchain *swapchain, const cairo_region_t *region);
+
+#endif // SWAPCHAIN_H
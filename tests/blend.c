@@ -0,0 +1,181 @@
+// Check that every compositing kernel supported by the CPU gives bit-exact
+// results to cairo, on random premultiplied pixels and random regions.
+//
+// Usage: blend
+
+#include "blend.h"
+#include "cairo-utils.h"
+
+#include <cairo.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROUNDS 200
+#define MAX_SIZE 150
+
+static uint64_t state = 0x9e3779b97f4a7c15;
+
+static uint32_t random_number(uint32_t bound)
+{
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state % bound;
+}
+
+// Runs of fully transparent and fully opaque pixels are mixed in, so that the
+// shortcuts the kernels take for them are covered too.
+static void fill_random(cairo_surface_t *surface)
+{
+  unsigned char *data = cairo_image_surface_get_data(surface);
+  int width = cairo_image_surface_get_width(surface);
+  int height = cairo_image_surface_get_height(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+
+  for(int y=0; y<height; ++y)
+  {
+    uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+    for(int x=0; x<width;)
+    {
+      int run = 1 + random_number(20);
+      uint32_t kind = random_number(3);
+      for(; run > 0 && x < width; --run, ++x)
+      {
+        uint32_t alpha = kind == 0 ? 0 : kind == 1 ? 255 : random_number(256);
+        uint32_t pixel = alpha << 24;
+        for(int shift=0; shift<24; shift+=8)
+          pixel |= random_number(alpha + 1) << shift;
+        row[x] = pixel;
+      }
+    }
+  }
+  cairo_surface_mark_dirty(surface);
+}
+
+static cairo_surface_t *create_random(int width, int height)
+{
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  fill_random(surface);
+  return surface;
+}
+
+static cairo_region_t *random_region(int width, int height)
+{
+  cairo_region_t *region = cairo_region_create();
+  int n = 1 + random_number(4);
+  for(int i=0; i<n; ++i)
+  {
+    cairo_rectangle_int_t rect;
+    rect.x = random_number(width + 20) - 10;
+    rect.y = random_number(height + 20) - 10;
+    rect.width = 1 + random_number(width);
+    rect.height = 1 + random_number(height);
+    cairo_region_union_rectangle(region, &rect);
+  }
+  return region;
+}
+
+static bool compare(cairo_surface_t *actual, cairo_surface_t *expected, const char *kernels, const char *operation, int round)
+{
+  cairo_surface_flush(actual);
+  cairo_surface_flush(expected);
+
+  int width = cairo_image_surface_get_width(actual);
+  int height = cairo_image_surface_get_height(actual);
+  for(int y=0; y<height; ++y)
+  {
+    const uint32_t *actual_row = (const uint32_t *)(cairo_image_surface_get_data(actual) + (size_t)y * cairo_image_surface_get_stride(actual));
+    const uint32_t *expected_row = (const uint32_t *)(cairo_image_surface_get_data(expected) + (size_t)y * cairo_image_surface_get_stride(expected));
+    for(int x=0; x<width; ++x)
+      if(actual_row[x] != expected_row[x])
+      {
+        fprintf(stderr, "error: %s %s differs from cairo in round %d at (%d, %d): %08x instead of %08x\n",
+            kernels, operation, round, x, y, actual_row[x], expected_row[x]);
+        return false;
+      }
+  }
+  return true;
+}
+
+static bool check_round(const char *kernels, int round)
+{
+  int width = 1 + random_number(MAX_SIZE);
+  int height = 1 + random_number(MAX_SIZE);
+  int src_width = 1 + random_number(MAX_SIZE);
+  int src_height = 1 + random_number(MAX_SIZE);
+  int src_x = random_number(width + src_width) - src_width;
+  int src_y = random_number(height + src_height) - src_height;
+
+  cairo_surface_t *src = random_number(8) == 0 ? NULL : create_random(src_width, src_height);
+  cairo_surface_t *actual = create_random(width, height);
+  cairo_surface_t *expected = cairo_image_surface_clone(actual);
+  cairo_region_t *region = random_number(8) == 0 ? NULL : random_region(width, height);
+
+  bool over = random_number(2) == 0;
+  if(over)
+    blend_over(actual, src, src_x, src_y, region);
+  else
+    blend_copy(actual, src, src_x, src_y, region);
+
+  // Without a source, blend_copy() clears everything within region.
+  cairo_t *cairo = cairo_create(expected);
+  if(src)
+  {
+    cairo_rectangle(cairo, src_x, src_y, src_width, src_height);
+    cairo_clip(cairo);
+  }
+  if(region)
+    cairo_clip_region(cairo, region);
+
+  if(!src)
+  {
+    if(!over)
+    {
+      cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+      cairo_paint(cairo);
+    }
+  }
+  else
+  {
+    cairo_set_operator(cairo, over ? CAIRO_OPERATOR_OVER : CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cairo, src, src_x, src_y);
+    cairo_paint(cairo);
+  }
+  cairo_destroy(cairo);
+
+  bool result = compare(actual, expected, kernels, over ? "over" : "copy", round);
+
+  if(region)
+    cairo_region_destroy(region);
+  cairo_surface_destroy(expected);
+  cairo_surface_destroy(actual);
+  if(src)
+    cairo_surface_destroy(src);
+  return result;
+}
+
+int main(void)
+{
+  static const char *const kernels[] = { "avx2", "sse2", "neon", "generic" };
+
+  bool success = true;
+  for(unsigned i=0; i<sizeof kernels / sizeof kernels[0]; ++i)
+  {
+    if(!blend_select(kernels[i]))
+    {
+      printf("skipped: %s kernels are not supported\n", kernels[i]);
+      continue;
+    }
+
+    bool passed = true;
+    for(int round=0; round<ROUNDS && passed; ++round)
+      passed = check_round(kernels[i], round);
+
+    printf("%s: %s\n", kernels[i], passed ? "ok" : "failed");
+    success = success && passed;
+  }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
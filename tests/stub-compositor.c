@@ -0,0 +1,1238 @@
+// A headless compositor that runs waydraw through a scripted scenario.
+//
+// It advertises just the globals waydraw needs, with a single output of a fixed
+// size, and plays the part of the user by sending input to waydraw's layer
+// surface. Buffers are copied and released as soon as they are committed, and
+// frame callbacks are done right away, so waydraw is never throttled.
+//
+// Subsurfaces, which waydraw presents strokes in progress on, are blended on
+// top of the layer surface into the captured frame, as a real compositor
+// would. Their state is applied together with their parent's while they are
+// synchronized, which is all waydraw uses.
+//
+// Along the way it measures the latency from input to the commit that reflects
+// it and the number of bytes damaged per frame. At the end, the last frame is
+// compared against a golden image, except for scenarios which check the frame
+// themselves.
+//
+// Usage: stub-compositor [--update-golden] WAYDRAW SCENARIO GOLDEN_DIRECTORY
+//
+// A missing golden image is a failure, since nothing would be checked
+// otherwise. With --update-golden, the golden image is written instead.
+
+#include "control.h"
+#include "shm.h"
+
+#include <wayland-server.h>
+#include <wlr-layer-shell-unstable-v1-server-protocol.h>
+
+#include <xkbcommon/xkbcommon.h>
+
+#include <cairo.h>
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <linux/input-event-codes.h>
+
+#define OUTPUT_WIDTH 320
+#define OUTPUT_HEIGHT 240
+
+#define TIMEOUT 5000000        // for waydraw to react, in microseconds
+#define SETTLE_INTERVAL 100000 // without commits for waydraw to be idle
+
+// Tolerance per channel when comparing against golden images, to allow for
+// differences in rounding between versions of cairo.
+#define GOLDEN_TOLERANCE 2
+
+struct stub_surface
+{
+  struct stub *stub;
+  struct wl_resource *resource;
+
+  struct wl_resource *pending_buffer;
+  bool attached;
+  size_t pending_damage; // in bytes
+
+  // Copy of the buffer shown since the last commit that took effect, if any.
+  cairo_surface_t *content;
+
+  struct wl_list frame_callbacks;
+
+  struct wl_resource *layer_surface;
+  bool configured;
+
+  struct wl_list subsurfaces; // above the surface, bottom first
+
+  // Only for subsurfaces. The position and whatever is committed while
+  // synchronized are cached until the parent is committed.
+  struct wl_resource *subsurface;
+  struct stub_surface *parent;
+  struct wl_list link;
+  int32_t x, y;
+  int32_t pending_x, pending_y;
+  bool desynchronized;
+
+  bool cached;          // whether a commit is waiting for the parent
+  bool cached_attached; // whether it attached a buffer, copied to cached_content
+  cairo_surface_t *cached_content;
+  size_t cached_damage;
+};
+
+struct stub
+{
+  struct wl_display *display;
+  struct wl_event_loop *loop;
+
+  pid_t child;
+  bool exited;
+  int status;
+
+  char *keymap;
+  uint32_t control_mask;
+
+  struct wl_resource *pointer;
+  struct wl_resource *keyboard;
+  struct stub_surface *layer; // the layer surface of waydraw, once created
+
+  cairo_surface_t *capture; // content of the last buffer committed to it
+
+  uint64_t input_time; // when the oldest input not yet reflected was sent
+
+  struct
+  {
+    uint64_t frames;
+    uint64_t damage_bytes;
+    uint64_t buffer_bytes;
+
+    uint64_t latencies;
+    uint64_t latency_total;
+    uint64_t latency_min;
+    uint64_t latency_max;
+  } stats;
+};
+
+static pid_t child;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void kill_child(void)
+{
+  if(child > 0)
+    kill(child, SIGTERM);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored  "-Wincompatible-pointer-types"
+
+static void noop() {}
+
+static void destroy_resource(struct wl_client *client, struct wl_resource *resource)
+{
+  (void)client;
+  wl_resource_destroy(resource);
+}
+
+static void remove_link(struct wl_resource *resource)
+{
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void surface_attach(struct wl_client *client, struct wl_resource *resource, struct wl_resource *buffer, int32_t x, int32_t y);
+static void surface_damage_buffer(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height);
+static void surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t callback);
+static void surface_commit(struct wl_client *client, struct wl_resource *resource);
+
+static void compositor_create_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id);
+static void compositor_create_region(struct wl_client *client, struct wl_resource *resource, uint32_t id);
+
+static void subcompositor_get_subsurface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface, struct wl_resource *parent);
+
+static void subsurface_set_position(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y);
+static void subsurface_set_sync(struct wl_client *client, struct wl_resource *resource);
+static void subsurface_set_desync(struct wl_client *client, struct wl_resource *resource);
+
+static void seat_get_pointer(struct wl_client *client, struct wl_resource *resource, uint32_t id);
+static void seat_get_keyboard(struct wl_client *client, struct wl_resource *resource, uint32_t id);
+
+static void layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface, struct wl_resource *output, uint32_t layer, const char *namespace);
+
+static const struct wl_surface_interface surface_implementation = {
+  .destroy = &destroy_resource,
+  .attach = &surface_attach,
+  .damage = &noop,
+  .frame = &surface_frame,
+  .set_opaque_region = &noop,
+  .set_input_region = &noop,
+  .commit = &surface_commit,
+  .set_buffer_transform = &noop,
+  .set_buffer_scale = &noop,
+  .damage_buffer = &surface_damage_buffer,
+  .offset = &noop,
+};
+
+static const struct wl_region_interface region_implementation = {
+  .destroy = &destroy_resource,
+  .add = &noop,
+  .subtract = &noop,
+};
+
+static const struct wl_compositor_interface compositor_implementation = {
+  .create_surface = &compositor_create_surface,
+  .create_region = &compositor_create_region,
+};
+
+static const struct wl_subcompositor_interface subcompositor_implementation = {
+  .destroy = &destroy_resource,
+  .get_subsurface = &subcompositor_get_subsurface,
+};
+
+// Subsurfaces stay in the order they are created in.
+static const struct wl_subsurface_interface subsurface_implementation = {
+  .destroy = &destroy_resource,
+  .set_position = &subsurface_set_position,
+  .place_above = &noop,
+  .place_below = &noop,
+  .set_sync = &subsurface_set_sync,
+  .set_desync = &subsurface_set_desync,
+};
+
+static const struct wl_output_interface output_implementation = {
+  .release = &destroy_resource,
+};
+
+static const struct wl_seat_interface seat_implementation = {
+  .get_pointer = &seat_get_pointer,
+  .get_keyboard = &seat_get_keyboard,
+  .get_touch = &noop,
+  .release = &destroy_resource,
+};
+
+static const struct wl_pointer_interface pointer_implementation = {
+  .set_cursor = &noop,
+  .release = &destroy_resource,
+};
+
+static const struct wl_keyboard_interface keyboard_implementation = {
+  .release = &destroy_resource,
+};
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_implementation = {
+  .get_layer_surface = &layer_shell_get_layer_surface,
+  .destroy = &destroy_resource,
+};
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_implementation = {
+  .set_size = &noop,
+  .set_anchor = &noop,
+  .set_exclusive_zone = &noop,
+  .set_margin = &noop,
+  .set_keyboard_interactivity = &noop,
+  .get_popup = &noop,
+  .ack_configure = &noop,
+  .destroy = &destroy_resource,
+  .set_layer = &noop,
+};
+
+#pragma GCC diagnostic pop
+
+static cairo_surface_t *copy_buffer(struct wl_resource *buffer)
+{
+  struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(buffer);
+  if(!shm_buffer)
+  {
+    fprintf(stderr, "error: waydraw committed a buffer that is not a wl_shm buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int32_t width = wl_shm_buffer_get_width(shm_buffer);
+  int32_t height = wl_shm_buffer_get_height(shm_buffer);
+  int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+
+  cairo_surface_t *content = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  unsigned char *data = cairo_image_surface_get_data(content);
+  int content_stride = cairo_image_surface_get_stride(content);
+
+  wl_shm_buffer_begin_access(shm_buffer);
+  const unsigned char *buffer_data = wl_shm_buffer_get_data(shm_buffer);
+  for(int32_t y=0; y<height; ++y)
+    memcpy(data + (size_t)y * content_stride, buffer_data + (size_t)y * stride, (size_t)width * 4);
+  wl_shm_buffer_end_access(shm_buffer);
+
+  cairo_surface_mark_dirty(content);
+  return content;
+}
+
+static void set_content(struct stub_surface *surface, cairo_surface_t *content)
+{
+  if(surface->content)
+    cairo_surface_destroy(surface->content);
+  surface->content = content;
+}
+
+// Apply the position of the subsurfaces of surface, and what got committed to
+// them while synchronized, now that surface is committed. Return whether
+// anything changed, with the damage of the subsurfaces added to *damage.
+static bool apply_subsurfaces(struct stub_surface *surface, size_t *damage)
+{
+  bool changed = false;
+
+  struct stub_surface *subsurface;
+  wl_list_for_each(subsurface, &surface->subsurfaces, link)
+  {
+    if(subsurface->x != subsurface->pending_x || subsurface->y != subsurface->pending_y)
+    {
+      subsurface->x = subsurface->pending_x;
+      subsurface->y = subsurface->pending_y;
+      changed = true;
+    }
+
+    if(!subsurface->cached)
+      continue;
+
+    if(subsurface->cached_attached)
+    {
+      set_content(subsurface, subsurface->cached_content);
+      subsurface->cached_content = NULL;
+      subsurface->cached_attached = false;
+    }
+
+    *damage += subsurface->cached_damage;
+    subsurface->cached_damage = 0;
+    subsurface->cached = false;
+
+    apply_subsurfaces(subsurface, damage);
+    changed = true;
+  }
+
+  return changed;
+}
+
+// A surface without content is not shown, and neither are its subsurfaces.
+static void composite_surface(cairo_t *cairo, struct stub_surface *surface, int32_t x, int32_t y)
+{
+  if(!surface->content)
+    return;
+
+  cairo_set_source_surface(cairo, surface->content, x, y);
+  cairo_paint(cairo);
+
+  struct stub_surface *subsurface;
+  wl_list_for_each(subsurface, &surface->subsurfaces, link)
+    composite_surface(cairo, subsurface, x + subsurface->x, y + subsurface->y);
+}
+
+// Capture what the layer surface shows, with its subsurfaces blended on top.
+static void capture_frame(struct stub *stub)
+{
+  cairo_surface_t *content = stub->layer->content;
+  int width = cairo_image_surface_get_width(content);
+  int height = cairo_image_surface_get_height(content);
+
+  if(stub->capture && (cairo_image_surface_get_width(stub->capture) != width || cairo_image_surface_get_height(stub->capture) != height))
+  {
+    cairo_surface_destroy(stub->capture);
+    stub->capture = NULL;
+  }
+
+  if(!stub->capture)
+    stub->capture = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+
+  // The layer surface is copied as it is, rather than blended onto whatever
+  // was captured before.
+  cairo_t *cairo = cairo_create(stub->capture);
+  cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cairo, content, 0, 0);
+  cairo_paint(cairo);
+
+  cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+  struct stub_surface *subsurface;
+  wl_list_for_each(subsurface, &stub->layer->subsurfaces, link)
+    composite_surface(cairo, subsurface, subsurface->x, subsurface->y);
+  cairo_destroy(cairo);
+  cairo_surface_flush(stub->capture);
+
+  stub->stats.buffer_bytes = (uint64_t)cairo_image_surface_get_stride(content) * height;
+}
+
+static void unlink_subsurface(struct stub_surface *surface)
+{
+  if(surface->parent)
+  {
+    wl_list_remove(&surface->link);
+    surface->parent = NULL;
+  }
+
+  if(surface->cached_content)
+    cairo_surface_destroy(surface->cached_content);
+  surface->cached_content = NULL;
+  surface->cached_attached = false;
+  surface->cached = false;
+  surface->subsurface = NULL;
+}
+
+static void surface_destroy(struct wl_resource *resource)
+{
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+
+  struct wl_resource *callback, *tmp;
+  wl_resource_for_each_safe(callback, tmp, &surface->frame_callbacks)
+  {
+    wl_list_remove(wl_resource_get_link(callback));
+    wl_list_init(wl_resource_get_link(callback));
+  }
+
+  if(surface->layer_surface)
+    wl_resource_set_user_data(surface->layer_surface, NULL);
+
+  if(surface->subsurface)
+  {
+    wl_resource_set_user_data(surface->subsurface, NULL);
+    unlink_subsurface(surface);
+  }
+
+  struct stub_surface *subsurface, *tmp_subsurface;
+  wl_list_for_each_safe(subsurface, tmp_subsurface, &surface->subsurfaces, link)
+  {
+    wl_list_remove(&subsurface->link);
+    subsurface->parent = NULL;
+  }
+
+  if(surface->stub->layer == surface)
+    surface->stub->layer = NULL;
+
+  set_content(surface, NULL);
+  free(surface);
+}
+
+static void surface_attach(struct wl_client *client, struct wl_resource *resource, struct wl_resource *buffer, int32_t x, int32_t y)
+{
+  (void)client;
+  (void)x;
+  (void)y;
+
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  surface->pending_buffer = buffer;
+  surface->attached = true;
+}
+
+static void surface_damage_buffer(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+  (void)client;
+  (void)x;
+  (void)y;
+
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  surface->pending_damage += (size_t)width * height * 4;
+}
+
+static void surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+
+  struct wl_resource *callback = wl_resource_create(client, &wl_callback_interface, 1, id);
+  wl_resource_set_implementation(callback, NULL, NULL, &remove_link);
+  wl_list_insert(surface->frame_callbacks.prev, wl_resource_get_link(callback));
+}
+
+static void surface_commit(struct wl_client *client, struct wl_resource *resource)
+{
+  (void)client;
+
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  struct stub *stub = surface->stub;
+
+  // The content is copied, so there is no need to hold on to the buffer.
+  cairo_surface_t *content = NULL;
+  if(surface->attached && surface->pending_buffer)
+  {
+    content = copy_buffer(surface->pending_buffer);
+    wl_buffer_send_release(surface->pending_buffer);
+  }
+
+  if(surface->parent && !surface->desynchronized)
+  {
+    if(surface->attached)
+    {
+      if(surface->cached_content)
+        cairo_surface_destroy(surface->cached_content);
+      surface->cached_content = content;
+      surface->cached_attached = true;
+    }
+    surface->cached_damage += surface->pending_damage;
+    surface->cached = true;
+  }
+  else
+  {
+    if(surface->attached)
+      set_content(surface, content);
+
+    size_t damage = surface->pending_damage;
+    bool changed = apply_subsurfaces(surface, &damage) || surface->attached;
+
+    if(stub->layer && stub->layer->content && changed)
+    {
+      capture_frame(stub);
+
+      // Only commits of the layer surface itself are frames.
+      if(surface == stub->layer)
+      {
+        stub->stats.frames += 1;
+        stub->stats.damage_bytes += damage;
+
+        if(stub->input_time)
+        {
+          uint64_t latency = now() - stub->input_time;
+          if(stub->stats.latencies == 0 || latency < stub->stats.latency_min)
+            stub->stats.latency_min = latency;
+          if(latency > stub->stats.latency_max)
+            stub->stats.latency_max = latency;
+          stub->stats.latency_total += latency;
+          stub->stats.latencies += 1;
+          stub->input_time = 0;
+        }
+      }
+    }
+  }
+
+  // The initial commit of a layer surface asks for a configure, and so does
+  // the first commit after it got unmapped by attaching no buffer.
+  bool unmapped = surface->attached && !surface->pending_buffer;
+  if(surface->layer_surface && unmapped)
+    surface->configured = false;
+  else if(surface->layer_surface && !surface->configured)
+  {
+    zwlr_layer_surface_v1_send_configure(surface->layer_surface, wl_display_next_serial(stub->display), OUTPUT_WIDTH, OUTPUT_HEIGHT);
+    surface->configured = true;
+  }
+
+  uint32_t time = now() / 1000;
+  struct wl_resource *callback, *tmp;
+  wl_resource_for_each_safe(callback, tmp, &surface->frame_callbacks)
+  {
+    wl_callback_send_done(callback, time);
+    wl_resource_destroy(callback);
+  }
+
+  surface->pending_buffer = NULL;
+  surface->attached = false;
+  surface->pending_damage = 0;
+}
+
+static void compositor_create_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+  struct stub_surface *surface = calloc(1, sizeof *surface);
+  surface->stub = wl_resource_get_user_data(resource);
+  wl_list_init(&surface->frame_callbacks);
+  wl_list_init(&surface->subsurfaces);
+
+  surface->resource = wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(surface->resource, &surface_implementation, surface, &surface_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+  struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+  wl_resource_set_implementation(region, &region_implementation, wl_resource_get_user_data(resource), NULL);
+}
+
+static void bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct wl_resource *resource = wl_resource_create(client, &wl_compositor_interface, version, id);
+  wl_resource_set_implementation(resource, &compositor_implementation, data, NULL);
+}
+
+static void subsurface_destroy(struct wl_resource *resource)
+{
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  if(surface)
+    unlink_subsurface(surface);
+}
+
+static void subcompositor_get_subsurface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface_resource, struct wl_resource *parent_resource)
+{
+  (void)resource;
+
+  struct stub_surface *surface = wl_resource_get_user_data(surface_resource);
+  struct stub_surface *parent = wl_resource_get_user_data(parent_resource);
+
+  surface->subsurface = wl_resource_create(client, &wl_subsurface_interface, 1, id);
+  wl_resource_set_implementation(surface->subsurface, &subsurface_implementation, surface, &subsurface_destroy);
+
+  // New subsurfaces go on top.
+  surface->parent = parent;
+  wl_list_insert(parent->subsurfaces.prev, &surface->link);
+}
+
+static void subsurface_set_position(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y)
+{
+  (void)client;
+
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  if(!surface)
+    return;
+
+  surface->pending_x = x;
+  surface->pending_y = y;
+}
+
+static void subsurface_set_sync(struct wl_client *client, struct wl_resource *resource)
+{
+  (void)client;
+
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  if(surface)
+    surface->desynchronized = false;
+}
+
+// Whatever is cached is left for the next commit of the parent to apply,
+// rather than applied right away. waydraw never desynchronizes subsurfaces.
+static void subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
+{
+  (void)client;
+
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  if(surface)
+    surface->desynchronized = true;
+}
+
+static void bind_subcompositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct wl_resource *resource = wl_resource_create(client, &wl_subcompositor_interface, version, id);
+  wl_resource_set_implementation(resource, &subcompositor_implementation, data, NULL);
+}
+
+static void bind_output(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct wl_resource *resource = wl_resource_create(client, &wl_output_interface, version, id);
+  wl_resource_set_implementation(resource, &output_implementation, data, NULL);
+
+  wl_output_send_geometry(resource, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN, "waydraw", "stub", WL_OUTPUT_TRANSFORM_NORMAL);
+  wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT, OUTPUT_WIDTH, OUTPUT_HEIGHT, 60000);
+  if(version >= WL_OUTPUT_SCALE_SINCE_VERSION)
+    wl_output_send_scale(resource, 1);
+  if(version >= WL_OUTPUT_NAME_SINCE_VERSION)
+    wl_output_send_name(resource, "STUB-1");
+  if(version >= WL_OUTPUT_DONE_SINCE_VERSION)
+    wl_output_send_done(resource);
+}
+
+static void pointer_destroy(struct wl_resource *resource)
+{
+  struct stub *stub = wl_resource_get_user_data(resource);
+  if(stub->pointer == resource)
+    stub->pointer = NULL;
+}
+
+static void keyboard_destroy(struct wl_resource *resource)
+{
+  struct stub *stub = wl_resource_get_user_data(resource);
+  if(stub->keyboard == resource)
+    stub->keyboard = NULL;
+}
+
+static void seat_get_pointer(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+  struct stub *stub = wl_resource_get_user_data(resource);
+  stub->pointer = wl_resource_create(client, &wl_pointer_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(stub->pointer, &pointer_implementation, stub, &pointer_destroy);
+}
+
+static void seat_get_keyboard(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+  struct stub *stub = wl_resource_get_user_data(resource);
+  stub->keyboard = wl_resource_create(client, &wl_keyboard_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(stub->keyboard, &keyboard_implementation, stub, &keyboard_destroy);
+
+  size_t size = strlen(stub->keymap) + 1;
+  int fd = allocate_shm_file(size);
+  if(fd < 0 || pwrite(fd, stub->keymap, size, 0) != (ssize_t)size)
+  {
+    fprintf(stderr, "error: failed to write keymap file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  wl_keyboard_send_keymap(stub->keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, size);
+  close(fd);
+}
+
+static void bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface, version, id);
+  wl_resource_set_implementation(resource, &seat_implementation, data, NULL);
+
+  wl_seat_send_capabilities(resource, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD);
+  if(version >= WL_SEAT_NAME_SINCE_VERSION)
+    wl_seat_send_name(resource, "seat0");
+}
+
+static void layer_surface_destroy(struct wl_resource *resource)
+{
+  struct stub_surface *surface = wl_resource_get_user_data(resource);
+  if(surface)
+    surface->layer_surface = NULL;
+}
+
+static void layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface_resource, struct wl_resource *output, uint32_t layer, const char *namespace)
+{
+  (void)output;
+  (void)layer;
+  (void)namespace;
+
+  struct stub_surface *surface = wl_resource_get_user_data(surface_resource);
+  surface->layer_surface = wl_resource_create(client, &zwlr_layer_surface_v1_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(surface->layer_surface, &layer_surface_implementation, surface, &layer_surface_destroy);
+  surface->stub->layer = surface;
+}
+
+static void bind_layer_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+  struct wl_resource *resource = wl_resource_create(client, &zwlr_layer_shell_v1_interface, version, id);
+  wl_resource_set_implementation(resource, &layer_shell_implementation, data, NULL);
+}
+
+// Dispatch requests from waydraw for up to timeout milliseconds.
+static void dispatch(struct stub *stub, int timeout)
+{
+  wl_display_flush_clients(stub->display);
+  wl_event_loop_dispatch(stub->loop, timeout);
+
+  if(!stub->exited && waitpid(stub->child, &stub->status, WNOHANG) == stub->child)
+  {
+    stub->exited = true;
+    child = 0;
+  }
+}
+
+static void check_running(struct stub *stub, const char *what)
+{
+  if(stub->exited)
+  {
+    fprintf(stderr, "error: waydraw exited while %s\n", what);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void wait_for_map(struct stub *stub)
+{
+  uint64_t deadline = now() + TIMEOUT;
+  while(!stub->capture || !stub->pointer || !stub->keyboard)
+  {
+    check_running(stub, "waiting for its surface to be mapped");
+    if(now() > deadline)
+    {
+      fprintf(stderr, "error: timed out waiting for waydraw to map its surface\n");
+      exit(EXIT_FAILURE);
+    }
+    dispatch(stub, 10);
+  }
+}
+
+static void wait_for_frame(struct stub *stub)
+{
+  uint64_t frames = stub->stats.frames;
+  uint64_t deadline = now() + TIMEOUT;
+  while(stub->stats.frames == frames)
+  {
+    check_running(stub, "waiting for a frame");
+    if(now() > deadline)
+    {
+      fprintf(stderr, "error: timed out waiting for waydraw to commit a frame\n");
+      exit(EXIT_FAILURE);
+    }
+    dispatch(stub, 10);
+  }
+}
+
+// Wait until waydraw stops committing new frames.
+static void settle(struct stub *stub)
+{
+  uint64_t frames = stub->stats.frames;
+  uint64_t idle = now() + SETTLE_INTERVAL;
+  while(now() < idle)
+  {
+    check_running(stub, "settling");
+    dispatch(stub, 10);
+    if(stub->stats.frames != frames)
+    {
+      frames = stub->stats.frames;
+      idle = now() + SETTLE_INTERVAL;
+    }
+  }
+}
+
+static void send_pointer_frame(struct stub *stub)
+{
+  if(wl_resource_get_version(stub->pointer) >= WL_POINTER_FRAME_SINCE_VERSION)
+    wl_pointer_send_frame(stub->pointer);
+  wl_display_flush_clients(stub->display);
+}
+
+static void send_modifiers(struct stub *stub, uint32_t depressed)
+{
+  wl_keyboard_send_modifiers(stub->keyboard, wl_display_next_serial(stub->display), depressed, 0, 0, 0);
+}
+
+static void press_key(struct stub *stub, uint32_t key)
+{
+  uint32_t time = now() / 1000;
+  wl_keyboard_send_key(stub->keyboard, wl_display_next_serial(stub->display), time, key, WL_KEYBOARD_KEY_STATE_PRESSED);
+  wl_keyboard_send_key(stub->keyboard, wl_display_next_serial(stub->display), time, key, WL_KEYBOARD_KEY_STATE_RELEASED);
+  wl_display_flush_clients(stub->display);
+}
+
+static void press_control_key(struct stub *stub, uint32_t key)
+{
+  send_modifiers(stub, stub->control_mask);
+  press_key(stub, key);
+  send_modifiers(stub, 0);
+}
+
+static void move_to(struct stub *stub, double x, double y)
+{
+  wl_pointer_send_motion(stub->pointer, now() / 1000, wl_fixed_from_double(x), wl_fixed_from_double(y));
+  send_pointer_frame(stub);
+}
+
+static void send_button(struct stub *stub, uint32_t state)
+{
+  wl_pointer_send_button(stub->pointer, wl_display_next_serial(stub->display), now() / 1000, BTN_LEFT, state);
+  send_pointer_frame(stub);
+}
+
+static void begin_stroke(struct stub *stub, double x, double y)
+{
+  move_to(stub, x, y);
+  send_button(stub, WL_POINTER_BUTTON_STATE_PRESSED);
+  settle(stub);
+}
+
+// Move the pointer while drawing, which waydraw should reflect in a frame.
+static void draw_to(struct stub *stub, double x, double y)
+{
+  stub->input_time = now();
+  move_to(stub, x, y);
+  wait_for_frame(stub);
+}
+
+static void end_stroke(struct stub *stub)
+{
+  send_button(stub, WL_POINTER_BUTTON_STATE_RELEASED);
+  settle(stub);
+}
+
+// Send a command to waydraw through its control socket, and check how it is
+// answered.
+static void send_control(struct stub *stub, const struct control_message *message, int32_t expected)
+{
+  char *path = control_path();
+  int status = send_command(path, message, NULL, 0, NULL);
+  if(status < 0)
+  {
+    fprintf(stderr, "error: failed to send command %c to control socket at %s: %s\n", message->command, path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if(status != expected)
+  {
+    fprintf(stderr, "error: waydraw answered command %c with status %d instead of %d\n", message->command, status, expected);
+    exit(EXIT_FAILURE);
+  }
+
+  free(path);
+  dispatch(stub, 0);
+  check_running(stub, "handling a command");
+}
+
+static void send_control_command(struct stub *stub, enum control_command command)
+{
+  send_control(stub, &(struct control_message){ .command = command }, CONTROL_STATUS_OK);
+}
+
+static unsigned long count_mismatches(cairo_surface_t *expected, cairo_surface_t *actual)
+{
+  const unsigned char *expected_data = cairo_image_surface_get_data(expected);
+  const unsigned char *actual_data = cairo_image_surface_get_data(actual);
+  int expected_stride = cairo_image_surface_get_stride(expected);
+  int actual_stride = cairo_image_surface_get_stride(actual);
+  int width = cairo_image_surface_get_width(actual);
+  int height = cairo_image_surface_get_height(actual);
+
+  unsigned long mismatches = 0;
+  for(int y=0; y<height; ++y)
+    for(int x=0; x<width * 4; ++x)
+      if(abs(expected_data[y * expected_stride + x] - actual_data[y * actual_stride + x]) > GOLDEN_TOLERANCE)
+      {
+        mismatches += 1;
+        x += 3 - x % 4; // count each pixel only once
+      }
+
+  return mismatches;
+}
+
+static void draw_wave(struct stub *stub, double y, double amplitude)
+{
+  begin_stroke(stub, 40, y);
+  for(int i=1; i<=40; ++i)
+    draw_to(stub, 40 + i * 6, y + amplitude * sin(i * 0.3));
+  end_stroke(stub);
+}
+
+static void scenario_brush(struct stub *stub)
+{
+  press_key(stub, KEY_B);
+  draw_wave(stub, 120, 60);
+}
+
+static void scenario_line(struct stub *stub)
+{
+  press_key(stub, KEY_L);
+  begin_stroke(stub, 40, 200);
+  for(int i=1; i<=20; ++i)
+    draw_to(stub, 40 + i * 12, 200 - i * 8);
+  end_stroke(stub);
+}
+
+static void scenario_circle(struct stub *stub)
+{
+  press_key(stub, KEY_C);
+  begin_stroke(stub, 160, 120);
+  for(int i=1; i<=20; ++i)
+    draw_to(stub, 160 + i * 4, 120);
+  end_stroke(stub);
+}
+
+static void scenario_rectangle(struct stub *stub)
+{
+  press_key(stub, KEY_R);
+  begin_stroke(stub, 60, 40);
+  for(int i=1; i<=20; ++i)
+    draw_to(stub, 60 + i * 10, 40 + i * 8);
+  end_stroke(stub);
+}
+
+// Two strokes in different colors, the second of which is undone.
+static void scenario_undo(struct stub *stub)
+{
+  press_key(stub, KEY_B);
+  draw_wave(stub, 80, 30);
+
+  press_key(stub, KEY_TAB);
+  draw_wave(stub, 160, 30);
+
+  press_control_key(stub, KEY_Z);
+  settle(stub);
+}
+
+// Changes to the history through the control socket while detached, which
+// must not show until resumed, and must then show as they would have anyway.
+// A weight too large for a cursor to be allocated is rejected along the way.
+static void scenario_detach(struct stub *stub)
+{
+  press_key(stub, KEY_B);
+  draw_wave(stub, 120, 60);
+
+  cairo_surface_t *expected = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, OUTPUT_WIDTH, OUTPUT_HEIGHT);
+  cairo_t *cairo = cairo_create(expected);
+  cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cairo, stub->capture, 0, 0);
+  cairo_paint(cairo);
+  cairo_destroy(cairo);
+
+  send_control_command(stub, CONTROL_COMMAND_DETACH);
+  settle(stub);
+
+  uint64_t frames = stub->stats.frames;
+  send_control_command(stub, CONTROL_COMMAND_UNDO);
+  send_control_command(stub, CONTROL_COMMAND_REDO);
+  send_control_command(stub, CONTROL_COMMAND_CLEAR);
+  send_control_command(stub, CONTROL_COMMAND_UNDO);
+  send_control(stub, &(struct control_message){ .command = CONTROL_COMMAND_WEIGHT, .weight = 1e30 }, CONTROL_STATUS_INVALID);
+  settle(stub);
+
+  if(stub->stats.frames != frames)
+  {
+    fprintf(stderr, "error: waydraw committed a frame while detached\n");
+    exit(EXIT_FAILURE);
+  }
+
+  send_control_command(stub, CONTROL_COMMAND_RESUME);
+  wait_for_frame(stub);
+  settle(stub);
+
+  unsigned long mismatches = count_mismatches(expected, stub->capture);
+  cairo_surface_destroy(expected);
+  if(mismatches)
+  {
+    fprintf(stderr, "error: %lu pixels differ from the frame before detaching\n", mismatches);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static const struct
+{
+  const char *name;
+  void (*run)(struct stub *stub);
+  bool golden; // whether the last frame is compared against a golden image
+} SCENARIOS[] = {
+  { "brush", &scenario_brush, true },
+  { "line", &scenario_line, true },
+  { "circle", &scenario_circle, true },
+  { "rectangle", &scenario_rectangle, true },
+  { "undo", &scenario_undo, true },
+  { "detach", &scenario_detach, false },
+};
+
+#define SCENARIO_COUNT (sizeof SCENARIOS / sizeof SCENARIOS[0])
+
+static void init_keymap(struct stub *stub)
+{
+  struct xkb_context *xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  struct xkb_keymap *xkb_keymap = xkb_context ? xkb_keymap_new_from_names(xkb_context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS) : NULL;
+  if(!xkb_keymap)
+  {
+    fprintf(stderr, "error: failed to create the default keymap\n");
+    exit(EXIT_FAILURE);
+  }
+
+  stub->keymap = xkb_keymap_get_as_string(xkb_keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+  stub->control_mask = 1u << xkb_keymap_mod_get_index(xkb_keymap, XKB_MOD_NAME_CTRL);
+
+  xkb_keymap_unref(xkb_keymap);
+  xkb_context_unref(xkb_context);
+}
+
+static void spawn_waydraw(struct stub *stub, const char *waydraw, const char *socket)
+{
+  stub->child = fork();
+  if(stub->child < 0)
+  {
+    fprintf(stderr, "error: failed to fork: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if(stub->child == 0)
+  {
+    setenv("WAYLAND_DISPLAY", socket, 1);
+    unsetenv("WAYLAND_SOCKET");
+    unsetenv("WAYDRAW_SESSION");
+    unsetenv("WAYDRAW_RECORD");
+    execl(waydraw, waydraw, (char *)NULL);
+    fprintf(stderr, "error: failed to execute %s: %s\n", waydraw, strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  child = stub->child;
+  atexit(&kill_child);
+}
+
+static void print_stats(struct stub *stub, const char *scenario)
+{
+  printf("stats: %s: %lu frames, %lu bytes damaged per frame out of %lu bytes per buffer\n",
+      scenario,
+      (unsigned long)stub->stats.frames,
+      (unsigned long)(stub->stats.frames ? stub->stats.damage_bytes / stub->stats.frames : 0),
+      (unsigned long)stub->stats.buffer_bytes);
+
+  if(stub->stats.latencies)
+    printf("stats: %s: input to commit latency over %lu inputs: min %luus, mean %luus, max %luus\n",
+        scenario,
+        (unsigned long)stub->stats.latencies,
+        (unsigned long)stub->stats.latency_min,
+        (unsigned long)(stub->stats.latency_total / stub->stats.latencies),
+        (unsigned long)stub->stats.latency_max);
+}
+
+static int check_golden(struct stub *stub, const char *directory, const char *path, bool update)
+{
+  if(update)
+  {
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "error: failed to create golden directory %s: %s\n", directory, strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    cairo_status_t status = cairo_surface_write_to_png(stub->capture, path);
+    if(status != CAIRO_STATUS_SUCCESS)
+    {
+      fprintf(stderr, "error: failed to write golden image %s: %s\n", path, cairo_status_to_string(status));
+      return EXIT_FAILURE;
+    }
+    printf("updated golden image %s\n", path);
+    return EXIT_SUCCESS;
+  }
+
+  cairo_surface_t *golden = cairo_image_surface_create_from_png(path);
+  cairo_status_t status = cairo_surface_status(golden);
+  if(status == CAIRO_STATUS_FILE_NOT_FOUND)
+  {
+    fprintf(stderr, "error: no golden image %s\n", path);
+    fprintf(stderr, "note: run with --update-golden to create it\n");
+    cairo_surface_destroy(golden);
+    return EXIT_FAILURE;
+  }
+
+  if(status != CAIRO_STATUS_SUCCESS)
+  {
+    fprintf(stderr, "error: failed to read golden image %s: %s\n", path, cairo_status_to_string(status));
+    cairo_surface_destroy(golden);
+    return EXIT_FAILURE;
+  }
+
+  int width = cairo_image_surface_get_width(stub->capture);
+  int height = cairo_image_surface_get_height(stub->capture);
+  if(cairo_image_surface_get_format(golden) != CAIRO_FORMAT_ARGB32 ||
+      cairo_image_surface_get_width(golden) != width ||
+      cairo_image_surface_get_height(golden) != height)
+  {
+    fprintf(stderr, "error: golden image %s does not match the output in size or format\n", path);
+    cairo_surface_destroy(golden);
+    return EXIT_FAILURE;
+  }
+
+  unsigned long mismatches = count_mismatches(golden, stub->capture);
+  cairo_surface_destroy(golden);
+
+  if(mismatches)
+  {
+    char actual_path[4096];
+    snprintf(actual_path, sizeof actual_path, "%s.actual.png", path);
+    cairo_surface_write_to_png(stub->capture, actual_path);
+
+    fprintf(stderr, "error: %lu pixels differ from golden image %s\n", mismatches, path);
+    fprintf(stderr, "note: the actual output is written to %s\n", actual_path);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+  bool update_golden = false;
+  if(argc > 1 && strcmp(argv[1], "--update-golden") == 0)
+  {
+    update_golden = true;
+    argc -= 1;
+    argv += 1;
+  }
+
+  if(argc != 4)
+  {
+    fprintf(stderr, "usage: stub-compositor [--update-golden] WAYDRAW SCENARIO GOLDEN_DIRECTORY\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const char *waydraw = argv[1];
+  const char *scenario = argv[2];
+  const char *golden_directory = argv[3];
+
+  void (*run)(struct stub *stub) = NULL;
+  bool golden = false;
+  for(size_t i=0; i<SCENARIO_COUNT; ++i)
+    if(strcmp(SCENARIOS[i].name, scenario) == 0)
+    {
+      run = SCENARIOS[i].run;
+      golden = SCENARIOS[i].golden;
+    }
+
+  if(!run)
+  {
+    fprintf(stderr, "error: unknown scenario %s\n", scenario);
+    exit(EXIT_FAILURE);
+  }
+
+  // Keep the socket, and the control socket of waydraw, away from any real
+  // compositor and any real instance of waydraw.
+  char runtime_directory[] = "/tmp/waydraw-stub-XXXXXX";
+  if(!mkdtemp(runtime_directory))
+  {
+    fprintf(stderr, "error: failed to create runtime directory: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  setenv("XDG_RUNTIME_DIR", runtime_directory, 1);
+
+  struct stub stub = {0};
+  init_keymap(&stub);
+
+  stub.display = wl_display_create();
+  stub.loop = wl_display_get_event_loop(stub.display);
+
+  const char *socket = wl_display_add_socket_auto(stub.display);
+  if(!socket)
+  {
+    fprintf(stderr, "error: failed to add wayland socket: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  // For the path of the control socket of waydraw.
+  setenv("WAYLAND_DISPLAY", socket, 1);
+
+  // In the order waydraw expects them.
+  wl_global_create(stub.display, &wl_compositor_interface, 5, &stub, &bind_compositor);
+  wl_global_create(stub.display, &wl_subcompositor_interface, 1, &stub, &bind_subcompositor);
+  wl_display_init_shm(stub.display);
+  wl_global_create(stub.display, &zwlr_layer_shell_v1_interface, 4, &stub, &bind_layer_shell);
+  wl_global_create(stub.display, &wl_output_interface, 4, &stub, &bind_output);
+  wl_global_create(stub.display, &wl_seat_interface, 5, &stub, &bind_seat);
+
+  spawn_waydraw(&stub, waydraw, socket);
+
+  wait_for_map(&stub);
+
+  wl_pointer_send_enter(stub.pointer, wl_display_next_serial(stub.display), stub.layer->resource, wl_fixed_from_int(0), wl_fixed_from_int(0));
+  send_pointer_frame(&stub);
+
+  struct wl_array keys;
+  wl_array_init(&keys);
+  wl_keyboard_send_enter(stub.keyboard, wl_display_next_serial(stub.display), stub.layer->resource, &keys);
+  send_modifiers(&stub, 0);
+
+  run(&stub);
+  print_stats(&stub, scenario);
+
+  int status = EXIT_SUCCESS;
+  if(golden)
+  {
+    char golden_path[4096];
+    snprintf(golden_path, sizeof golden_path, "%s/%s.png", golden_directory, scenario);
+    status = check_golden(&stub, golden_directory, golden_path, update_golden);
+  }
+
+  press_key(&stub, KEY_Q);
+  uint64_t deadline = now() + TIMEOUT;
+  while(!stub.exited && now() < deadline)
+    dispatch(&stub, 10);
+
+  if(!stub.exited)
+  {
+    fprintf(stderr, "error: waydraw did not quit\n");
+    status = EXIT_FAILURE;
+  }
+  else if(!WIFEXITED(stub.status) || WEXITSTATUS(stub.status) != EXIT_SUCCESS)
+  {
+    fprintf(stderr, "error: waydraw did not exit cleanly\n");
+    status = EXIT_FAILURE;
+  }
+
+  wl_display_destroy(stub.display);
+  rmdir(runtime_directory);
+  return status;
+}
@@ -0,0 +1,225 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#define TRACE_MAGIC "WDTRACE\001"
+
+// Flush at least this often while recording, in microseconds, so that a crash
+// loses at most that much of the trace.
+#define TRACE_FLUSH_INTERVAL 1000000
+
+// Arguments of each event: u for unsigned, i for signed and b for bytes.
+static const char *const SIGNATURES[TRACE_EVENT_COUNT] = {
+  [TRACE_EVENT_OUTPUT]            = "uu",
+  [TRACE_EVENT_OUTPUT_NAME]       = "ub",
+  [TRACE_EVENT_SEAT]              = "uu",
+  [TRACE_EVENT_SEAT_CAPABILITIES] = "uu",
+  [TRACE_EVENT_CONFIGURE]         = "uuu",
+  [TRACE_EVENT_KEYMAP]            = "uub",
+  [TRACE_EVENT_KEYBOARD_ENTER]    = "uu",
+  [TRACE_EVENT_KEYBOARD_LEAVE]    = "uu",
+  [TRACE_EVENT_KEY]               = "uuu",
+  [TRACE_EVENT_MODIFIERS]         = "uuuuu",
+  [TRACE_EVENT_POINTER_ENTER]     = "uuii",
+  [TRACE_EVENT_POINTER_LEAVE]     = "uu",
+  [TRACE_EVENT_POINTER_MOTION]    = "uii",
+  [TRACE_EVENT_POINTER_BUTTON]    = "uuu",
+  [TRACE_EVENT_POINTER_AXIS]      = "uui",
+  [TRACE_EVENT_POINTER_FRAME]     = "u",
+};
+
+struct trace
+{
+  char *path;
+  FILE *file;
+
+  uint64_t start;      // when recording started, in microseconds
+  uint64_t timestamp;  // of the last event, in microseconds since start
+  uint64_t flushed;    // when the trace was last flushed
+};
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct trace *trace_new(const char *path, const char *mode)
+{
+  struct trace *trace = calloc(1, sizeof *trace);
+  trace->path = strdup(path);
+  trace->file = fopen(path, mode);
+  if(!trace->file)
+  {
+    fprintf(stderr, "error: failed to open trace file %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return trace;
+}
+
+struct trace *trace_create(const char *path)
+{
+  struct trace *trace = trace_new(path, "wb");
+  trace->start = now();
+
+  if(fwrite(TRACE_MAGIC, 1, 8, trace->file) != 8)
+  {
+    fprintf(stderr, "error: failed to write trace file %s: %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return trace;
+}
+
+struct trace *trace_open(const char *path)
+{
+  struct trace *trace = trace_new(path, "rb");
+
+  char magic[8];
+  if(fread(magic, 1, sizeof magic, trace->file) != sizeof magic || memcmp(magic, TRACE_MAGIC, sizeof magic) != 0)
+  {
+    fprintf(stderr, "error: %s is not a trace file\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return trace;
+}
+
+void trace_close(struct trace *trace)
+{
+  fclose(trace->file);
+  free(trace->path);
+  free(trace);
+}
+
+static void write_varint(FILE *file, uint64_t value)
+{
+  while(value >= 0x80)
+  {
+    fputc((value & 0x7f) | 0x80, file);
+    value >>= 7;
+  }
+  fputc(value, file);
+}
+
+void trace_record(struct trace *trace, enum trace_event_type type, ...)
+{
+  if(!trace)
+    return;
+
+  uint64_t timestamp = now() - trace->start;
+  fputc(type, trace->file);
+  write_varint(trace->file, timestamp - trace->timestamp);
+  trace->timestamp = timestamp;
+
+  va_list args;
+  va_start(args, type);
+  for(const char *p = SIGNATURES[type]; *p; ++p)
+    switch(*p)
+    {
+    case 'u':
+      write_varint(trace->file, va_arg(args, uint32_t));
+      break;
+    case 'i':
+      {
+        int32_t value = va_arg(args, int32_t);
+        write_varint(trace->file, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+      }
+      break;
+    case 'b':
+      {
+        const void *data = va_arg(args, const void *);
+        size_t size = va_arg(args, size_t);
+        write_varint(trace->file, size);
+        fwrite(data, 1, size, trace->file);
+      }
+      break;
+    }
+  va_end(args);
+
+  if(ferror(trace->file))
+  {
+    fprintf(stderr, "error: failed to write trace file %s: %s\n", trace->path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if(timestamp - trace->flushed >= TRACE_FLUSH_INTERVAL)
+  {
+    fflush(trace->file);
+    trace->flushed = timestamp;
+  }
+}
+
+static bool read_varint(FILE *file, uint64_t *value)
+{
+  *value = 0;
+  for(unsigned shift = 0; shift < 64; shift += 7)
+  {
+    int c = fgetc(file);
+    if(c == EOF)
+      return false;
+
+    *value |= (uint64_t)(c & 0x7f) << shift;
+    if(!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool trace_read(struct trace *trace, struct trace_event *event)
+{
+  int type = fgetc(trace->file);
+  if(type == EOF)
+    return false;
+
+  if(type <= 0 || type >= TRACE_EVENT_COUNT)
+    goto corrupted;
+
+  uint64_t delta;
+  if(!read_varint(trace->file, &delta))
+    goto corrupted;
+
+  trace->timestamp += delta;
+  event->type = type;
+  event->timestamp = trace->timestamp;
+  event->data.size = 0;
+
+  unsigned i = 0;
+  for(const char *p = SIGNATURES[type]; *p; ++p)
+  {
+    uint64_t value;
+    if(!read_varint(trace->file, &value))
+      goto corrupted;
+
+    switch(*p)
+    {
+    case 'u':
+      event->args[i++] = value;
+      break;
+    case 'i':
+      event->args[i++] = (uint32_t)(value >> 1) ^ -(uint32_t)(value & 1);
+      break;
+    case 'b':
+      if(value > (1 << 24))
+        goto corrupted;
+
+      // Keep it NUL terminated for convenience.
+      wl_array_add(&event->data, value + 1);
+      event->data.size = value;
+      if(fread(event->data.data, 1, value, trace->file) != value)
+        goto corrupted;
+      ((char *)event->data.data)[value] = '\0';
+      break;
+    }
+  }
+  return true;
+
+corrupted:
+  fprintf(stderr, "error: trace file %s is corrupted\n", trace->path);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,75 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// An input trace records the events from the compositor that drive waydraw,
+// so that a session can be replayed later on without any compositor.
+//
+// A trace starts with a header, followed by events. Each event starts with its
+// type and the time since the previous event in microseconds, followed by its
+// arguments as listed below. Numbers are encoded as LEB128 varints, with signed
+// ones zigzag encoded first. Outputs and seats are referred to by the order in
+// which they were announced, starting from 0.
+
+#include <wayland-util.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum trace_event_type
+{
+  TRACE_EVENT_OUTPUT = 1,         // output, version
+  TRACE_EVENT_OUTPUT_NAME,        // output, name
+  TRACE_EVENT_SEAT,               // seat, version
+  TRACE_EVENT_SEAT_CAPABILITIES,  // seat, capabilities
+  TRACE_EVENT_CONFIGURE,          // output, width, height
+  TRACE_EVENT_KEYMAP,             // seat, format, keymap
+  TRACE_EVENT_KEYBOARD_ENTER,     // seat, output
+  TRACE_EVENT_KEYBOARD_LEAVE,     // seat, output
+  TRACE_EVENT_KEY,                // seat, key, state
+  TRACE_EVENT_MODIFIERS,          // seat, depressed, latched, locked, group
+  TRACE_EVENT_POINTER_ENTER,      // seat, output, x, y
+  TRACE_EVENT_POINTER_LEAVE,      // seat, output
+  TRACE_EVENT_POINTER_MOTION,     // seat, x, y
+  TRACE_EVENT_POINTER_BUTTON,     // seat, button, state
+  TRACE_EVENT_POINTER_AXIS,       // seat, axis, value
+  TRACE_EVENT_POINTER_FRAME,      // seat
+
+  TRACE_EVENT_COUNT,
+};
+
+#define TRACE_MAX_ARGS 5
+
+struct trace_event
+{
+  enum trace_event_type type;
+  uint64_t timestamp; // microseconds since the start of the trace
+
+  // Arguments in the order listed above. Signed arguments, which are all
+  // wl_fixed_t, are stored as is. The name or the keymap, if any, go to data
+  // instead.
+  uint32_t args[TRACE_MAX_ARGS];
+  struct wl_array data;
+};
+
+struct trace;
+
+// Create a trace file to record into. Exit on failure.
+struct trace *trace_create(const char *path);
+
+// Open a trace file to read from. Exit on failure.
+struct trace *trace_open(const char *path);
+
+void trace_close(struct trace *trace);
+
+// Record an event with its arguments, which are uint32_t or wl_fixed_t, except
+// for a name or a keymap which is given as a pointer and a size_t. Does
+// nothing if trace is NULL.
+void trace_record(struct trace *trace, enum trace_event_type type, ...);
+
+// Read the next event into event, which must have been zero initialized
+// before the first call. Return false at the end of the trace. Exit if the
+// trace is corrupted.
+bool trace_read(struct trace *trace, struct trace_event *event);
+
+#endif // TRACE_H
@@ -0,0 +1,111 @@
+// Send a command to the running instance of waydraw through its control socket.
+//
+// This only links against libc, statically, so that running it from a hotkey
+// costs little more than the round trip to waydraw itself.
+
+#include "control.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Enough for the statistics of a dozen outputs.
+#define REPLY_SIZE (64 * 1024)
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s COMMAND\n", program);
+  fprintf(stderr, "note: commands are wake, hibernate, detach, clear, undo, redo, color R G B [A], weight WEIGHT and stats\n");
+  exit(EXIT_FAILURE);
+}
+
+static double parse_number(const char *program, const char *string)
+{
+  char *end;
+  double number = strtod(string, &end);
+  if(end == string || *end != '\0' || !isfinite(number))
+    usage(program);
+  return number;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2)
+    usage(argv[0]);
+
+  static const struct
+  {
+    const char *name;
+    enum control_command command;
+    int min_args, max_args;
+  } commands[] = {
+    { "wake",      CONTROL_COMMAND_RESUME,    0, 0 },
+    { "hibernate", CONTROL_COMMAND_HIBERNATE, 0, 0 },
+    { "detach",    CONTROL_COMMAND_DETACH,    0, 0 },
+    { "clear",     CONTROL_COMMAND_CLEAR,     0, 0 },
+    { "undo",      CONTROL_COMMAND_UNDO,      0, 0 },
+    { "redo",      CONTROL_COMMAND_REDO,      0, 0 },
+    { "color",     CONTROL_COMMAND_COLOR,     3, 4 },
+    { "weight",    CONTROL_COMMAND_WEIGHT,    1, 1 },
+    { "stats",     CONTROL_COMMAND_STATS,     0, 0 },
+  };
+
+  struct control_message message = {0};
+  int args = argc - 2;
+
+  size_t i;
+  for(i=0; i<sizeof commands / sizeof commands[0]; ++i)
+    if(strcmp(argv[1], commands[i].name) == 0)
+      break;
+
+  if(i == sizeof commands / sizeof commands[0] || args < commands[i].min_args || args > commands[i].max_args)
+    usage(argv[0]);
+
+  message.command = commands[i].command;
+  switch(message.command)
+  {
+  case CONTROL_COMMAND_COLOR:
+    message.color[3] = 1.0;
+    for(int j=0; j<args; ++j)
+      message.color[j] = parse_number(argv[0], argv[2 + j]);
+    break;
+  case CONTROL_COMMAND_WEIGHT:
+    message.weight = parse_number(argv[0], argv[2]);
+    if(message.weight > CONTROL_MAX_WEIGHT)
+    {
+      fprintf(stderr, "error: weight %s is too large\n", argv[2]);
+      fprintf(stderr, "note: the weight can be at most %g\n", CONTROL_MAX_WEIGHT);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  default:
+    break;
+  }
+
+  char *path = control_path();
+  char *text = malloc(REPLY_SIZE);
+  size_t size = 0;
+
+  int status = send_command(path, &message, text, REPLY_SIZE, &size);
+  if(status < 0)
+  {
+    fprintf(stderr, "error: failed to send command to control socket at %s: %s\n", path, strerror(errno));
+    if(errno == ENOENT || errno == ECONNREFUSED)
+      fprintf(stderr, "note: waydraw does not seem to be running\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(status != CONTROL_STATUS_OK)
+  {
+    fprintf(stderr, "error: waydraw rejected command %s\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  fwrite(text, 1, size, stdout);
+
+  free(text);
+  free(path);
+  return 0;
+}
@@ -1,7 +1,16 @@
-#include "cairo-wayland-utils.h"
+#include "blend.h"
 #include "cairo.h"
-#include "hibernate.h"
+#include "command.h"
+#include "control.h"
+#include "cursor.h"
+#include "filter.h"
+#include "layer.h"
+#include "pool.h"
+#include "session.h"
 #include "snapshot.h"
+#include "stats.h"
+#include "swapchain.h"
+#include "trace.h"
 
 #include "cairo-utils.h"
 
@@ -12,6 +21,7 @@
 #include <xkbcommon/xkbcommon.h>
 
 #include <wayland-util.h>
+#include <viewporter-client-protocol.h>
 #include <xdg-shell-client-protocol.h>
 #include <wlr-layer-shell-unstable-v1-client-protocol.h>
 
@@ -21,17 +31,43 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
+#include <malloc.h>
+#include <math.h>
 
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 
 #include <linux/input-event-codes.h>
 
 #define SCROLL_SENSITIVITY 0.1
 #define MIN_DRAW_RADIUS 1
 
+// Number of nodes around the current node in chronological order whose
+// keyframes are never compressed.
+#define HOT_HISTORY_NODES 16
+
+// Damage of an output is split into jobs of at least this many pixels, in
+// bands of whole rows of tiles. Anything smaller is rendered on the main thread
+// right away, since handing it to a worker would take longer than that.
+#define RENDER_JOB_PIXELS (256 * 1024)
+
+// Strokes in progress are previewed at a lower resolution once frames with a
+// preview take on average this much longer than the refresh interval, and at
+// a higher one again after this many frames in a row that take at most that
+// much longer than it.
+#define PREVIEW_SLOW_RATIO 1.5
+#define PREVIEW_FAST_RATIO 1.25
+#define PREVIEW_FAST_FRAMES 120
+#define PREVIEW_MAX_SCALE 4
+
 static double COLOR_PALLETE[][4] = {
   { 1.0, 0.0, 0.0, 1.0, },
   { 0.0, 1.0, 0.0, 1.0, },
@@ -43,27 +79,129 @@ static double COLOR_PALLETE[][4] = {
 
 #define COLOR_PALLETE_SIZE (sizeof COLOR_PALLETE / sizeof COLOR_PALLETE[0])
 
-enum waydraw_mode
-{
-  WAYDRAW_MODE_BRUSH,
-
-  WAYDRAW_MODE_LINE,
-  WAYDRAW_MODE_RECTANGLE,
-  WAYDRAW_MODE_CIRCLE,
-
-  WAYDRAW_MODE_COUNT,
-};
-
 struct waydraw_output
 {
   struct waydraw *waydraw;
   struct wl_list link;
   struct wl_output *wl_output;
+  uint32_t global_name;
+  unsigned index; // in the order outputs are announced, for traces
+  char *name;
 
   struct wl_surface *wl_surface;
   struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1;
 
+  struct swapchain *swapchain;
   struct snapshot *snapshot;
+  struct session *session;
+
+  cairo_region_t *damage; // damage accumulated since the last frame
+
+  // Pending wl_surface.frame callback. While it is pending, rendering is
+  // deferred until it is done so that we commit at most once per frame.
+  struct wl_callback *frame_callback;
+  uint64_t commit_time; // of the frame the callback is for, for stats
+
+  // Buffer being rendered by workers, and the number of jobs left until it can
+  // be committed.
+  struct swapchain_buffer *rendering;
+  unsigned jobs;
+  uint64_t render_start; // for stats
+
+  struct wl_list commits; // strokes being committed, oldest first
+  struct wl_list overlays;
+
+  // Strokes in progress are drawn on overlays at 1/preview_scale of the
+  // resolution of the output and scaled back up by the compositor, for as
+  // long as frames can not keep up with them at full resolution. Frames are only timed when committed as
+  // soon as the previous one is done, which is when they follow each other as
+  // fast as the compositor goes.
+  unsigned preview_scale;
+  bool frame_pending;         // whether there was damage when the last frame was done
+  bool preview_timed;         // whether the pending frame is timed
+  uint64_t frame_done_time;   // of the last frame callback
+  uint64_t refresh_interval;  // of the current mode, if known
+  uint64_t shortest_interval; // between timed frames so far
+  uint64_t preview_interval;  // moving average between timed frames
+  unsigned preview_fast_frames;
+
+  // Whether the buffer got detached by hibernation, in which case nothing can
+  // be attached until the surface is configured again.
+  bool detached;
+
+  // Whether the surface got configured while hibernated with H, in which case
+  // it is only shown once resuming.
+  bool hidden;
+};
+
+// A finished stroke, composited into a clone of the canvas of its output on a
+// worker. Until it is pushed onto the history, its layer is composited on top
+// of the canvas in place of the seat it came from.
+//
+// Only the oldest stroke of an output is being composited at any time, since
+// each of them has to start from the canvas the previous one results in.
+struct waydraw_commit
+{
+  struct pool_job job;
+  struct wl_list link;
+
+  struct waydraw_output *output;
+  struct command command;
+  struct layer *layer;
+  struct waydraw_overlay *overlay; // showing the stroke until done, if scaled
+
+  struct canvas *canvas; // once started
+  bool done;
+  uint64_t composite_time; // on the worker, for stats
+};
+
+// A subsurface of an output that the stroke of a seat is presented on while it
+// is in progress, so that the compositor blends it on top of the canvas, and
+// only the part of the layer that changed has to be uploaded each frame. It is
+// kept around for the next stroke of the seat on the same output, once it no
+// longer shows the last one.
+//
+// The subsurface is synchronized, so that once the stroke is finished, hiding
+// it takes effect together with the buffer of the output that has the stroke
+// composited into it.
+struct waydraw_overlay
+{
+  struct wl_list link;
+  struct waydraw_output *output;
+  struct waydraw_seat *seat;
+
+  struct wl_surface *wl_surface;
+  struct wl_subsurface *wl_subsurface;
+  struct wp_viewport *wp_viewport; // if the compositor can scale
+  struct swapchain *swapchain;     // as large as the layer
+  unsigned scale;                  // of the output relative to the layer
+
+  struct layer *layer;    // of the stroke in progress or being committed
+  cairo_region_t *damage; // of the layer since it was last presented
+  bool reset;             // whether the buffers still show a previous stroke
+  bool attached;          // whether a buffer is attached
+};
+
+// A band of the damage of an output, rendered on a worker.
+struct waydraw_render_job
+{
+  struct pool_job job;
+  struct waydraw_output *output;
+  cairo_region_t *region;
+};
+
+// Pointer events received since the last wl_pointer.frame, which are applied
+// together once the frame event arrives.
+struct waydraw_pointer_frame
+{
+  bool motion;
+  double x, y;
+
+  struct wl_array buttons; // states of BTN_LEFT in the order they are received
+
+  double axis;
+
+  unsigned events; // number of events in this frame
 };
 
 struct waydraw_seat
@@ -71,6 +209,7 @@ struct waydraw_seat
   struct waydraw *waydraw;
   struct wl_list link;
   struct wl_seat *wl_seat;
+  unsigned index; // in the order seats are announced, for traces
 
   struct wl_keyboard *wl_keyboard;
   struct xkb_state *xkb_state;
@@ -78,23 +217,33 @@ struct waydraw_seat
   struct wl_pointer *wl_pointer;
   struct wl_surface *wl_pointer_surface;
 
+  struct waydraw_pointer_frame pointer_frame;
+
   struct waydraw_output *keyboard_focus;
   struct waydraw_output *pointer_focus;
 
   double x, y;
 
-  unsigned color_index;
+  unsigned color_index; // in the palette, unless color was set otherwise
+  double color[4];
   double weight;
 
   enum waydraw_mode mode;
-  enum waydraw_mode committed_mode;
 
-  double saved_x, saved_y;
+  // The command for the current stroke, and the filter positions of the
+  // pointer go through before becoming its points in brush mode.
+  struct command command;
+  struct filter filter;
 
   struct waydraw_output *drawing_focus;
 
-  cairo_surface_t *surface;
+  struct layer *layer;
   cairo_t *cairo;
+
+  // Where the stroke is presented, if the compositor supports subsurfaces.
+  // Otherwise, the layer is composited on top of the canvas in the buffers of
+  // the output.
+  struct waydraw_overlay *overlay;
 };
 
 struct waydraw
@@ -104,30 +253,102 @@ struct waydraw
   struct wl_display *wl_display;
 
   struct wl_compositor *wl_compositor;
+  struct wl_subcompositor *wl_subcompositor; // if any
+  struct wp_viewporter *wp_viewporter;       // if any
   struct wl_shm *wl_shm;
   struct zwlr_layer_shell_v1 *zwlr_layer_shell_v1;
 
   bool initialized;
 
+  // While hibernated, input passes through to whatever is below, but events
+  // from the compositor keep being serviced.
+  bool hibernated;
+  bool detached;         // whether outputs are not shown either, as with H
+  uint64_t resume_start; // until the canvas is shown again, for stats
+
+  struct cursor_cache *cursor_cache; // shared by every seat, created on demand
+
+  unsigned keyframe_interval;
+  enum command_smoothing smoothing; // of brush strokes
+
+  size_t memory_budget; // start compressing history past this, if non-zero
+  size_t memory_limit;  // start pruning history past this, if non-zero
+
+  const char *session_directory; // directory of session files, if any
+
+  struct trace *trace; // input trace being recorded, if any
+
+  sigset_t signals;   // blocked in every thread, and read from a signalfd
+  struct pool *pool;  // workers rendering outputs
+  unsigned rendering; // number of outputs being rendered
+
   struct wl_list outputs;
   struct wl_list seats;
+
+  struct
+  {
+    uint64_t events;    // number of pointer events received
+    uint64_t frames;    // number of pointer frames applied
+    uint64_t coalesced; // number of pointer frames folded into an already pending redraw
+  } input_stats;
 };
 
 static void check_globals(struct waydraw *waydraw);
 
 static void handle_global(void *data, struct wl_registry *wl_registry, uint32_t name, const char *interface, uint32_t version);
 
-static void handle_output(struct waydraw *waydraw, struct wl_output *wl_output);
+static void handle_output(struct waydraw *waydraw, uint32_t name, struct wl_output *wl_output);
 static void handle_seat(struct waydraw *waydraw, struct wl_seat *wl_seat);
 
 static void init_output(struct waydraw_output *output);
+static void open_output_session(struct waydraw_output *output);
 static void init_seat(struct waydraw_seat *seat);
 
-static void update_output(struct waydraw_output *output);
+static void damage_output(struct waydraw_output *output, const cairo_rectangle_int_t *rect);
+static void damage_output_all(struct waydraw_output *output);
+
+static void update_outputs(struct waydraw *waydraw);
+static void render_output(struct waydraw_output *output);
+static void run_render_job(struct pool_job *job);
+static void finish_render_job(struct pool_job *job);
+static void commit_output(struct waydraw_output *output);
+static void commit_output_surface(struct waydraw_output *output);
+static void frame_output(void *data, struct wl_callback *wl_callback, uint32_t time);
+
+static void commit_seat(struct waydraw_seat *seat);
+static void start_commit(struct waydraw_commit *commit);
+static void run_commit(struct pool_job *job);
+static void finish_commit(struct pool_job *job);
+static void apply_commits(struct waydraw_output *output);
+static void wait_commits(struct waydraw_output *output);
+static void wait_all_commits(struct waydraw *waydraw);
+
+static struct waydraw_overlay *get_overlay(struct waydraw_output *output, struct waydraw_seat *seat);
+static bool overlays_pending(struct waydraw_output *output);
+static void present_overlay(struct waydraw_overlay *overlay);
+static void adapt_preview_scale(struct waydraw_output *output, uint64_t interval);
 
 static void update_seat_preview(struct waydraw_seat *seat);
+static void draw_seat_preview(struct waydraw_seat *seat);
 
 static void update_seat_pointer(struct waydraw_seat *seat);
+static void set_seat_weight(struct waydraw_seat *seat, double weight);
+
+static void change_history(struct waydraw_output *output, void (*change)(struct snapshot *snapshot));
+
+static size_t memory_usage(struct waydraw *waydraw);
+static void enforce_memory_budget(struct waydraw *waydraw);
+
+static void print_stats(struct waydraw *waydraw, FILE *file);
+static void handle_command(struct waydraw *waydraw, const struct control_message *message);
+
+static void hibernate(struct waydraw *waydraw, bool detach);
+static void release_memory(struct waydraw *waydraw, bool detach);
+static void resume(struct waydraw *waydraw);
+static void record_wakeup(struct waydraw *waydraw);
+
+static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags, int32_t width, int32_t height, int32_t refresh);
+static void output_name(void *data, struct wl_output *wl_output, const char *name);
 
 static void seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t capabilities);
 
@@ -144,8 +365,15 @@ static void pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t se
 static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y);
 static void pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state);
 static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value);
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer);
+
+static void apply_pointer_frame(struct waydraw_seat *seat);
+static void apply_pointer_motion(struct waydraw_seat *seat);
+static void apply_pointer_button(struct waydraw_seat *seat, uint32_t state);
+static void apply_pointer_axis(struct waydraw_seat *seat, double value);
 
 static void configure_surface(void *data, struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1, uint32_t serial, uint32_t width, uint32_t height);
+static void show_output(struct waydraw_output *output);
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored  "-Wincompatible-pointer-types"
@@ -157,6 +385,15 @@ static struct wl_registry_listener wl_registry_listener = {
   .global_remove = &noop,
 };
 
+static struct wl_output_listener wl_output_listener = {
+  .geometry = &noop,
+  .mode = &output_mode,
+  .done = &noop,
+  .scale = &noop,
+  .name = &output_name,
+  .description = &noop,
+};
+
 static struct wl_seat_listener wl_seat_listener = {
   .capabilities = &seat_capabilities,
   .name = &noop,
@@ -177,7 +414,7 @@ static struct wl_pointer_listener wl_pointer_listener = {
   .motion = &pointer_motion,
   .button = &pointer_button,
   .axis = &pointer_axis,
-  .frame = &noop,
+  .frame = &pointer_frame,
   .axis_source = &noop,
   .axis_stop = &noop,
   .axis_discrete = &noop,
@@ -185,6 +422,10 @@ static struct wl_pointer_listener wl_pointer_listener = {
   .axis_relative_direction = &noop,
 };
 
+static struct wl_callback_listener wl_frame_callback_listener = {
+  .done = &frame_output,
+};
+
 static struct zwlr_layer_surface_v1_listener zwlr_layer_surface_v1_listener = {
   .configure = &configure_surface,
   .closed = &noop,
@@ -231,6 +472,18 @@ static void handle_global(void *data, struct wl_registry *wl_registry, uint32_t
     return;
   }
 
+  if(strcmp(interface, wl_subcompositor_interface.name) == 0)
+  {
+    waydraw->wl_subcompositor = wl_registry_bind(wl_registry, name, &wl_subcompositor_interface, 1);
+    return;
+  }
+
+  if(strcmp(interface, wp_viewporter_interface.name) == 0)
+  {
+    waydraw->wp_viewporter = wl_registry_bind(wl_registry, name, &wp_viewporter_interface, 1);
+    return;
+  }
+
   if(strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0)
   {
     waydraw->zwlr_layer_shell_v1 = wl_registry_bind(wl_registry, name, &zwlr_layer_shell_v1_interface, version);
@@ -245,7 +498,7 @@ static void handle_global(void *data, struct wl_registry *wl_registry, uint32_t
 
   if(strcmp(interface, wl_output_interface.name) == 0)
   {
-    handle_output(waydraw, wl_registry_bind(wl_registry, name, &wl_output_interface, version));
+    handle_output(waydraw, name, wl_registry_bind(wl_registry, name, &wl_output_interface, version));
     return;
   }
 
@@ -256,13 +509,17 @@ static void handle_global(void *data, struct wl_registry *wl_registry, uint32_t
   }
 }
 
-static void handle_output(struct waydraw *waydraw, struct wl_output *wl_output)
+static void handle_output(struct waydraw *waydraw, uint32_t name, struct wl_output *wl_output)
 {
   check_globals(waydraw);
 
   struct waydraw_output *output = calloc(1, sizeof *output);
   output->waydraw = waydraw;
   output->wl_output = wl_output;
+  output->global_name = name;
+  output->index = wl_list_length(&waydraw->outputs);
+  trace_record(waydraw->trace, TRACE_EVENT_OUTPUT, output->index, wl_output_get_version(wl_output));
+  wl_output_add_listener(wl_output, &wl_output_listener, output);
   wl_list_insert(&waydraw->outputs, &output->link);
   init_output(output);
 }
@@ -274,6 +531,8 @@ static void handle_seat(struct waydraw *waydraw, struct wl_seat *wl_seat)
   struct waydraw_seat *seat = calloc(1, sizeof *seat);
   seat->waydraw = waydraw;
   seat->wl_seat = wl_seat;
+  seat->index = wl_list_length(&waydraw->seats);
+  trace_record(waydraw->trace, TRACE_EVENT_SEAT, seat->index, wl_seat_get_version(wl_seat));
   wl_list_insert(&waydraw->seats, &seat->link);
   init_seat(seat);
 }
@@ -282,6 +541,11 @@ static void init_output(struct waydraw_output *output)
 {
   struct waydraw *waydraw = output->waydraw;
 
+  output->damage = cairo_region_create();
+  wl_list_init(&output->commits);
+  wl_list_init(&output->overlays);
+  output->preview_scale = 1;
+
   output->wl_surface = wl_compositor_create_surface(waydraw->wl_compositor);
   wl_surface_set_user_data(output->wl_surface, output);
 
@@ -294,7 +558,19 @@ static void init_output(struct waydraw_output *output)
 
   zwlr_layer_surface_v1_add_listener(output->zwlr_layer_surface_v1, &zwlr_layer_surface_v1_listener, output);
 
-  zwlr_layer_surface_v1_set_keyboard_interactivity(output->zwlr_layer_surface_v1, ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_EXCLUSIVE);
+  // An output showing up while hibernated lets input through like the others,
+  // and is not shown either if they are not.
+  if(waydraw->hibernated)
+  {
+    struct wl_region *empty_region = wl_compositor_create_region(waydraw->wl_compositor);
+    wl_surface_set_input_region(output->wl_surface, empty_region);
+    wl_region_destroy(empty_region);
+    output->detached = waydraw->detached;
+  }
+
+  zwlr_layer_surface_v1_set_keyboard_interactivity(output->zwlr_layer_surface_v1, waydraw->hibernated
+      ? ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE
+      : ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_EXCLUSIVE);
   zwlr_layer_surface_v1_set_exclusive_zone(output->zwlr_layer_surface_v1, -1);
   zwlr_layer_surface_v1_set_anchor(output->zwlr_layer_surface_v1,
       ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
@@ -305,243 +581,1173 @@ static void init_output(struct waydraw_output *output)
   wl_surface_commit(output->wl_surface);
 }
 
+static void open_output_session(struct waydraw_output *output)
+{
+  struct waydraw *waydraw = output->waydraw;
+
+  if(mkdir(waydraw->session_directory, 0700) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "error: failed to create session directory %s: %s\n", waydraw->session_directory, strerror(errno));
+    return;
+  }
+
+  // The name of an output is only available since wl_output version 4. Fall
+  // back to the name of its global, which is at least stable as long as the
+  // compositor is running.
+  char path[4096];
+  if(output->name)
+    snprintf(path, sizeof path, "%s/%s.session", waydraw->session_directory, output->name);
+  else
+    snprintf(path, sizeof path, "%s/output-%u.session", waydraw->session_directory, output->global_name);
+
+  output->session = session_open(path, output->snapshot);
+}
+
 static void init_seat(struct waydraw_seat *seat)
 {
+  wl_array_init(&seat->pointer_frame.buttons);
+
   seat->weight = 10;
   seat->color_index = 0;
+  memcpy(seat->color, COLOR_PALLETE[seat->color_index], sizeof seat->color);
   seat->mode = WAYDRAW_MODE_BRUSH;
 
   wl_seat_add_listener(seat->wl_seat, &wl_seat_listener, seat);
 }
 
-static void update_output(struct waydraw_output *output)
+static void damage_output(struct waydraw_output *output, const cairo_rectangle_int_t *rect)
 {
-  cairo_surface_t *new_surface = cairo_image_surface_clone(output->snapshot->current->cairo_surface);
-  cairo_t *cairo = cairo_create(new_surface);
+  cairo_region_union_rectangle(output->damage, rect);
+}
 
-  struct waydraw *waydraw = output->waydraw;
+// A detached output has no swapchain, and is damaged as a whole by
+// show_output() once it is shown again anyway.
+static void damage_output_all(struct waydraw_output *output)
+{
+  if(!output->swapchain)
+    return;
 
+  cairo_rectangle_int_t rect = { 0, 0, output->swapchain->width, output->swapchain->height };
+  cairo_region_union_rectangle(output->damage, &rect);
+}
+
+static uint64_t region_pixels(const cairo_region_t *region)
+{
+  uint64_t pixels = 0;
+
+  int n = cairo_region_num_rectangles(region);
+  for(int i=0; i<n; ++i)
+  {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(region, i, &rect);
+    pixels += (uint64_t)rect.width * rect.height;
+  }
+  return pixels;
+}
+
+// Render every output that has something new to show and is ready for it, all
+// at once, and commit each of them as soon as it is done. This is only called
+// from the main loop between dispatching events, and does not return before
+// everything is committed, so that nothing workers read from can change under
+// them.
+static void update_outputs(struct waydraw *waydraw)
+{
+  // Points held back by the input filter are added right before the frame
+  // that shows them, so that the stroke reaches the pointer in every frame.
   struct waydraw_seat *seat;
   wl_list_for_each(seat, &waydraw->seats, link)
-    if(seat->drawing_focus == output)
+    if(seat->drawing_focus && !seat->drawing_focus->rendering && !seat->drawing_focus->frame_callback)
     {
-      cairo_set_source_surface(cairo, seat->surface, 0.0, 0.0);
-      cairo_paint(cairo);
+      filter_flush(&seat->filter, &seat->command);
+      draw_seat_preview(seat);
     }
 
-  wl_surface_update_from_cairo_surface(output->wl_surface, new_surface, waydraw->wl_shm);
-  wl_surface_commit(output->wl_surface);
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+    render_output(output);
 
-  cairo_surface_destroy(new_surface);
-  cairo_destroy(cairo);
+  while(waydraw->rendering > 0)
+    pool_dispatch(waydraw->pool, true);
 }
 
-static void update_seat_preview(struct waydraw_seat *seat)
+// Create a job for rendering region, which it takes ownership of.
+static struct pool_job *new_render_job(struct waydraw_output *output, cairo_region_t *region)
 {
-  assert(seat->drawing_focus);
+  struct waydraw_render_job *render_job = calloc(1, sizeof *render_job);
+  render_job->job.run = &run_render_job;
+  render_job->job.done = &finish_render_job;
+  render_job->output = output;
+  render_job->region = region;
+
+  output->jobs += 1;
+  return &render_job->job;
+}
+
+static void render_output(struct waydraw_output *output)
+{
+  struct waydraw *waydraw = output->waydraw;
+  if(output->rendering || output->frame_callback || output->detached)
+    return;
 
-  switch(seat->committed_mode)
+  // Strokes in progress on subsurfaces do not need a new buffer for the output.
+  if(cairo_region_is_empty(output->damage))
   {
-  case WAYDRAW_MODE_BRUSH:
-    cairo_move_to(seat->cairo, seat->saved_x, seat->saved_y);
-    cairo_line_to(seat->cairo, seat->x, seat->y);
-    cairo_stroke(seat->cairo);
+    if(overlays_pending(output))
+      commit_output_surface(output);
+    return;
+  }
 
-    seat->saved_x = seat->x;
-    seat->saved_y = seat->y;
-    break;
-  case WAYDRAW_MODE_LINE:
-    {
-      cairo_save(seat->cairo);
-      cairo_set_operator(seat->cairo, CAIRO_OPERATOR_CLEAR);
-      cairo_paint(seat->cairo);
-      cairo_restore(seat->cairo);
-
-      cairo_move_to(seat->cairo, seat->saved_x, seat->saved_y);
-      cairo_line_to(seat->cairo, seat->x, seat->y);
-      cairo_stroke(seat->cairo);
-    }
-    break;
-  case WAYDRAW_MODE_RECTANGLE:
-    {
-      double width = seat->x - seat->saved_x;
-      double height = seat->y - seat->saved_y;
+  // If the compositor is still holding on to all of our buffers, there is
+  // nothing we can do but to wait. We will get to it again once one of them is
+  // released, with the damage still accumulated.
+  struct swapchain_buffer *buffer = swapchain_acquire(output->swapchain);
+  if(!buffer)
+    return;
 
-      cairo_save(seat->cairo);
-      cairo_set_operator(seat->cairo, CAIRO_OPERATOR_CLEAR);
-      cairo_paint(seat->cairo);
-      cairo_restore(seat->cairo);
+  cairo_rectangle_int_t bounds = { 0, 0, output->swapchain->width, output->swapchain->height };
+  cairo_region_intersect_rectangle(output->damage, &bounds);
+  swapchain_damage(output->swapchain, output->damage);
 
-      cairo_rectangle(seat->cairo, seat->saved_x, seat->saved_y, width, height);
-      cairo_stroke(seat->cairo);
-    }
-    break;
-  case WAYDRAW_MODE_CIRCLE:
-    {
-      double dx = seat->x - seat->saved_x;
-      double dy = seat->y - seat->saved_y;
-      double radius = sqrt(dx * dx + dy * dy);
+  output->render_start = stats_now();
+
+  // Get everything workers are going to read from ready beforehand, since they
+  // can not touch anything shared.
+  canvas_decompress(output->snapshot->canvas, buffer->damage);
+  cairo_surface_flush(buffer->cairo_surface);
+
+  struct waydraw_seat *seat;
+  wl_list_for_each(seat, &waydraw->seats, link)
+    if(seat->drawing_focus == output && !seat->overlay)
+      cairo_surface_flush(seat->layer->cairo_surface);
 
-      cairo_save(seat->cairo);
-      cairo_set_operator(seat->cairo, CAIRO_OPERATOR_CLEAR);
-      cairo_paint(seat->cairo);
-      cairo_restore(seat->cairo);
+  output->rendering = buffer;
+  waydraw->rendering += 1;
 
-      cairo_arc(seat->cairo, seat->saved_x, seat->saved_y, radius, 0, 2.0 * M_PI);
-      cairo_stroke(seat->cairo);
+  // Hold on to the output until every job is submitted, or it might get
+  // committed as soon as the first one is done.
+  output->jobs = 1;
+
+  if(pool_workers(waydraw->pool) == 0 || region_pixels(buffer->damage) < RENDER_JOB_PIXELS)
+  {
+    struct pool_job *job = new_render_job(output, cairo_region_copy(buffer->damage));
+    run_render_job(job);
+    finish_render_job(job);
+  }
+  else
+  {
+    cairo_rectangle_int_t extents;
+    cairo_region_get_extents(buffer->damage, &extents);
+
+    cairo_region_t *region = cairo_region_create();
+    for(int y = extents.y - extents.y % TILE_SIZE; y < extents.y + extents.height; y += TILE_SIZE)
+    {
+      cairo_rectangle_int_t row = { 0, y, bounds.width, TILE_SIZE };
+      cairo_region_t *part = cairo_region_copy(buffer->damage);
+      cairo_region_intersect_rectangle(part, &row);
+      cairo_region_union(region, part);
+      cairo_region_destroy(part);
+
+      if(region_pixels(region) >= RENDER_JOB_PIXELS)
+      {
+        pool_submit(waydraw->pool, new_render_job(output, region));
+        region = cairo_region_create();
+      }
     }
-    break;
-  case WAYDRAW_MODE_COUNT:
-    break;
+
+    if(!cairo_region_is_empty(region))
+      pool_submit(waydraw->pool, new_render_job(output, region));
+    else
+      cairo_region_destroy(region);
   }
+
+  if(--output->jobs == 0)
+    commit_output(output);
 }
 
-static void update_seat_pointer(struct waydraw_seat *seat)
+// Each buffer of the swapchain is a persistent framebuffer of the output, so
+// composite straight into the shm buffer, but only the part that is out of
+// date. The canvas is copied so that whatever was left in the buffer from the
+// last time it was used is overwritten. A seat without an overlay only needs to
+// be composited on top where its stroke touches the damage.
+//
+// This runs on a worker, alongside other jobs for the same buffer.
+static void run_render_job(struct pool_job *job)
 {
-  struct waydraw *waydraw = seat->waydraw;
+  struct waydraw_render_job *render_job = wl_container_of(job, render_job, job);
+  struct waydraw_output *output = render_job->output;
+  cairo_surface_t *cairo_surface = output->rendering->cairo_surface;
 
-  if(!seat->drawing_focus)
-  {
-    int size = ceil(seat->weight);
-    int hsize = round(size * 0.5);
+  canvas_paint(output->snapshot->canvas, cairo_surface, render_job->region);
 
-    cairo_surface_t *cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
-    cairo_t *cairo = cairo_create(cairo_surface);
+  // Strokes that are still being drawn at full resolution are shown on their
+  // overlay instead.
+  struct waydraw_commit *commit;
+  wl_list_for_each(commit, &output->commits, link)
+  {
+    if(commit->overlay)
+      continue;
 
-    cairo_set_source_rgba(cairo,
-      COLOR_PALLETE[seat->color_index][0],
-      COLOR_PALLETE[seat->color_index][1],
-      COLOR_PALLETE[seat->color_index][2],
-      COLOR_PALLETE[seat->color_index][3]
-    );
-    cairo_set_line_width(cairo, 3);
-    cairo_arc(cairo, hsize, hsize, seat->weight * 0.5, 0, 2*M_PI);
-    cairo_fill(cairo);
+    cairo_region_t *region = cairo_region_copy(render_job->region);
+    cairo_region_intersect_rectangle(region, &commit->command.extents);
+    blend_over_unlocked(cairo_surface, commit->layer->cairo_surface, commit->layer->rect.x, commit->layer->rect.y, region);
+    cairo_region_destroy(region);
+  }
 
-    wl_surface_update_from_cairo_surface(seat->wl_pointer_surface, cairo_surface, waydraw->wl_shm);
+  struct waydraw_seat *seat;
+  wl_list_for_each(seat, &output->waydraw->seats, link)
+    if(seat->drawing_focus == output && !seat->overlay)
+    {
+      cairo_region_t *region = cairo_region_copy(render_job->region);
+      cairo_region_intersect_rectangle(region, &seat->command.extents);
+      blend_over_unlocked(cairo_surface, seat->layer->cairo_surface, seat->layer->rect.x, seat->layer->rect.y, region);
+      cairo_region_destroy(region);
+    }
+}
 
-    cairo_destroy(cairo);
-    cairo_surface_destroy(cairo_surface);
-  }
-  else
-    wl_surface_attach(seat->wl_pointer_surface, NULL, 0, 0);
+static void finish_render_job(struct pool_job *job)
+{
+  struct waydraw_render_job *render_job = wl_container_of(job, render_job, job);
+  struct waydraw_output *output = render_job->output;
 
-  wl_surface_commit(seat->wl_pointer_surface);
+  cairo_region_destroy(render_job->region);
+  free(render_job);
 
+  if(--output->jobs == 0)
+    commit_output(output);
 }
 
-static void seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t capabilities)
+static void commit_output(struct waydraw_output *output)
 {
-  struct waydraw_seat *seat = data;
-  struct waydraw *waydraw = seat->waydraw;
+  struct waydraw *waydraw = output->waydraw;
+  struct swapchain_buffer *buffer = output->rendering;
 
-  if(seat->wl_keyboard)
-    wl_keyboard_destroy(seat->wl_keyboard);
+  cairo_surface_mark_dirty(buffer->cairo_surface);
+  stats_count(STATS_SHM_BYTES, region_pixels(buffer->damage) * 4);
 
-  if(seat->wl_pointer)
-    wl_pointer_destroy(seat->wl_pointer);
+  cairo_region_destroy(buffer->damage);
+  buffer->damage = cairo_region_create();
 
-  if(seat->wl_pointer_surface)
-    wl_surface_destroy(seat->wl_pointer_surface);
+  stats_record_since(STATS_UPLOAD, output->render_start);
 
-  if(capabilities & WL_SEAT_CAPABILITY_KEYBOARD)
-  {
-    seat->wl_keyboard = wl_seat_get_keyboard(wl_seat);
-    wl_keyboard_add_listener(seat->wl_keyboard, &wl_keyboard_listener, seat);
-  }
-  else
-    seat->wl_keyboard = NULL;
+  wl_surface_attach(output->wl_surface, buffer->wl_buffer, 0, 0);
 
-  if(capabilities & WL_SEAT_CAPABILITY_POINTER)
+  int n = cairo_region_num_rectangles(output->damage);
+  for(int i=0; i<n; ++i)
   {
-    seat->wl_pointer = wl_seat_get_pointer(wl_seat);
-    wl_pointer_add_listener(seat->wl_pointer, &wl_pointer_listener, seat);
-    seat->wl_pointer_surface = wl_compositor_create_surface(waydraw->wl_compositor);
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(output->damage, i, &rect);
+    wl_surface_damage_buffer(output->wl_surface, rect.x, rect.y, rect.width, rect.height);
   }
-  else
+
+  commit_output_surface(output);
+
+  cairo_region_destroy(output->damage);
+  output->damage = cairo_region_create();
+
+  output->rendering = NULL;
+  waydraw->rendering -= 1;
+
+  record_wakeup(waydraw);
+}
+
+// Commit the surface of output together with its overlays, which only take
+// effect once it is committed.
+static void commit_output_surface(struct waydraw_output *output)
+{
+  uint64_t start = stats_now();
+
+  output->frame_callback = wl_surface_frame(output->wl_surface);
+  wl_callback_add_listener(output->frame_callback, &wl_frame_callback_listener, output);
+
+  bool previewing = false;
+  struct waydraw_overlay *overlay;
+  wl_list_for_each(overlay, &output->overlays, link)
   {
-    seat->wl_pointer = NULL;
-    seat->wl_pointer_surface = NULL;
+    previewing |= overlay->layer && !cairo_region_is_empty(overlay->damage);
+    present_overlay(overlay);
   }
+  output->preview_timed = previewing && output->frame_pending;
+
+  wl_surface_commit(output->wl_surface);
+
+  output->commit_time = stats_now();
+  stats_record(STATS_COMMIT, output->commit_time - start);
 }
 
-static void keyboard_enter(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface, struct wl_array *keys)
+static struct waydraw_overlay *get_overlay(struct waydraw_output *output, struct waydraw_seat *seat)
 {
-  (void)wl_keyboard;
-  (void)serial;
-  (void)keys;
+  struct waydraw *waydraw = output->waydraw;
 
-  struct waydraw_seat *seat = data;
-  assert(seat->keyboard_focus == NULL);
-  seat->keyboard_focus = wl_surface_get_user_data(surface);
+  struct waydraw_overlay *overlay;
+  wl_list_for_each(overlay, &output->overlays, link)
+    if(overlay->seat == seat && !overlay->layer)
+      return overlay;
+
+  overlay = calloc(1, sizeof *overlay);
+  overlay->output = output;
+  overlay->seat = seat;
+  overlay->damage = cairo_region_create();
+
+  overlay->wl_surface = wl_compositor_create_surface(waydraw->wl_compositor);
+  overlay->wl_subsurface = wl_subcompositor_get_subsurface(waydraw->wl_subcompositor, overlay->wl_surface, output->wl_surface);
+
+  // Pointer events have to keep going to the output, or strokes would stop at
+  // their own overlay.
+  struct wl_region *wl_region = wl_compositor_create_region(waydraw->wl_compositor);
+  wl_surface_set_input_region(overlay->wl_surface, wl_region);
+  wl_region_destroy(wl_region);
+
+  if(waydraw->wp_viewporter)
+    overlay->wp_viewport = wp_viewporter_get_viewport(waydraw->wp_viewporter, overlay->wl_surface);
+
+  wl_list_insert(output->overlays.prev, &overlay->link);
+  return overlay;
 }
 
-static void keyboard_leave(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface)
+static bool overlays_pending(struct waydraw_output *output)
 {
-  (void)wl_keyboard;
-  (void)serial;
-
-  struct waydraw_seat *seat = data;
-  assert(seat->keyboard_focus == wl_surface_get_user_data(surface));
-  seat->keyboard_focus = NULL;
+  struct waydraw_overlay *overlay;
+  wl_list_for_each(overlay, &output->overlays, link)
+    if(overlay->layer ? !cairo_region_is_empty(overlay->damage) : overlay->attached)
+      return true;
+  return false;
 }
 
-static void handle_keymap(void *data, struct wl_keyboard *wl_keyboard, uint32_t format, int32_t fd, uint32_t size)
+// Upload the damage of the layer of overlay, or hide it once the stroke is
+// finished. This only takes effect once the output is committed.
+static void present_overlay(struct waydraw_overlay *overlay)
 {
-  (void)wl_keyboard;
+  struct waydraw *waydraw = overlay->output->waydraw;
+  struct layer *layer = overlay->layer;
 
-  struct waydraw_seat *seat = data;
-  struct waydraw *waydraw = seat->waydraw;
+  if(!layer)
+  {
+    if(overlay->attached)
+    {
+      wl_surface_attach(overlay->wl_surface, NULL, 0, 0);
+      wl_surface_commit(overlay->wl_surface);
+      overlay->attached = false;
+    }
+    return;
+  }
 
-  if(seat->xkb_state)
-    xkb_state_unref(seat->xkb_state);
+  if(cairo_region_is_empty(overlay->damage))
+    return;
 
-  assert(format == WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1);
+  // The layer moves to a larger surface as the stroke grows, which is rare
+  // enough that a new swapchain will do.
+  uint32_t width = layer->rect.width;
+  uint32_t height = layer->rect.height;
+  if(!overlay->swapchain || overlay->swapchain->width != width || overlay->swapchain->height != height)
+  {
+    if(overlay->swapchain)
+      swapchain_destroy(overlay->swapchain);
+    overlay->swapchain = swapchain_new(waydraw->wl_shm, width, height);
+    overlay->reset = true;
+  }
 
-  char *map_shm = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if(map_shm == MAP_FAILED)
+  struct swapchain_buffer *buffer = swapchain_acquire(overlay->swapchain);
+  if(!buffer)
+    return;
+
+  // The damage is in the coordinates of the output, and the layer covers
+  // scale by scale pixels of the output with each of its own.
+  unsigned scale = overlay->scale;
+  if(scale != 1)
   {
-    fprintf(stderr, "error: failed to mmap keymap file: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+    cairo_region_t *damage = cairo_region_downsample(overlay->damage, scale);
+    cairo_region_destroy(overlay->damage);
+    overlay->damage = damage;
   }
 
-  struct xkb_keymap *xkb_keymap = xkb_keymap_new_from_string(
-      waydraw->xkb_context,
-      map_shm,
-      XKB_KEYMAP_FORMAT_TEXT_V1,
-      XKB_KEYMAP_COMPILE_NO_FLAGS);
+  cairo_rectangle_int_t bounds = { 0, 0, width, height };
+  if(overlay->reset)
+  {
+    cairo_region_union_rectangle(overlay->damage, &layer->rect);
+    overlay->reset = false;
+  }
 
-  if(!xkb_keymap)
+  cairo_region_translate(overlay->damage, -layer->rect.x, -layer->rect.y);
+  cairo_region_intersect_rectangle(overlay->damage, &bounds);
+  swapchain_damage(overlay->swapchain, overlay->damage);
+
+  blend_copy(buffer->cairo_surface, layer->cairo_surface, 0, 0, buffer->damage);
+  stats_count(STATS_SHM_BYTES, region_pixels(buffer->damage) * 4);
+  cairo_region_destroy(buffer->damage);
+  buffer->damage = cairo_region_create();
+
+  if(overlay->wp_viewport)
   {
-    fprintf(stderr, "error: failed to parse keymap file\n");
-    exit(EXIT_FAILURE);
+    wp_viewport_set_source(overlay->wp_viewport, 0, 0, wl_fixed_from_int(width), wl_fixed_from_int(height));
+    wp_viewport_set_destination(overlay->wp_viewport, width * scale, height * scale);
   }
 
-  seat->xkb_state = xkb_state_new(xkb_keymap);
-  if(!seat->xkb_state)
+  wl_subsurface_set_position(overlay->wl_subsurface, layer->rect.x * scale, layer->rect.y * scale);
+  wl_surface_attach(overlay->wl_surface, buffer->wl_buffer, 0, 0);
+
+  int n = cairo_region_num_rectangles(overlay->damage);
+  for(int i=0; i<n; ++i)
   {
-    fprintf(stderr, "error: failed to create xkb state from keymap\n");
-    exit(EXIT_FAILURE);
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(overlay->damage, i, &rect);
+    wl_surface_damage_buffer(overlay->wl_surface, rect.x, rect.y, rect.width, rect.height);
   }
 
-  xkb_keymap_unref(xkb_keymap);
-  munmap(map_shm, size);
-  close(fd);
+  wl_surface_commit(overlay->wl_surface);
+  overlay->attached = true;
+
+  cairo_region_destroy(overlay->damage);
+  overlay->damage = cairo_region_create();
 }
 
-static void handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, uint32_t time, uint32_t key, uint32_t state)
+// Hand the stroke of seat over to a worker to be committed, now that it is
+// finished.
+static void commit_seat(struct waydraw_seat *seat)
 {
-  (void)wl_keyboard;
-  (void)serial;
-  (void)time;
-
-  struct waydraw_seat *seat = data;
-  struct waydraw_output *output = seat->keyboard_focus;
-  struct waydraw *waydraw = seat->waydraw;
-  assert(seat->xkb_state);
-  assert(output);
+  struct waydraw_output *output = seat->drawing_focus;
+
+  struct waydraw_commit *commit = calloc(1, sizeof *commit);
+  commit->job.run = &run_commit;
+  commit->job.done = &finish_commit;
+  commit->output = output;
+  commit->command = seat->command;
+  cairo_destroy(seat->cairo);
+  seat->cairo = NULL;
+
+  // A preview at a lower resolution only stands in for the stroke, which the
+  // worker draws again at full resolution to be committed. Until then, the
+  // overlay keeps showing the preview, and the stroke is left out of the
+  // buffers of the output. The layer is allocated here, as large as the stroke
+  // could get, which is also all the worker may touch of the canvas.
+  if(seat->overlay && seat->overlay->scale != 1)
+  {
+    commit->overlay = seat->overlay;
+    commit->layer = layer_new(output->snapshot->width, output->snapshot->height);
+    commit->command.previewed = 0;
+    commit->command.extents = (cairo_rectangle_int_t){0};
+    command_preview_bounds(&commit->command, &commit->command.extents);
+    layer_reserve(commit->layer, &commit->command.extents);
+    seat->overlay = NULL;
+  }
+  else
+  {
+    commit->layer = seat->layer;
+    cairo_surface_flush(commit->layer->cairo_surface);
+  }
+  wl_list_insert(output->commits.prev, &commit->link);
+  seat->layer = NULL;
 
-  if(state == WL_KEYBOARD_KEY_STATE_PRESSED)
+  // From now on, the stroke is composited into the buffers of the output, and
+  // the overlay is hidden once that is committed.
+  if(seat->overlay)
+  {
+    damage_output(output, &commit->command.extents);
+    seat->overlay->layer = NULL;
+    seat->overlay = NULL;
+  }
+
+  apply_commits(output);
+}
+
+static void start_commit(struct waydraw_commit *commit)
+{
+  struct waydraw_output *output = commit->output;
+
+  // Only the tiles touched by the stroke get copied.
+  uint64_t start = stats_now();
+  commit->canvas = canvas_clone(output->snapshot->canvas);
+  stats_record_since(STATS_CLONE, start);
+
+  // The worker must not decompress tiles it shares with the rest of the
+  // history. Tiles are only compressed on the main thread while no stroke is
+  // being committed, so they stay that way until it is done.
+  cairo_region_t *region = cairo_region_create_rectangle(&commit->command.extents);
+  canvas_decompress(commit->canvas, region);
+  cairo_region_destroy(region);
+
+  pool_submit(output->waydraw->pool, &commit->job);
+}
+
+static void run_commit(struct pool_job *job)
+{
+  struct waydraw_commit *commit = wl_container_of(job, commit, job);
+
+  uint64_t start = stats_now();
+  struct layer *layer = commit->layer;
+
+  // The extents are measured again along the way, so that the stroke ends up
+  // exactly as if it was previewed at full resolution.
+  if(commit->overlay)
+  {
+    commit->command.extents = (cairo_rectangle_int_t){0};
+    cairo_t *cairo = cairo_create(layer->cairo_surface);
+    command_setup(&commit->command, cairo);
+    cairo_region_t *damage = cairo_region_create();
+    command_preview(&commit->command, cairo, damage);
+    cairo_region_destroy(damage);
+    cairo_destroy(cairo);
+    cairo_surface_flush(layer->cairo_surface);
+  }
+
+  canvas_composite(commit->canvas, layer->cairo_surface, layer->rect.x, layer->rect.y, &commit->command.extents);
+  commit->composite_time = stats_now() - start;
+}
+
+// This might be called while outputs are being rendered, so leave the actual
+// work to apply_commits().
+static void finish_commit(struct pool_job *job)
+{
+  struct waydraw_commit *commit = wl_container_of(job, commit, job);
+  commit->done = true;
+}
+
+// Push strokes of output that are done onto its history in order, and start
+// compositing the next one.
+static void apply_commits(struct waydraw_output *output)
+{
+  struct waydraw *waydraw = output->waydraw;
+  assert(!output->rendering);
+
+  bool pushed = false;
+  while(!wl_list_empty(&output->commits))
+  {
+    struct waydraw_commit *commit = wl_container_of(output->commits.next, commit, link);
+    if(!commit->canvas)
+    {
+      start_commit(commit);
+      break;
+    }
+
+    if(!commit->done)
+      break;
+
+    stats_record(STATS_COMPOSITE, commit->composite_time);
+
+    // The layer and the canvas it got composited into look exactly the same,
+    // so there is nothing to redraw, unless an overlay showed the stroke
+    // instead, which is hidden together with the buffer that has it.
+    if(commit->overlay)
+    {
+      damage_output(output, &commit->command.extents);
+      layer_destroy(commit->overlay->layer);
+      commit->overlay->layer = NULL;
+    }
+
+    snapshot_push(output->snapshot, &commit->command, commit->canvas);
+    session_save(output->session, output->snapshot);
+    pushed = true;
+
+    wl_list_remove(&commit->link);
+    layer_destroy(commit->layer);
+    free(commit);
+  }
+
+  if(pushed)
+    enforce_memory_budget(waydraw);
+}
+
+// Block until every stroke finished on output so far is on its history, for
+// anything that has to come after them.
+static void wait_commits(struct waydraw_output *output)
+{
+  for(apply_commits(output); !wl_list_empty(&output->commits); apply_commits(output))
+    pool_dispatch(output->waydraw->pool, true);
+}
+
+static void wait_all_commits(struct waydraw *waydraw)
+{
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+    wait_commits(output);
+}
+
+static void frame_output(void *data, struct wl_callback *wl_callback, uint32_t time)
+{
+  (void)time;
+
+  struct waydraw_output *output = data;
+  assert(output->frame_callback == wl_callback);
+
+  wl_callback_destroy(wl_callback);
+  output->frame_callback = NULL;
+  stats_record_since(STATS_FRAME_CALLBACK, output->commit_time);
+
+  uint64_t now = stats_now();
+  if(output->preview_timed && output->waydraw->wp_viewporter)
+    adapt_preview_scale(output, now - output->frame_done_time);
+
+  output->frame_done_time = now;
+  output->frame_pending = !cairo_region_is_empty(output->damage) || overlays_pending(output);
+}
+
+// Lower the resolution of previews while frames with one in them can not keep
+// up with the refresh rate, and try raising it again once they can. Without a
+// refresh rate from the compositor, the shortest frame seen stands in for it.
+static void adapt_preview_scale(struct waydraw_output *output, uint64_t interval)
+{
+  if(!output->shortest_interval || interval < output->shortest_interval)
+    output->shortest_interval = interval;
+
+  uint64_t refresh_interval = output->refresh_interval ? output->refresh_interval : output->shortest_interval;
+  output->preview_interval = output->preview_interval ? (output->preview_interval * 7 + interval) / 8 : interval;
+
+  // Changing the scale means drawing and uploading the whole layer again, so
+  // the average starts over from the refresh interval rather than from that
+  // frame.
+  if(output->preview_interval > refresh_interval * PREVIEW_SLOW_RATIO)
+  {
+    output->preview_fast_frames = 0;
+    if(output->preview_scale < PREVIEW_MAX_SCALE)
+    {
+      output->preview_scale *= 2;
+      output->preview_interval = refresh_interval;
+    }
+    return;
+  }
+
+  if(interval > refresh_interval * PREVIEW_FAST_RATIO)
+  {
+    output->preview_fast_frames = 0;
+    return;
+  }
+
+  if(output->preview_scale > 1 && ++output->preview_fast_frames >= PREVIEW_FAST_FRAMES)
+  {
+    output->preview_fast_frames = 0;
+    output->preview_scale /= 2;
+    output->preview_interval = refresh_interval;
+  }
+}
+
+// Feed the position of the pointer to the stroke in progress. In brush mode,
+// it may not become a point right away, if at all.
+static void update_seat_preview(struct waydraw_seat *seat)
+{
+  assert(seat->drawing_focus);
+
+  stats_count(STATS_INPUT_POINTS, 1);
+  if(seat->command.mode == WAYDRAW_MODE_BRUSH)
+    filter_add(&seat->filter, &seat->command, seat->x, seat->y);
+  else
+    command_add_point(&seat->command, seat->x, seat->y);
+
+  draw_seat_preview(seat);
+}
+
+// Draw whatever of the stroke in progress has not been drawn yet. On an
+// overlay the compositor can scale, the layer is at 1/preview_scale of the
+// resolution of the output, and the stroke is drawn again from the start on a
+// new layer whenever that changes.
+static void draw_seat_preview(struct waydraw_seat *seat)
+{
+  struct waydraw_output *output = seat->drawing_focus;
+  struct waydraw_overlay *overlay = seat->overlay;
+
+  unsigned scale = overlay && overlay->wp_viewport ? output->preview_scale : 1;
+  if(!seat->layer || (overlay && overlay->scale != scale))
+  {
+    if(seat->layer)
+    {
+      if(seat->cairo)
+        cairo_destroy(seat->cairo);
+      seat->cairo = NULL;
+      layer_destroy(seat->layer);
+    }
+
+    seat->layer = layer_new((output->snapshot->width + scale - 1) / scale, (output->snapshot->height + scale - 1) / scale);
+    seat->command.previewed = 0;
+    if(overlay)
+    {
+      overlay->layer = seat->layer;
+      overlay->scale = scale;
+      overlay->reset = true;
+    }
+  }
+
+  cairo_rectangle_int_t bounds;
+  if(!command_preview_bounds(&seat->command, &bounds))
+    return;
+
+  cairo_rectangle_int_downsample(&bounds, scale);
+  if(layer_reserve(seat->layer, &bounds))
+  {
+    if(seat->cairo)
+      cairo_destroy(seat->cairo);
+
+    seat->cairo = cairo_create(seat->layer->cairo_surface);
+    cairo_scale(seat->cairo, 1.0 / scale, 1.0 / scale);
+    command_setup(&seat->command, seat->cairo);
+  }
+
+  cairo_region_t *damage = seat->overlay ? seat->overlay->damage : seat->drawing_focus->damage;
+  command_preview(&seat->command, seat->cairo, damage);
+}
+
+static void update_seat_pointer(struct waydraw_seat *seat)
+{
+  struct waydraw *waydraw = seat->waydraw;
+
+  if(!seat->drawing_focus)
+  {
+    if(!waydraw->cursor_cache)
+      waydraw->cursor_cache = cursor_cache_new(waydraw->wl_shm);
+
+    struct cursor *cursor = cursor_cache_get(waydraw->cursor_cache, seat->color, seat->weight);
+    wl_surface_attach(seat->wl_pointer_surface, cursor->wl_buffer, 0, 0);
+    wl_surface_damage_buffer(seat->wl_pointer_surface, 0, 0, cursor->size, cursor->size);
+  }
+  else
+    wl_surface_attach(seat->wl_pointer_surface, NULL, 0, 0);
+
+  wl_surface_commit(seat->wl_pointer_surface);
+
+}
+
+static size_t memory_usage(struct waydraw *waydraw)
+{
+  struct canvas_stats canvas_stats;
+  canvas_get_stats(&canvas_stats);
+
+  size_t bytes = canvas_stats.bytes;
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+    if(output->snapshot)
+      bytes += output->snapshot->bytes;
+
+  return bytes;
+}
+
+static void enforce_memory_budget(struct waydraw *waydraw)
+{
+  if(!waydraw->memory_budget || memory_usage(waydraw) <= waydraw->memory_budget)
+    return;
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+    if(output->snapshot)
+      snapshot_compress(output->snapshot, HOT_HISTORY_NODES);
+
+  if(!waydraw->memory_limit)
+    return;
+
+  // Take turns between outputs so that one output does not lose all of its
+  // history just because another output has a long one.
+  bool pruned = true;
+  wl_list_for_each(output, &waydraw->outputs, link)
+    session_load_history(output->session, output->snapshot);
+
+  while(pruned && memory_usage(waydraw) > waydraw->memory_limit)
+  {
+    pruned = false;
+    wl_list_for_each(output, &waydraw->outputs, link)
+      if(output->snapshot)
+        pruned |= snapshot_prune(output->snapshot);
+  }
+}
+
+static void print_stats(struct waydraw *waydraw, FILE *file)
+{
+  unsigned index = 0;
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+  {
+    if(output->swapchain)
+      fprintf(file, "stats: output %u: %lu frames, %lu stalls waiting for buffer release, %u buffers\n",
+          index,
+          (unsigned long)output->swapchain->stats.frames,
+          (unsigned long)output->swapchain->stats.stalls,
+          output->swapchain->count);
+
+    if(output->preview_scale != 1)
+      fprintf(file, "stats: output %u: strokes in progress previewed at 1/%u resolution\n", index, output->preview_scale);
+
+    if(output->snapshot)
+      fprintf(file, "stats: output %u: %zu history nodes using %zu bytes excluding tiles\n",
+          index,
+          output->snapshot->count,
+          output->snapshot->bytes);
+
+    index += 1;
+  }
+
+  struct canvas_stats canvas_stats;
+  canvas_get_stats(&canvas_stats);
+
+  size_t compressed_tiles_bytes = canvas_stats.compressed_tiles * TILE_SIZE * TILE_SIZE * sizeof(uint32_t);
+  fprintf(file, "stats: memory: %zu bytes in total, %zu tiles of which %zu compressed with ratio %.2f and %zu mapped from session files\n",
+      memory_usage(waydraw),
+      canvas_stats.tiles,
+      canvas_stats.compressed_tiles,
+      canvas_stats.compressed_bytes ? (double)compressed_tiles_bytes / canvas_stats.compressed_bytes : 1.0,
+      canvas_stats.mapped_tiles);
+
+  fprintf(file, "stats: input: %lu pointer events in %lu pointer frames, %lu pointer frames coalesced into pending redraws\n",
+      (unsigned long)waydraw->input_stats.events,
+      (unsigned long)waydraw->input_stats.frames,
+      (unsigned long)waydraw->input_stats.coalesced);
+
+  if(waydraw->cursor_cache)
+    fprintf(file, "stats: cursors: %lu hits, %lu misses, %u cached in %zu bytes\n",
+        (unsigned long)waydraw->cursor_cache->stats.hits,
+        (unsigned long)waydraw->cursor_cache->stats.misses,
+        waydraw->cursor_cache->count,
+        waydraw->cursor_cache->size);
+
+  stats_dump(file);
+}
+
+// Apply a change to the history of an output, such as snapshot_undo(), once no
+// stroke is being committed on top of the current node anymore.
+static void change_history(struct waydraw_output *output, void (*change)(struct snapshot *snapshot))
+{
+  wait_commits(output);
+  session_load_history(output->session, output->snapshot);
+  change(output->snapshot);
+  session_save(output->session, output->snapshot);
+  damage_output_all(output);
+}
+
+// Carry out a command from the control socket and answer it. Commands act on
+// every output and every seat, since they do not come from any of them.
+static void handle_command(struct waydraw *waydraw, const struct control_message *message)
+{
+  enum control_status status = CONTROL_STATUS_OK;
+
+  struct waydraw_output *output;
+  struct waydraw_seat *seat;
+  switch(message->command)
+  {
+  case CONTROL_COMMAND_RESUME:
+    if(waydraw->hibernated)
+      resume(waydraw);
+    break;
+  case CONTROL_COMMAND_HIBERNATE:
+  case CONTROL_COMMAND_DETACH:
+    hibernate(waydraw, message->command == CONTROL_COMMAND_DETACH);
+    break;
+  case CONTROL_COMMAND_CLEAR:
+  case CONTROL_COMMAND_UNDO:
+  case CONTROL_COMMAND_REDO:
+    wl_list_for_each(output, &waydraw->outputs, link)
+      if(output->snapshot)
+        change_history(output,
+            message->command == CONTROL_COMMAND_CLEAR ? &snapshot_clear :
+            message->command == CONTROL_COMMAND_UNDO ? &snapshot_undo : &snapshot_redo);
+    break;
+  case CONTROL_COMMAND_COLOR:
+    for(int i=0; i<4; ++i)
+      if(!(message->color[i] >= 0.0 && message->color[i] <= 1.0))
+        status = CONTROL_STATUS_INVALID;
+
+    if(status != CONTROL_STATUS_OK)
+      break;
+
+    wl_list_for_each(seat, &waydraw->seats, link)
+    {
+      memcpy(seat->color, message->color, sizeof seat->color);
+      if(seat->pointer_focus && !waydraw->hibernated)
+        update_seat_pointer(seat);
+    }
+    break;
+  case CONTROL_COMMAND_WEIGHT:
+    if(!isfinite(message->weight) || message->weight > CONTROL_MAX_WEIGHT)
+    {
+      status = CONTROL_STATUS_INVALID;
+      break;
+    }
+
+    wl_list_for_each(seat, &waydraw->seats, link)
+      set_seat_weight(seat, message->weight);
+    break;
+  case CONTROL_COMMAND_STATS:
+    {
+      char *text;
+      size_t size;
+      FILE *file = open_memstream(&text, &size);
+      print_stats(waydraw, file);
+      fclose(file);
+
+      reply_command(status, text, size);
+      free(text);
+    }
+    return;
+  default:
+    status = CONTROL_STATUS_INVALID;
+    break;
+  }
+
+  reply_command(status, NULL, 0);
+}
+
+// Let input pass through to whatever is below until resumed, and with detach,
+// stop showing the canvas too. This returns right away, and waydraw keeps
+// answering the compositor in the meantime.
+static void hibernate(struct waydraw *waydraw, bool detach)
+{
+  struct wl_region *empty_region = wl_compositor_create_region(waydraw->wl_compositor);
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+  {
+    if(detach)
+    {
+      wl_surface_attach(output->wl_surface, NULL, 0, 0);
+      output->detached = true;
+    }
+
+    wl_surface_set_input_region(output->wl_surface, empty_region);
+    zwlr_layer_surface_v1_set_keyboard_interactivity(output->zwlr_layer_surface_v1, ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE);
+    wl_surface_commit(output->wl_surface);
+  }
+
+  wl_region_destroy(empty_region);
+  waydraw->hibernated = true;
+  waydraw->detached = detach;
+
+  release_memory(waydraw, detach);
+}
+
+// Hibernation might last for hours, so drop everything that can be recovered
+// later on. The current canvas of each output is kept as it is, unless it is
+// not shown anymore either, in which case it is decompressed again by the first
+// frame after resuming.
+static void release_memory(struct waydraw *waydraw, bool detach)
+{
+  wait_all_commits(waydraw);
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+  {
+    if(output->snapshot)
+    {
+      snapshot_compress(output->snapshot, 0);
+      if(detach)
+        canvas_compress(output->snapshot->canvas);
+    }
+
+    // The swapchain of the output is created again once it is configured.
+    if(detach && output->swapchain)
+    {
+      swapchain_destroy(output->swapchain);
+      output->swapchain = NULL;
+    }
+
+    struct waydraw_overlay *overlay;
+    wl_list_for_each(overlay, &output->overlays, link)
+      if(overlay->swapchain && !overlay->layer && !overlay->attached)
+      {
+        swapchain_destroy(overlay->swapchain);
+        overlay->swapchain = NULL;
+      }
+  }
+
+  // Cursors are not shown while input passes through.
+  if(waydraw->cursor_cache)
+  {
+    cursor_cache_destroy(waydraw->cursor_cache);
+    waydraw->cursor_cache = NULL;
+  }
+
+  layer_release_pool();
+
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+// A detached surface gets configured again once committed, and is only shown
+// again after that.
+static void resume(struct waydraw *waydraw)
+{
+  // Only outputs that are not shown take time to come back, so resuming is
+  // only timed if there are any.
+  bool detached = false;
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+  {
+    detached = detached || output->detached;
+    wl_surface_set_input_region(output->wl_surface, NULL);
+    zwlr_layer_surface_v1_set_keyboard_interactivity(output->zwlr_layer_surface_v1, ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_EXCLUSIVE);
+    wl_surface_commit(output->wl_surface);
+
+    // Nothing is going to configure it again.
+    if(output->hidden)
+    {
+      output->hidden = false;
+      show_output(output);
+    }
+  }
+
+  waydraw->hibernated = false;
+  waydraw->detached = false;
+  if(detached)
+  {
+    waydraw->resume_start = stats_now();
+    record_wakeup(waydraw);
+  }
+}
+
+// Record how long it took to resume, once no output is waiting to be shown
+// again.
+static void record_wakeup(struct waydraw *waydraw)
+{
+  if(!waydraw->resume_start)
+    return;
+
+  struct waydraw_output *output;
+  wl_list_for_each(output, &waydraw->outputs, link)
+    if(output->detached)
+      return;
+
+  stats_record_since(STATS_WAKEUP, waydraw->resume_start);
+  waydraw->resume_start = 0;
+}
+
+static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags, int32_t width, int32_t height, int32_t refresh)
+{
+  (void)wl_output;
+  (void)width;
+  (void)height;
+
+  // The refresh rate is in mHz.
+  struct waydraw_output *output = data;
+  if(flags & WL_OUTPUT_MODE_CURRENT)
+    output->refresh_interval = refresh > 0 ? 1000000000000 / refresh : 0;
+}
+
+static void output_name(void *data, struct wl_output *wl_output, const char *name)
+{
+  (void)wl_output;
+
+  struct waydraw_output *output = data;
+  trace_record(output->waydraw->trace, TRACE_EVENT_OUTPUT_NAME, output->index, name, strlen(name));
+
+  free(output->name);
+  output->name = strdup(name);
+}
+
+static void seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t capabilities)
+{
+  struct waydraw_seat *seat = data;
+  struct waydraw *waydraw = seat->waydraw;
+  trace_record(waydraw->trace, TRACE_EVENT_SEAT_CAPABILITIES, seat->index, capabilities);
+
+  if(seat->wl_keyboard)
+    wl_keyboard_destroy(seat->wl_keyboard);
+
+  if(seat->wl_pointer)
+    wl_pointer_destroy(seat->wl_pointer);
+
+  if(seat->wl_pointer_surface)
+    wl_surface_destroy(seat->wl_pointer_surface);
+
+  if(capabilities & WL_SEAT_CAPABILITY_KEYBOARD)
+  {
+    seat->wl_keyboard = wl_seat_get_keyboard(wl_seat);
+    wl_keyboard_add_listener(seat->wl_keyboard, &wl_keyboard_listener, seat);
+  }
+  else
+    seat->wl_keyboard = NULL;
+
+  if(capabilities & WL_SEAT_CAPABILITY_POINTER)
+  {
+    seat->wl_pointer = wl_seat_get_pointer(wl_seat);
+    wl_pointer_add_listener(seat->wl_pointer, &wl_pointer_listener, seat);
+    seat->wl_pointer_surface = wl_compositor_create_surface(waydraw->wl_compositor);
+  }
+  else
+  {
+    seat->wl_pointer = NULL;
+    seat->wl_pointer_surface = NULL;
+  }
+}
+
+static void keyboard_enter(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface, struct wl_array *keys)
+{
+  (void)wl_keyboard;
+  (void)serial;
+  (void)keys;
+
+  struct waydraw_seat *seat = data;
+  assert(seat->keyboard_focus == NULL);
+  seat->keyboard_focus = wl_surface_get_user_data(surface);
+  trace_record(seat->waydraw->trace, TRACE_EVENT_KEYBOARD_ENTER, seat->index, seat->keyboard_focus->index);
+}
+
+static void keyboard_leave(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface)
+{
+  (void)wl_keyboard;
+  (void)serial;
+
+  struct waydraw_seat *seat = data;
+  assert(seat->keyboard_focus == wl_surface_get_user_data(surface));
+  trace_record(seat->waydraw->trace, TRACE_EVENT_KEYBOARD_LEAVE, seat->index, seat->keyboard_focus->index);
+  seat->keyboard_focus = NULL;
+}
+
+static void handle_keymap(void *data, struct wl_keyboard *wl_keyboard, uint32_t format, int32_t fd, uint32_t size)
+{
+  (void)wl_keyboard;
+
+  struct waydraw_seat *seat = data;
+  struct waydraw *waydraw = seat->waydraw;
+
+  if(seat->xkb_state)
+    xkb_state_unref(seat->xkb_state);
+
+  assert(format == WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1);
+
+  char *map_shm = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map_shm == MAP_FAILED)
+  {
+    fprintf(stderr, "error: failed to mmap keymap file: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  trace_record(waydraw->trace, TRACE_EVENT_KEYMAP, seat->index, format, map_shm, (size_t)size);
+
+  struct xkb_keymap *xkb_keymap = xkb_keymap_new_from_string(
+      waydraw->xkb_context,
+      map_shm,
+      XKB_KEYMAP_FORMAT_TEXT_V1,
+      XKB_KEYMAP_COMPILE_NO_FLAGS);
+
+  if(!xkb_keymap)
+  {
+    fprintf(stderr, "error: failed to parse keymap file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  seat->xkb_state = xkb_state_new(xkb_keymap);
+  if(!seat->xkb_state)
+  {
+    fprintf(stderr, "error: failed to create xkb state from keymap\n");
+    exit(EXIT_FAILURE);
+  }
+
+  xkb_keymap_unref(xkb_keymap);
+  munmap(map_shm, size);
+  close(fd);
+}
+
+static void handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, uint32_t time, uint32_t key, uint32_t state)
+{
+  (void)wl_keyboard;
+  (void)serial;
+  (void)time;
+
+  struct waydraw_seat *seat = data;
+  struct waydraw_output *output = seat->keyboard_focus;
+  struct waydraw *waydraw = seat->waydraw;
+  assert(seat->xkb_state);
+  assert(output);
+
+  trace_record(waydraw->trace, TRACE_EVENT_KEY, seat->index, key, state);
+
+  if(state == WL_KEYBOARD_KEY_STATE_PRESSED)
   {
     xkb_keysym_t sym = xkb_state_key_get_one_sym(seat->xkb_state, key + 8);
     switch(sym)
@@ -549,29 +1755,25 @@ static void handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t ser
     case XKB_KEY_z:
       if(xkb_state_mod_name_is_active(seat->xkb_state, "Control", XKB_STATE_MODS_EFFECTIVE))
       {
-        snapshot_undo(output->snapshot);
-        update_output(output);
+        change_history(output, &snapshot_undo);
       }
       break;
     case XKB_KEY_Z:
       if(xkb_state_mod_name_is_active(seat->xkb_state, "Control", XKB_STATE_MODS_EFFECTIVE))
       {
-        snapshot_redo(output->snapshot);
-        update_output(output);
+        change_history(output, &snapshot_redo);
       }
       break;
     case XKB_KEY_x:
       if(xkb_state_mod_name_is_active(seat->xkb_state, "Control", XKB_STATE_MODS_EFFECTIVE))
       {
-        snapshot_earlier(output->snapshot);
-        update_output(output);
+        change_history(output, &snapshot_earlier);
       }
       break;
     case XKB_KEY_X:
       if(xkb_state_mod_name_is_active(seat->xkb_state, "Control", XKB_STATE_MODS_EFFECTIVE))
       {
-        snapshot_later(output->snapshot);
-        update_output(output);
+        change_history(output, &snapshot_later);
       }
       break;
     case XKB_KEY_b:
@@ -591,6 +1793,7 @@ static void handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t ser
         seat->color_index = COLOR_PALLETE_SIZE - 1;
       else
         seat->color_index -= 1;
+      memcpy(seat->color, COLOR_PALLETE[seat->color_index], sizeof seat->color);
       update_seat_pointer(seat);
       break;
     case XKB_KEY_Tab:
@@ -598,36 +1801,17 @@ static void handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t ser
         seat->color_index = 0;
       else
         seat->color_index += 1;
+      memcpy(seat->color, COLOR_PALLETE[seat->color_index], sizeof seat->color);
       update_seat_pointer(seat);
       break;
     case XKB_KEY_H:
     case XKB_KEY_h:
-      {
-        struct waydraw_output *output;
-        struct wl_region *empty_region = wl_compositor_create_region(waydraw->wl_compositor);
-
-        wl_list_for_each(output, &waydraw->outputs, link) {
-          if(sym == XKB_KEY_H)
-            wl_surface_attach(output->wl_surface, NULL, 0, 0);
-
-          wl_surface_set_input_region(output->wl_surface, empty_region);
-          zwlr_layer_surface_v1_set_keyboard_interactivity(output->zwlr_layer_surface_v1, ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE);
-          wl_surface_commit(output->wl_surface);
-        }
-
-        wl_region_destroy(empty_region);
-        wl_display_flush(waydraw->wl_display);
-
-        suspend();
-
-        wl_list_for_each(output, &waydraw->outputs, link) {
-          wl_surface_set_input_region(output->wl_surface, NULL);
-          zwlr_layer_surface_v1_set_keyboard_interactivity(output->zwlr_layer_surface_v1, ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_EXCLUSIVE);
-          wl_surface_commit(output->wl_surface);
-        }
-      }
+      hibernate(waydraw, sym == XKB_KEY_H);
       break;
     case XKB_KEY_q:
+      wait_all_commits(waydraw);
+      if(getenv("WAYDRAW_STATS"))
+        print_stats(waydraw, stderr);
       exit(EXIT_SUCCESS);
       break;
     }
@@ -641,6 +1825,7 @@ static void handle_modifiers(void *data, struct wl_keyboard *wl_keyboard, uint32
 
   struct waydraw_seat *seat = data;
   assert(seat->xkb_state);
+  trace_record(seat->waydraw->trace, TRACE_EVENT_MODIFIERS, seat->index, mods_depressed, mods_latched, mods_locked, group);
   xkb_state_update_mask(seat->xkb_state, mods_depressed, mods_latched, mods_locked, 0, 0, group);
 }
 
@@ -649,11 +1834,12 @@ static void pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t se
   struct waydraw_seat *seat = data;
   assert(seat->pointer_focus == NULL);
   seat->pointer_focus = wl_surface_get_user_data(surface);
+  trace_record(seat->waydraw->trace, TRACE_EVENT_POINTER_ENTER, seat->index, seat->pointer_focus->index, surface_x, surface_y);
 
   seat->x = wl_fixed_to_double(surface_x);
   seat->y = wl_fixed_to_double(surface_y);
 
-  int size = ceil(seat->weight);
+  int size = cursor_size(seat->weight);
   int hsize = round(size * 0.5);
 
   update_seat_pointer(seat);
@@ -667,136 +1853,340 @@ static void pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t se
 
   struct waydraw_seat *seat = data;
   assert(seat->pointer_focus == wl_surface_get_user_data(surface));
+  trace_record(seat->waydraw->trace, TRACE_EVENT_POINTER_LEAVE, seat->index, seat->pointer_focus->index);
   seat->pointer_focus = NULL;
 }
 
+// Pointer events are only recorded here and applied all at once on
+// wl_pointer.frame. Compositors that are too old to send wl_pointer.frame get
+// every event applied as it arrives.
+static void flush_pointer_frame(struct waydraw_seat *seat, struct wl_pointer *wl_pointer)
+{
+  seat->waydraw->input_stats.events += 1;
+  seat->pointer_frame.events += 1;
+  if(wl_pointer_get_version(wl_pointer) < WL_POINTER_FRAME_SINCE_VERSION)
+    apply_pointer_frame(seat);
+}
+
 static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y)
 {
-  (void)wl_pointer;
   (void)time;
 
   struct waydraw_seat *seat = data;
-  struct waydraw_output *output = seat->pointer_focus;
-  assert(output);
-
-  seat->x = wl_fixed_to_double(surface_x);
-  seat->y = wl_fixed_to_double(surface_y);
+  trace_record(seat->waydraw->trace, TRACE_EVENT_POINTER_MOTION, seat->index, surface_x, surface_y);
 
-  // Note: There is a bit of an out-of-sync problem that could happen but should
-  //       not matter. The cairo surface we draw on is from the current node we
-  //       push onto the snapshot tree. It could happen that the user undo when
-  //       we are drawing and the current node will change, in which case we
-  //       will be drawing to a surface that is no longer rendered. The call to
-  //       update_output only redraw the output by copying from the surface on
-  //       the current node on the snapshot tree, which we are not actually
-  //       drawing onto. We could technically try to work around that but there
-  //       is no need to.
-  if(seat->drawing_focus)
-  {
-    update_seat_preview(seat);
-    update_output(seat->drawing_focus);
-  }
+  seat->pointer_frame.motion = true;
+  seat->pointer_frame.x = wl_fixed_to_double(surface_x);
+  seat->pointer_frame.y = wl_fixed_to_double(surface_y);
+  flush_pointer_frame(seat, wl_pointer);
 }
 
 static void pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state)
 {
-  (void)wl_pointer;
   (void)serial;
   (void)time;
 
   struct waydraw_seat *seat = data;
+  trace_record(seat->waydraw->trace, TRACE_EVENT_POINTER_BUTTON, seat->index, button, state);
+
   if(button == BTN_LEFT)
-    switch(state)
-    {
-    case WL_POINTER_BUTTON_STATE_PRESSED:
-      // Do not allow drawing across outputs in a single stroke.
-      if(!seat->drawing_focus)
-      {
-        struct waydraw_output *output = seat->pointer_focus;
-        seat->drawing_focus = output;
+  {
+    uint32_t *pending = wl_array_add(&seat->pointer_frame.buttons, sizeof *pending);
+    *pending = state;
+  }
+  flush_pointer_frame(seat, wl_pointer);
+}
 
-        cairo_format_t format = cairo_image_surface_get_format(output->snapshot->current->cairo_surface);
-        int width = cairo_image_surface_get_width(output->snapshot->current->cairo_surface);
-        int height = cairo_image_surface_get_height(output->snapshot->current->cairo_surface);
+static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value)
+{
+  (void)time;
 
-        seat->surface = cairo_image_surface_create(format, width, height);
-        seat->cairo = cairo_create(seat->surface);
+  struct waydraw_seat *seat = data;
+  trace_record(seat->waydraw->trace, TRACE_EVENT_POINTER_AXIS, seat->index, axis, value);
 
-        cairo_set_source_rgba(seat->cairo,
-            COLOR_PALLETE[seat->color_index][0],
-            COLOR_PALLETE[seat->color_index][1],
-            COLOR_PALLETE[seat->color_index][2],
-            COLOR_PALLETE[seat->color_index][3]
-        );
+  if(axis == WL_POINTER_AXIS_VERTICAL_SCROLL)
+    seat->pointer_frame.axis += wl_fixed_to_double(value);
+  flush_pointer_frame(seat, wl_pointer);
+}
 
-        cairo_set_line_width(seat->cairo, seat->weight);
-        cairo_set_line_cap(seat->cairo, CAIRO_LINE_CAP_ROUND);
-        cairo_set_line_join(seat->cairo, CAIRO_LINE_JOIN_ROUND);
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer)
+{
+  (void)wl_pointer;
 
-        seat->committed_mode = seat->mode;
-        seat->saved_x = seat->x;
-        seat->saved_y = seat->y;
+  struct waydraw_seat *seat = data;
+  trace_record(seat->waydraw->trace, TRACE_EVENT_POINTER_FRAME, seat->index);
+  apply_pointer_frame(seat);
+}
 
-        update_seat_preview(seat);
-        update_seat_pointer(seat);
-        update_output(output);
-      }
-      break;
-    case WL_POINTER_BUTTON_STATE_RELEASED:
-      if(seat->drawing_focus)
-      {
-        struct waydraw_output *output = seat->drawing_focus;
-        seat->drawing_focus = NULL;
+static void apply_pointer_frame(struct waydraw_seat *seat)
+{
+  struct waydraw *waydraw = seat->waydraw;
+  struct waydraw_pointer_frame *frame = &seat->pointer_frame;
 
-        cairo_surface_t *new_surface = cairo_image_surface_clone(output->snapshot->current->cairo_surface);
-        cairo_t *cairo = cairo_create(new_surface);
+  // Find out if the output we are drawing on already has a redraw pending, in
+  // which case this frame is going to be folded into it.
+  struct waydraw_output *output = seat->drawing_focus ? seat->drawing_focus : seat->pointer_focus;
+  bool pending = output && output->frame_callback && (!cairo_region_is_empty(output->damage) || overlays_pending(output));
 
-        cairo_set_source_surface(cairo, seat->surface, 0.0, 0.0);
-        cairo_paint(cairo);
+  if(frame->motion)
+    apply_pointer_motion(seat);
 
-        cairo_surface_destroy(seat->surface);
-        cairo_destroy(seat->cairo);
+  uint32_t *state;
+  wl_array_for_each(state, &frame->buttons)
+    apply_pointer_button(seat, *state);
 
-        snapshot_push(output->snapshot, new_surface);
-        update_seat_pointer(seat);
-        update_output(output);
-      }
-      break;
-    }
+  if(frame->axis != 0.0)
+    apply_pointer_axis(seat, frame->axis);
+
+  waydraw->input_stats.frames += 1;
+  if(pending)
+    waydraw->input_stats.coalesced += 1;
+  stats_record(STATS_EVENTS_PER_FRAME, frame->events);
+
+  frame->motion = false;
+  frame->buttons.size = 0;
+  frame->axis = 0.0;
+  frame->events = 0;
 }
 
-static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value)
+static void apply_pointer_motion(struct waydraw_seat *seat)
 {
-  (void)wl_pointer;
-  (void)time;
+  struct waydraw_output *output = seat->pointer_focus;
+  if(!output)
+    return;
 
-  struct waydraw_seat *seat = data;
-  if(axis == WL_POINTER_AXIS_VERTICAL_SCROLL)
+  seat->x = seat->pointer_frame.x;
+  seat->y = seat->pointer_frame.y;
+
+  // The seat layer is composited onto whichever node is current once the
+  // stroke is finished, so undo/redo in the middle of a stroke is fine.
+  if(seat->drawing_focus)
+    update_seat_preview(seat);
+}
+
+static void apply_pointer_button(struct waydraw_seat *seat, uint32_t state)
+{
+  switch(state)
   {
-    int old_size = ceil(seat->weight);
-    int old_hsize = round(old_size * 0.5);
+  case WL_POINTER_BUTTON_STATE_PRESSED:
+    // Do not allow drawing across outputs in a single stroke.
+    if(!seat->drawing_focus && seat->pointer_focus)
+    {
+      struct waydraw_output *output = seat->pointer_focus;
+      seat->drawing_focus = output;
 
-    seat->weight += wl_fixed_to_double(value) * SCROLL_SENSITIVITY;
-    if(seat->weight < MIN_DRAW_RADIUS)
-      seat->weight = MIN_DRAW_RADIUS;
+      // The layer is created once the stroke gets previewed, and grows to
+      // cover it.
+      command_init(&seat->command, seat->mode, seat->color, seat->weight);
+      seat->command.smoothing = seat->waydraw->smoothing;
+      filter_init(&seat->filter);
 
-    int size = ceil(seat->weight);
-    int hsize = round(size * 0.5);
+      if(seat->waydraw->wl_subcompositor)
+        seat->overlay = get_overlay(output, seat);
 
-    update_seat_pointer(seat);
-    wl_surface_offset(seat->wl_pointer_surface, old_hsize - hsize, old_hsize - hsize);
+      update_seat_preview(seat);
+      update_seat_pointer(seat);
+    }
+    break;
+  case WL_POINTER_BUTTON_STATE_RELEASED:
+    if(seat->drawing_focus)
+    {
+      filter_flush(&seat->filter, &seat->command);
+      command_finish(&seat->command);
+      draw_seat_preview(seat);
+
+      commit_seat(seat);
+      seat->drawing_focus = NULL;
+      update_seat_pointer(seat);
+    }
+    break;
   }
 }
 
+// Change the weight of the brush, and move the cursor so that it stays centered
+// on the pointer if it is shown.
+static void set_seat_weight(struct waydraw_seat *seat, double weight)
+{
+  int old_size = cursor_size(seat->weight);
+  int old_hsize = round(old_size * 0.5);
+
+  seat->weight = weight;
+  if(seat->weight < MIN_DRAW_RADIUS)
+    seat->weight = MIN_DRAW_RADIUS;
+  if(seat->weight > CONTROL_MAX_WEIGHT)
+    seat->weight = CONTROL_MAX_WEIGHT;
+
+  if(!seat->pointer_focus || seat->waydraw->hibernated)
+    return;
+
+  int size = cursor_size(seat->weight);
+  int hsize = round(size * 0.5);
+
+  update_seat_pointer(seat);
+  wl_surface_offset(seat->wl_pointer_surface, old_hsize - hsize, old_hsize - hsize);
+}
+
+static void apply_pointer_axis(struct waydraw_seat *seat, double value)
+{
+  set_seat_weight(seat, seat->weight + value * SCROLL_SENSITIVITY);
+}
+
 static void configure_surface(void *data, struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1, uint32_t serial, uint32_t width, uint32_t height)
 {
   zwlr_layer_surface_v1_ack_configure(zwlr_layer_surface_v1, serial);
 
   struct waydraw_output *output = data;
+  struct waydraw *waydraw = output->waydraw;
+  trace_record(waydraw->trace, TRACE_EVENT_CONFIGURE, output->index, width, height);
+
+  // A frame callback requested before the surface got unmapped, for example
+  // by hibernation, is never going to be done.
+  if(output->frame_callback)
+  {
+    wl_callback_destroy(output->frame_callback);
+    output->frame_callback = NULL;
+  }
+
   if(!output->snapshot)
+  {
     output->snapshot = snapshot_new(width, height);
+    output->snapshot->keyframe_interval = waydraw->keyframe_interval;
+    if(waydraw->session_directory)
+      open_output_session(output);
+  }
 
-  update_output(output);
+  // Attaching a buffer would show the output, which has to wait for resuming
+  // while hibernated with H.
+  if(waydraw->hibernated && waydraw->detached)
+  {
+    output->detached = true;
+    output->hidden = true;
+    return;
+  }
+
+  show_output(output);
+}
+
+static void show_output(struct waydraw_output *output)
+{
+  output->detached = false;
+
+  if(!output->swapchain)
+    output->swapchain = swapchain_new(output->waydraw->wl_shm, output->snapshot->width, output->snapshot->height);
+
+  damage_output_all(output);
+}
+
+// Dispatch events until the connection to the compositor is lost, and render
+// outputs in between. Statistics are printed on SIGUSR1, and commands from the
+// control socket, which is also what resumes from hibernation, are answered as
+// they come. This only ever blocks in poll(), hibernated or not.
+static void run(struct waydraw *waydraw)
+{
+  struct wl_display *wl_display = waydraw->wl_display;
+
+  int signal_fd = signalfd(-1, &waydraw->signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if(signal_fd < 0)
+  {
+    fprintf(stderr, "error: failed to create signalfd: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  struct pollfd fds[] = {
+    { .fd = wl_display_get_fd(wl_display), .events = POLLIN },
+    { .fd = signal_fd, .events = POLLIN },
+    { .fd = control_fd(), .events = POLLIN },
+    { .fd = pool_fd(waydraw->pool), .events = POLLIN },
+  };
+
+  for(;;)
+  {
+    while(wl_display_prepare_read(wl_display) != 0)
+      if(wl_display_dispatch_pending(wl_display) < 0)
+        goto out;
+
+    update_outputs(waydraw);
+
+    struct waydraw_output *output;
+    wl_list_for_each(output, &waydraw->outputs, link)
+      apply_commits(output);
+
+    if(wl_display_flush(wl_display) < 0 && errno != EAGAIN)
+    {
+      wl_display_cancel_read(wl_display);
+      goto out;
+    }
+
+    if(poll(fds, sizeof fds / sizeof fds[0], -1) < 0)
+    {
+      wl_display_cancel_read(wl_display);
+      if(errno == EINTR)
+        continue;
+
+      fprintf(stderr, "error: failed to poll: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    if(fds[0].revents)
+    {
+      if(wl_display_read_events(wl_display) < 0)
+        goto out;
+    }
+    else
+      wl_display_cancel_read(wl_display);
+
+    if(wl_display_dispatch_pending(wl_display) < 0)
+      goto out;
+
+    struct signalfd_siginfo info;
+    if(fds[1].revents & POLLIN)
+      while(read(signal_fd, &info, sizeof info) == sizeof info)
+        print_stats(waydraw, stderr);
+
+    struct control_message message;
+    if(fds[2].revents & POLLIN)
+      while(read_command(&message))
+        handle_command(waydraw, &message);
+
+    if(fds[3].revents & POLLIN)
+      pool_dispatch(waydraw->pool, false);
+  }
+
+out:
+  wait_all_commits(waydraw);
+  close(signal_fd);
+}
+
+// Parse a non-negative number from an environment variable, with an optional
+// K, M or G suffix.
+static size_t getenv_number(const char *name, size_t value)
+{
+  char *string = getenv(name);
+  if(!string)
+    return value;
+
+  char *end;
+  errno = 0;
+  unsigned long long number = strtoull(string, &end, 10);
+  if(errno || end == string)
+    goto invalid;
+
+  size_t multiplier = 1;
+  switch(*end)
+  {
+  case 'G': multiplier *= 1024; // fallthrough
+  case 'M': multiplier *= 1024; // fallthrough
+  case 'K': multiplier *= 1024; ++end; break;
+  }
+
+  if(*end != '\0' || number > SIZE_MAX / multiplier)
+    goto invalid;
+
+  return number * multiplier;
+
+invalid:
+  fprintf(stderr, "error: invalid value for %s: %s\n", name, string);
+  exit(EXIT_FAILURE);
 }
 
 int main(void)
@@ -805,6 +2195,61 @@ int main(void)
 
   struct waydraw waydraw = {0};
 
+  waydraw.keyframe_interval = getenv_number("WAYDRAW_KEYFRAME_INTERVAL", SNAPSHOT_DEFAULT_KEYFRAME_INTERVAL);
+  if(waydraw.keyframe_interval == 0)
+  {
+    fprintf(stderr, "error: keyframe interval must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+
+  static const char *const smoothings[COMMAND_SMOOTHING_COUNT] = {
+    [COMMAND_SMOOTHING_NONE] = "none",
+    [COMMAND_SMOOTHING_QUADRATIC] = "quadratic",
+    [COMMAND_SMOOTHING_CATMULL_ROM] = "catmull-rom",
+  };
+
+  const char *smoothing = getenv("WAYDRAW_SMOOTHING");
+  if(smoothing)
+  {
+    while(waydraw.smoothing < COMMAND_SMOOTHING_COUNT && strcmp(smoothing, smoothings[waydraw.smoothing]) != 0)
+      waydraw.smoothing += 1;
+
+    if(waydraw.smoothing == COMMAND_SMOOTHING_COUNT)
+    {
+      fprintf(stderr, "error: unsupported smoothing %s\n", smoothing);
+      fprintf(stderr, "note: supported smoothings are none, quadratic and catmull-rom\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  waydraw.memory_budget = getenv_number("WAYDRAW_MEMORY_BUDGET", 0);
+  waydraw.memory_limit = getenv_number("WAYDRAW_MEMORY_LIMIT", 0);
+  if(waydraw.memory_limit && !waydraw.memory_budget)
+    waydraw.memory_budget = waydraw.memory_limit;
+
+  waydraw.session_directory = getenv("WAYDRAW_SESSION");
+
+  const char *blend = getenv("WAYDRAW_BLEND");
+  if(blend && !blend_select(blend))
+  {
+    fprintf(stderr, "error: unsupported compositing kernels %s\n", blend);
+    fprintf(stderr, "note: supported kernels are avx2, sse2, neon and generic, subject to the CPU\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Workers inherit the signal mask, and have to be created after it is set, or
+  // SIGUSR1 could be delivered to one of them and kill the whole process.
+  sigemptyset(&waydraw.signals);
+  sigaddset(&waydraw.signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &waydraw.signals, NULL);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  waydraw.pool = pool_new(getenv_number("WAYDRAW_THREADS", cpus > 0 ? cpus : 1));
+
+  const char *record = getenv("WAYDRAW_RECORD");
+  if(record)
+    waydraw.trace = trace_create(record);
+
   waydraw.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
   if(!waydraw.xkb_context)
   {
@@ -831,9 +2276,17 @@ int main(void)
   wl_list_init(&waydraw.outputs);
   wl_list_init(&waydraw.seats);
 
-  while(wl_display_dispatch(waydraw.wl_display))
-    ;
+  run(&waydraw);
+
+  if(getenv("WAYDRAW_STATS"))
+    print_stats(&waydraw, stderr);
+  if(waydraw.trace)
+    trace_close(waydraw.trace);
+
+  if(waydraw.cursor_cache)
+    cursor_cache_destroy(waydraw.cursor_cache);
 
+  pool_destroy(waydraw.pool);
   wl_display_disconnect(waydraw.wl_display);
   return 0;
 }